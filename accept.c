@@ -0,0 +1,100 @@
+#include "accept.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/* Connections taken per wakeup, the rest wait for the next
+ * one so a connect storm doesn't starve the peers we already have */
+#define ACCEPT_BATCH_MAX 64
+
+/* How long to stop accepting when we are out of fds. The socket stays
+ * readable meanwhile, so polling it would only spin. */
+#define ACCEPT_RETRY_USEC (USEC_PER_SEC / 10)
+
+static int acceptor_retry_cb(sd_event_source *s, uint64_t usec, void *userdata) {
+        Acceptor *a = userdata;
+
+        a->retry_timer = sd_event_source_disable_unref(a->retry_timer);
+        return sd_event_source_set_enabled(a->source, SD_EVENT_ON);
+}
+
+static int acceptor_back_off(Acceptor *a) {
+        int r;
+
+        r = sd_event_source_set_enabled(a->source, SD_EVENT_OFF);
+        if (r < 0)
+                return r;
+
+        if (a->retry_timer)
+                return 0;
+
+        return sd_event_add_time_relative(a->event, &a->retry_timer, CLOCK_MONOTONIC,
+                                          ACCEPT_RETRY_USEC, 0, acceptor_retry_cb, a);
+}
+
+static void acceptor_deliver(Acceptor *a, int fd) {
+        a->n_accepted++;
+        a->callback(fd, a->userdata);
+}
+
+static int epoll_accept_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        Acceptor *a = userdata;
+        int i, nfd;
+
+        a->n_wakeups++;
+
+        for (i = 0; i < ACCEPT_BATCH_MAX; i++) {
+                a->n_syscalls++;
+                nfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+                if (nfd < 0) {
+                        if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK)
+                                return 0;
+                        else if (errno == EMFILE || errno == ENFILE ||
+                                 errno == ENOBUFS || errno == ENOMEM) {
+                                fprintf(stderr, "Failed to accept, retrying later: %m\n");
+                                return acceptor_back_off(a);
+                        } else if (errno == ECONNABORTED)
+                                continue;
+                        else {
+                                int errsv = errno;
+                                fprintf(stderr, "Failed to accept: %m\n");
+                                return -errsv;
+                        }
+                }
+
+                acceptor_deliver(a, nfd);
+        }
+
+        return 0;
+}
+
+static int acceptor_start_epoll(Acceptor *a) {
+        int r;
+
+        r = sd_event_add_io(a->event, &a->source, a->listen_fd, EPOLLIN,
+                            epoll_accept_handler, a);
+        if (r < 0) {
+                fprintf(stderr, "Failed to add io event: %s\n", strerror(-r));
+                return r;
+        }
+
+        (void) sd_event_source_set_description(a->source, "master-socket");
+        return 0;
+}
+
+int acceptor_start(Acceptor *a, sd_event *event, int listen_fd,
+                   accept_callback callback, void *userdata) {
+        a->event = sd_event_ref(event);
+        a->listen_fd = listen_fd;
+        a->callback = callback;
+        a->userdata = userdata;
+
+        return acceptor_start_epoll(a);
+}
+
+void acceptor_stop(Acceptor *a) {
+        a->source = sd_event_source_disable_unref(a->source);
+        a->retry_timer = sd_event_source_disable_unref(a->retry_timer);
+        a->event = sd_event_unref(a->event);
+}
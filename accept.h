@@ -0,0 +1,27 @@
+#pragma once
+
+#include "orch.h"
+
+typedef struct Acceptor Acceptor;
+
+/* Gets each accepted connection, owns fd from then on */
+typedef void (*accept_callback)(int fd, void *userdata);
+
+/* Accepts connections on a listening socket from the event loop, a
+ * batch per wakeup. The counters show how well the batching works. */
+struct Acceptor {
+        int listen_fd;
+        accept_callback callback;
+        void *userdata;
+        sd_event *event;
+        sd_event_source *source;
+        sd_event_source *retry_timer;   /* set while out of fds */
+
+        uint64_t n_wakeups;      /* times the event loop called us */
+        uint64_t n_syscalls;     /* accept4() calls */
+        uint64_t n_accepted;
+};
+
+extern int acceptor_start(Acceptor *a, sd_event *event, int listen_fd,
+                          accept_callback callback, void *userdata);
+extern void acceptor_stop(Acceptor *a);
@@ -0,0 +1,401 @@
+#include "orch.h"
+#include "types.h"
+#include "accept.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+/* Measures the node event stream over a peer connection set up like the
+ * one between orch-node and orch, with one JobRemoved signal per job and
+ * with bursts batched into JobsRemoved. Then measures how orch accepts
+ * bursts of node connections. */
+
+/* Clients connecting at once in the accept benchmark */
+#define ACCEPT_BENCH_BURST 64
+
+typedef struct {
+        uint64_t n_signals;
+        uint64_t n_events;
+        bool failed;
+} Receiver;
+
+static uint64_t now_nsec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int match_job_removed(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        Receiver *receiver = userdata;
+        const char *job_path, *result;
+        uint32_t id;
+        int r;
+
+        r = sd_bus_message_read(m, "uos", &id, &job_path, &result);
+        if (r < 0)
+                receiver->failed = true;
+
+        receiver->n_events++;
+        receiver->n_signals++;
+        return 0;
+}
+
+static int match_jobs_removed(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        Receiver *receiver = userdata;
+        const char *job_path, *result;
+        uint32_t id;
+        int r;
+
+        r = sd_bus_message_enter_container(m, 'a', "(uos)");
+        while (r >= 0 && (r = sd_bus_message_read(m, "(uos)", &id, &job_path, &result)) > 0)
+                receiver->n_events++;
+        if (r < 0)
+                receiver->failed = true;
+
+        receiver->n_signals++;
+        return 0;
+}
+
+static int open_peers(sd_bus **ret_node, sd_bus **ret_orch) {
+        _cleanup_sd_bus_ sd_bus *node = NULL, *orch = NULL;
+        sd_id128_t id;
+        int sv[2];
+        int r;
+
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0)
+                return -errno;
+
+        r = sd_bus_new(&orch);
+        if (r >= 0)
+                r = sd_bus_set_fd(orch, sv[0], sv[0]);
+        if (r >= 0)
+                r = sd_id128_randomize(&id);
+        if (r >= 0)
+                r = sd_bus_set_server(orch, 1, id);
+        if (r >= 0)
+                r = sd_bus_set_anonymous(orch, true);
+        if (r >= 0)
+                r = sd_bus_set_sender(orch, ORCHESTRATOR_BUS_NAME);
+        if (r >= 0)
+                r = sd_bus_start(orch);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_new(&node);
+        if (r >= 0)
+                r = sd_bus_set_fd(node, sv[1], sv[1]);
+        if (r >= 0)
+                r = sd_bus_start(node);
+        if (r < 0)
+                return r;
+
+        *ret_node = steal_pointer(&node);
+        *ret_orch = steal_pointer(&orch);
+        return 0;
+}
+
+/* Runs both ends until the receiver has seen n_events */
+static int pump(sd_bus *node, sd_bus *orch, Receiver *receiver, uint64_t n_events) {
+        int r;
+
+        while (receiver->n_events < n_events) {
+                bool progress = false;
+
+                r = sd_bus_process(node, NULL);
+                if (r < 0)
+                        return r;
+                progress = progress || r > 0;
+
+                r = sd_bus_process(orch, NULL);
+                if (r < 0)
+                        return r;
+                progress = progress || r > 0;
+
+                if (!progress) {
+                        r = sd_bus_wait(orch, 1000);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        return 0;
+}
+
+/* Sends a burst of batch_size job removals, as the node would with or
+ * without NODE_FEATURE_JOBS_REMOVED */
+static int send_burst(Manager *manager, bool batched, uint32_t batch_size, uint32_t *next_id) {
+        _cleanup_free_ char *job_path = NULL;
+        uint32_t i;
+        int r;
+
+        if (!batched) {
+                for (i = 0; i < batch_size; i++) {
+                        ++*next_id;
+                        free(job_path);
+                        if (asprintf(&job_path, "%s/%u", NODE_PEER_JOBS_OBJECT_PATH_PREFIX, *next_id) < 0)
+                                return -ENOMEM;
+
+                        r = sd_bus_emit_signal(manager->bus, manager->manager_path, manager->manager_iface,
+                                               "JobRemoved", "uos", *next_id, job_path,
+                                               job_result_to_string(JOB_DONE));
+                        if (r < 0)
+                                return r;
+                }
+                return 0;
+        }
+
+        /* Queued as jobs finish, the flush goes out once the event loop
+         * gets to it */
+        for (i = 0; i < batch_size; i++) {
+                r = manager_queue_job_removed(manager, ++*next_id, JOB_DONE);
+                if (r < 0)
+                        return r;
+        }
+
+        return sd_event_run(manager->event, 0);
+}
+
+static int bench(const char *name, bool batched, uint32_t batch_size, uint64_t n_bursts) {
+        _cleanup_sd_bus_ sd_bus *node = NULL, *orch = NULL;
+        Manager manager = {
+                .job_path_prefix = NODE_PEER_JOBS_OBJECT_PATH_PREFIX,
+                .manager_path = NODE_PEER_OBJECT_PATH,
+                .manager_iface = NODE_IFACE,
+                .batch_job_removed = batched,
+        };
+        Receiver receiver = {};
+        uint32_t next_id = 0;
+        uint64_t i, start, elapsed;
+        int bytes = 0;
+        int r;
+
+        r = open_peers(&node, &orch);
+        if (r < 0) {
+                fprintf(stderr, "Failed to connect peers: %s\n", strerror(-r));
+                return r;
+        }
+        manager.bus = node;
+
+        r = sd_bus_match_signal(orch, NULL, NULL, NODE_PEER_OBJECT_PATH, NODE_IFACE,
+                                "JobRemoved", match_job_removed, &receiver);
+        if (r >= 0)
+                r = sd_bus_match_signal(orch, NULL, NULL, NODE_PEER_OBJECT_PATH, NODE_IFACE,
+                                        "JobsRemoved", match_jobs_removed, &receiver);
+        if (r < 0) {
+                fprintf(stderr, "Failed to add matches: %s\n", strerror(-r));
+                return r;
+        }
+
+        r = sd_event_new(&manager.event);
+        if (r < 0) {
+                fprintf(stderr, "Failed to create event loop: %s\n", strerror(-r));
+                return r;
+        }
+
+        /* One burst to get through authentication, which needs both
+         * ends running, then one to see the size on the wire before the
+         * receiver reads it */
+        r = send_burst(&manager, batched, batch_size, &next_id);
+        if (r >= 0)
+                r = pump(node, orch, &receiver, next_id);
+        if (r < 0)
+                goto finish;
+
+        r = send_burst(&manager, batched, batch_size, &next_id);
+        if (r >= 0)
+                r = sd_bus_flush(node);
+        if (r >= 0 && ioctl(sd_bus_get_fd(orch), FIONREAD, &bytes) < 0)
+                r = -errno;
+        if (r >= 0)
+                r = pump(node, orch, &receiver, next_id);
+        if (r < 0)
+                goto finish;
+
+        receiver.n_signals = 0;
+        start = now_nsec();
+        for (i = 0; i < n_bursts; i++) {
+                r = send_burst(&manager, batched, batch_size, &next_id);
+                if (r >= 0)
+                        r = pump(node, orch, &receiver, next_id);
+                if (r < 0)
+                        goto finish;
+        }
+        elapsed = now_nsec() - start;
+
+        if (receiver.failed || receiver.n_events != next_id) {
+                fprintf(stderr, "%s: receiver got %" PRIu64 " of %" PRIu32 " removals\n",
+                        name, receiver.n_events, next_id);
+                r = -EBADMSG;
+                goto finish;
+        }
+
+        printf("%-12s %10.0f removals/s %8.1f bytes/removal %6.1f signals/burst\n",
+               name,
+               n_bursts * batch_size * 1e9 / elapsed,
+               (double) bytes / batch_size,
+               (double) receiver.n_signals / n_bursts);
+
+finish:
+        manager_clear_job_removed(&manager);
+        free(manager.job_removed_batch);
+        sd_event_source_unref(manager.job_removed_flush_source);
+        sd_event_unref(manager.event);
+        if (r < 0)
+                fprintf(stderr, "%s: %s\n", name, strerror(-r));
+        return r;
+}
+
+static void bench_accept_cb(int fd, void *userdata) {
+        uint64_t *n_accepted = userdata;
+
+        close(fd);
+        ++*n_accepted;
+}
+
+static int open_listener(struct sockaddr_in *addr) {
+        socklen_t addr_len = sizeof(*addr);
+        int fd;
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (fd < 0)
+                return -errno;
+
+        memset(addr, 0, sizeof(*addr));
+        addr->sin_family = AF_INET;
+        addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr *) addr, sizeof(*addr)) < 0 ||
+            listen(fd, SOMAXCONN) < 0 ||
+            getsockname(fd, (struct sockaddr *) addr, &addr_len) < 0) {
+                int errsv = errno;
+                close(fd);
+                return -errsv;
+        }
+
+        return fd;
+}
+
+static int bench_accept(uint64_t n_connections) {
+        _cleanup_sd_event_ sd_event *event = NULL;
+        _cleanup_fd_ int listen_fd = -1;
+        struct sockaddr_in addr;
+        Acceptor acceptor = {};
+        uint64_t n_connected = 0, n_accepted = 0, start, elapsed;
+        int clients[ACCEPT_BENCH_BURST];
+        int i, n = 0, r;
+
+        listen_fd = open_listener(&addr);
+        if (listen_fd < 0) {
+                fprintf(stderr, "Failed to listen: %s\n", strerror(-listen_fd));
+                return listen_fd;
+        }
+
+        r = sd_event_new(&event);
+        if (r < 0)
+                return r;
+
+        r = acceptor_start(&acceptor, event, listen_fd, bench_accept_cb, &n_accepted);
+        if (r < 0)
+                return r;
+
+        start = now_nsec();
+        while (n_connected < n_connections) {
+                for (n = 0; n < ACCEPT_BENCH_BURST && n_connected < n_connections; n++, n_connected++) {
+                        clients[n] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+                        if (clients[n] < 0 ||
+                            (connect(clients[n], (struct sockaddr *) &addr, sizeof(addr)) < 0 &&
+                             errno != EINPROGRESS)) {
+                                r = -errno;
+                                if (clients[n] >= 0)
+                                        close(clients[n]);
+                                goto finish;
+                        }
+                }
+
+                while (n_accepted < n_connected) {
+                        r = sd_event_run(event, UINT64_MAX);
+                        if (r < 0)
+                                goto finish;
+                }
+
+                for (i = 0; i < n; i++)
+                        close(clients[i]);
+                n = 0;
+        }
+        elapsed = now_nsec() - start;
+
+        printf("%-12s %8.0f connections/s %6.2f wakeups/connection %6.2f syscalls/connection\n",
+               "accept",
+               n_accepted * 1e9 / elapsed,
+               (double) acceptor.n_wakeups / n_accepted,
+               (double) acceptor.n_syscalls / n_accepted);
+        r = 0;
+
+finish:
+        for (i = 0; i < n; i++)
+                close(clients[i]);
+        acceptor_stop(&acceptor);
+        if (r < 0)
+                fprintf(stderr, "accept: %s\n", strerror(-r));
+        return r;
+}
+
+static const struct option options[] = {
+        { "burst", required_argument, NULL, 'b' },
+        { "bursts", required_argument, NULL, 'n' },
+        { "connections", required_argument, NULL, 'c' },
+        { "help", no_argument, NULL, 'h' },
+        {}
+};
+
+static void usage(const char *argv0) {
+        printf("Usage: %s [OPTIONS]\n"
+               "  -b, --burst=N            Jobs removed at once (default 16)\n"
+               "  -n, --bursts=N           Bursts to send each way (default 10000)\n"
+               "  -c, --connections=N      Connections to accept (default 10000)\n"
+               "  -h, --help               Show this help\n",
+               argv0);
+}
+
+int main(int argc, char *argv[]) {
+        uint32_t batch_size = 16;
+        uint64_t n_bursts = 10000;
+        uint64_t n_connections = 10000;
+        int c;
+
+        while ((c = getopt_long(argc, argv, "b:n:c:h", options, NULL)) >= 0) {
+                switch (c) {
+                case 'b':
+                        batch_size = strtoul(optarg, NULL, 10);
+                        break;
+                case 'n':
+                        n_bursts = strtoull(optarg, NULL, 10);
+                        break;
+                case 'c':
+                        n_connections = strtoull(optarg, NULL, 10);
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (batch_size == 0 || n_bursts == 0 || n_connections == 0) {
+                fprintf(stderr, "Burst size and numbers of bursts and connections must be positive\n");
+                return EXIT_FAILURE;
+        }
+
+        if (bench("JobRemoved", false, batch_size, n_bursts) < 0 ||
+            bench("JobsRemoved", true, batch_size, n_bursts) < 0 ||
+            bench_accept(n_connections) < 0)
+                return EXIT_FAILURE;
+
+        return EXIT_SUCCESS;
+}
@@ -58,15 +58,93 @@ static int match_job_removed(sd_bus_message *m, void *userdata, sd_bus_error *er
         return 0;
 }
 
+static uint32_t job_id_from_path(const char *job_path) {
+        const char *slash = strrchr(job_path, '/');
+
+        return slash ? strtoul(slash + 1, NULL, 10) : 0;
+}
+
+/* Returns 1 and the result (owned by *reply) if the job has finished, 0 otherwise */
+static int get_job_result(sd_bus *bus, uint32_t id, sd_bus_message **reply, const char **result_out) {
+        const char *type;
+        uint64_t finished;
+        int r;
+
+        r = sd_bus_call_method(bus,
+                               ORCHESTRATOR_BUS_NAME,
+                               ORCHESTRATOR_OBJECT_PATH,
+                               ORCHESTRATOR_IFACE,
+                               "GetJobResult",
+                               NULL,
+                               reply,
+                               "u",
+                               id);
+        if (r < 0)
+                return 0;
+
+        r = sd_bus_message_read(*reply, "sst", &type, result_out, &finished);
+        if (r < 0)
+                return 0;
+
+        return 1;
+}
+
+static int match_node_straggling(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        const char *job_path;
+        const char *node;
+        uint32_t id, elapsed, median;
+        int r;
+
+        r = sd_bus_message_read(m, "uosuu", &id, &job_path, &node, &elapsed, &median);
+        if (r < 0)
+                return 0;
+
+        if (waiting_for_job != NULL && strcmp(waiting_for_job, job_path) == 0)
+                printf("Node '%s' is straggling: %u ms, median is %u ms\n", node, elapsed, median);
+
+        return 0;
+}
+
+/* Waits for a fleet job and prints its result */
+static int wait_for_fleet_job(sd_bus *bus, const char *name, const char *job_path) {
+        _cleanup_sd_bus_message_ sd_bus_message *job_result = NULL;
+        _cleanup_sd_bus_message_ sd_bus_message *finished = NULL;
+        const char *result;
+        uint32_t id;
+        int r;
+
+        printf("Started %s operation\n", name);
+
+        /* A reused idempotency key may return a job that already finished */
+        r = get_job_result(bus, job_id_from_path(job_path), &finished, &result);
+        if (r > 0) {
+                printf("%s result: %s\n", name, result);
+                return 0;
+        }
+
+        job_result = wait_for_job(bus, job_path);
+        if (job_result == NULL) {
+                return -EIO;
+        }
+
+        r = sd_bus_message_read(job_result, "uos", &id, &job_path, &result);
+        if (r < 0) {
+                fprintf(stderr, "Can't parse job result\n");
+                return 0;
+        }
+
+        printf("%s result: %s\n", name, result);
+
+        return 0;
+}
+
 int isolate_all(int argc, char *argv[], sd_bus *bus) {
         _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
         _cleanup_sd_bus_message_ sd_bus_message *m = NULL;
-        _cleanup_sd_bus_message_ sd_bus_message *job_result = NULL;
         int r;
         const char *target;
+        const char *key;
         const char *job_path;
-        const char *result;
-        uint32_t id;
 
         if (argc < 1) {
                 fprintf(stderr, "No target given\n");
@@ -74,16 +152,20 @@ int isolate_all(int argc, char *argv[], sd_bus *bus) {
         }
         target = argv[0];
 
+        /* An optional idempotency key makes retries return the same job */
+        key = argc > 1 ? argv[1] : "";
+
         /* Issue the method call and store the respons message in m */
         r = sd_bus_call_method(bus,
                                ORCHESTRATOR_BUS_NAME,
                                ORCHESTRATOR_OBJECT_PATH,
                                ORCHESTRATOR_IFACE,
-                               "IsolateAll",
+                               "IsolateAllWithKey",
                                &error,
                                &m,
-                               "s",
-                               target);
+                               "ss",
+                               target,
+                               key);
         if (r < 0) {
                 fprintf(stderr, "Failed to issue method call: %s\n", error.message);
                 return r;
@@ -96,24 +178,165 @@ int isolate_all(int argc, char *argv[], sd_bus *bus) {
                 return r;
         }
 
-        printf("Started IsolateAll operation\n");
+        return wait_for_fleet_job(bus, "IsolateAll", job_path);
+}
 
-        job_result = wait_for_job(bus, job_path);
-        if (job_result == NULL) {
-                return -EIO;
+int prepare_all(int argc, char *argv[], sd_bus *bus) {
+        _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        _cleanup_sd_bus_message_ sd_bus_message *m = NULL;
+        const char *job_path;
+        int r;
+
+        if (argc < 1) {
+                fprintf(stderr, "No target given\n");
+                return -EINVAL;
         }
 
-        r = sd_bus_message_read(job_result, "uos", &id, &job_path, &result);
+        r = sd_bus_call_method(bus,
+                               ORCHESTRATOR_BUS_NAME,
+                               ORCHESTRATOR_OBJECT_PATH,
+                               ORCHESTRATOR_IFACE,
+                               "PrepareAllWithKey",
+                               &error,
+                               &m,
+                               "ss",
+                               argv[0],
+                               argc > 1 ? argv[1] : "");
         if (r < 0) {
-                fprintf(stderr, "Can't parse job result\n");
-                return 0;
+                fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+                return r;
+        }
+
+        r = sd_bus_message_read(m, "o", &job_path);
+        if (r < 0) {
+                fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+                return r;
+        }
+
+        return wait_for_fleet_job(bus, "PrepareAll", job_path);
+}
+
+
+int job_result(int argc, char *argv[], sd_bus *bus) {
+        _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        _cleanup_sd_bus_message_ sd_bus_message *m = NULL;
+        const char *type;
+        const char *result;
+        uint64_t finished;
+        uint32_t id;
+        int r;
+
+        if (argc < 1) {
+                fprintf(stderr, "No job id given\n");
+                return -EINVAL;
+        }
+        id = strtoul(argv[0], NULL, 10);
+
+        r = sd_bus_call_method(bus,
+                               ORCHESTRATOR_BUS_NAME,
+                               ORCHESTRATOR_OBJECT_PATH,
+                               ORCHESTRATOR_IFACE,
+                               "GetJobResult",
+                               &error,
+                               &m,
+                               "u",
+                               id);
+        if (r < 0) {
+                fprintf(stderr, "Failed to get job result: %s\n", error.message);
+                return r;
+        }
+
+        r = sd_bus_message_read(m, "sst", &type, &result, &finished);
+        if (r < 0) {
+                fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+                return r;
         }
 
-        printf("IsolateAll result: %s\n", result);
+        printf("Job %u (%s) result: %s\n", id, type, result);
 
         return 0;
 }
 
+int job_nodes(int argc, char *argv[], sd_bus *bus) {
+        _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        _cleanup_sd_bus_message_ sd_bus_message *m = NULL;
+        const char *node, *result, *node_error;
+        uint32_t dispatch, reply, done;
+        uint32_t id;
+        int r;
+
+        if (argc < 1) {
+                fprintf(stderr, "No job id given\n");
+                return -EINVAL;
+        }
+        id = strtoul(argv[0], NULL, 10);
+
+        r = sd_bus_call_method(bus,
+                               ORCHESTRATOR_BUS_NAME,
+                               ORCHESTRATOR_OBJECT_PATH,
+                               ORCHESTRATOR_IFACE,
+                               "GetJobNodeResults",
+                               &error,
+                               &m,
+                               "u",
+                               id);
+        if (r < 0) {
+                fprintf(stderr, "Failed to get node results: %s\n", error.message);
+                return r;
+        }
+
+        r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(sssuuu)");
+        if (r < 0)
+                return r;
+
+        printf("%-20s %-10s %10s %10s %10s  %s\n", "NODE", "RESULT", "REPLY(ms)", "JOB(ms)", "TOTAL(ms)", "ERROR");
+        while ((r = sd_bus_message_read(m, "(sssuuu)", &node, &result, &node_error, &dispatch, &reply, &done)) > 0) {
+                if (strcmp(result, "pending") == 0)
+                        printf("%-20s %-10s %10s %10s %10s\n", node, result, "-", "-", "-");
+                else
+                        printf("%-20s %-10s %10u %10u %10u  %s\n", node, result,
+                               reply > dispatch ? reply - dispatch : 0,
+                               reply > 0 ? done - reply : 0,
+                               done - dispatch,
+                               node_error);
+        }
+        if (r < 0) {
+                fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+                return r;
+        }
+
+        return 0;
+}
+
+int upgrade(int argc, char *argv[], sd_bus *bus) {
+        _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        _cleanup_sd_bus_message_ sd_bus_message *m = NULL;
+        uint32_t n_nodes;
+        int r;
+
+        r = sd_bus_call_method(bus,
+                               ORCHESTRATOR_BUS_NAME,
+                               ORCHESTRATOR_OBJECT_PATH,
+                               ORCHESTRATOR_IFACE,
+                               "Upgrade",
+                               &error,
+                               &m,
+                               "");
+        if (r < 0) {
+                fprintf(stderr, "Failed to upgrade orchestrator: %s\n", error.message);
+                return r;
+        }
+
+        r = sd_bus_message_read(m, "u", &n_nodes);
+        if (r < 0) {
+                fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+                return r;
+        }
+
+        printf("Orchestrator upgraded, handed off %u nodes\n", n_nodes);
+
+        return 0;
+}
 
 int main(int argc, char *argv[]) {
         _cleanup_sd_bus_ sd_bus *bus = NULL;
@@ -146,8 +369,27 @@ int main(int argc, char *argv[]) {
         if (r < 0)
           return r;
 
+        r = sd_bus_match_signal(
+                        bus,
+                        NULL,
+                        ORCHESTRATOR_BUS_NAME,
+                        ORCHESTRATOR_OBJECT_PATH,
+                        ORCHESTRATOR_IFACE,
+                        "NodeStraggling",
+                        match_node_straggling, NULL);
+        if (r < 0)
+          return r;
+
         if (strcmp("isolate-all", command) == 0) {
                 r = isolate_all(argc, argv, bus);
+        } else if (strcmp("prepare-all", command) == 0) {
+                r = prepare_all(argc, argv, bus);
+        } else if (strcmp("job-result", command) == 0) {
+                r = job_result(argc, argv, bus);
+        } else if (strcmp("job-nodes", command) == 0) {
+                r = job_nodes(argc, argv, bus);
+        } else if (strcmp("upgrade", command) == 0) {
+                r = upgrade(argc, argv, bus);
         } else {
                 fprintf(stderr, "Unknown command: %s\n", command);
                 return EXIT_FAILURE;
@@ -0,0 +1,182 @@
+#include "eventlog.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void event_log_init(EventLog *log, uint32_t size) {
+        memset(log->header, 0, log->map_size);
+        log->header->magic = EVENT_LOG_MAGIC;
+        log->header->version = EVENT_LOG_VERSION;
+        log->header->size = size;
+}
+
+static bool event_log_is_valid(EventLog *log, uint32_t size) {
+        EventLogHeader *h = log->header;
+
+        return h->magic == EVENT_LOG_MAGIC && h->version == EVENT_LOG_VERSION &&
+                h->size == size && h->acked_seq <= h->last_seq;
+}
+
+int event_log_open(EventLog *log, const char *path, uint32_t size) {
+        bool loaded = false;
+        struct stat st;
+        void *p;
+        int fd;
+
+        assert(size > 0);
+
+        log->map_size = sizeof(EventLogHeader) + (size_t) size * sizeof(EventLogEntry);
+        log->n_dropped = 0;
+
+        if (path == NULL) {
+                p = mmap(NULL, log->map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED)
+                        return -errno;
+        } else {
+                fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+                if (fd < 0)
+                        return -errno;
+
+                if (fstat(fd, &st) < 0 ||
+                    (st.st_size != (off_t) log->map_size && ftruncate(fd, log->map_size) < 0)) {
+                        int errsv = errno;
+                        close(fd);
+                        return -errsv;
+                }
+                loaded = st.st_size == (off_t) log->map_size;
+
+                p = mmap(NULL, log->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+                close(fd);
+                if (p == MAP_FAILED)
+                        return -errno;
+        }
+
+        log->header = p;
+        log->entries = (EventLogEntry *)(log->header + 1);
+
+        if (loaded && !event_log_is_valid(log, size)) {
+                fprintf(stderr, "Ignoring invalid event log %s\n", path);
+                loaded = false;
+        }
+        if (!loaded)
+                event_log_init(log, size);
+
+        return loaded;
+}
+
+void event_log_close(EventLog *log) {
+        if (log->header)
+                munmap(log->header, log->map_size);
+        log->header = NULL;
+        log->entries = NULL;
+}
+
+void event_log_reset(EventLog *log, sd_id128_t session) {
+        memcpy(log->header->session, session.bytes, sizeof(log->header->session));
+        log->header->last_seq = 0;
+        log->header->acked_seq = 0;
+}
+
+sd_id128_t event_log_get_session(EventLog *log) {
+        sd_id128_t session;
+
+        memcpy(session.bytes, log->header->session, sizeof(session.bytes));
+        return session;
+}
+
+void event_log_set_next_job_id(EventLog *log, uint32_t next_job_id) {
+        log->header->next_job_id = next_job_id;
+}
+
+int event_log_set_running_job(EventLog *log, uint32_t id, int type, const char *target) {
+        EventLogJob *j = &log->header->running_job;
+        sd_id128_t boot_id = SD_ID128_NULL;
+        size_t len = strlen(target);
+
+        if (len >= sizeof(j->target))
+                return -ENAMETOOLONG;
+
+        (void) sd_id128_get_boot(&boot_id);
+
+        /* The job is complete before id covers it */
+        j->id = 0;
+        memcpy(log->header->boot_id, boot_id.bytes, sizeof(log->header->boot_id));
+        j->type = type;
+        j->systemd_job_id = 0;
+        memcpy(j->target, target, len + 1);
+        j->id = id;
+
+        return 0;
+}
+
+bool event_log_running_job_is_stale(EventLog *log) {
+        sd_id128_t boot_id, job_boot_id;
+
+        /* Can't tell, the systemd job id says no more than before */
+        if (sd_id128_get_boot(&boot_id) < 0)
+                return false;
+
+        memcpy(job_boot_id.bytes, log->header->boot_id, sizeof(job_boot_id.bytes));
+        return !sd_id128_equal(boot_id, job_boot_id);
+}
+
+/* Only the number is kept, systemd names its jobs after it */
+void event_log_set_running_systemd_job(EventLog *log, uint32_t id, const char *job_object_path) {
+        EventLogJob *j = &log->header->running_job;
+        const char *s = strrchr(job_object_path, '/');
+
+        if (j->id == id && s != NULL)
+                j->systemd_job_id = strtoul(s + 1, NULL, 10);
+}
+
+void event_log_clear_running_job(EventLog *log, uint32_t id) {
+        if (log->header->running_job.id == id)
+                log->header->running_job.id = 0;
+}
+
+uint64_t event_log_append(EventLog *log, uint32_t id, int result) {
+        EventLogHeader *h = log->header;
+        uint64_t seq = h->last_seq + 1;
+        EventLogEntry *e = &log->entries[seq % h->size];
+
+        if (seq - h->acked_seq > h->size) {
+                h->acked_seq = seq - h->size;
+                log->n_dropped++;
+        }
+
+        /* The entry is complete before last_seq covers it */
+        e->seq = seq;
+        e->id = id;
+        e->result = result;
+        h->last_seq = seq;
+
+        return seq;
+}
+
+void event_log_ack(EventLog *log, uint64_t seq) {
+        EventLogHeader *h = log->header;
+
+        if (seq > h->last_seq)
+                seq = h->last_seq;
+        if (seq > h->acked_seq)
+                h->acked_seq = seq;
+}
+
+void event_log_rebase(EventLog *log, uint64_t seq) {
+        log->header->acked_seq = seq;
+        log->header->last_seq = seq;
+}
+
+const EventLogEntry *event_log_get(EventLog *log, uint64_t seq) {
+        EventLogHeader *h = log->header;
+        EventLogEntry *e;
+
+        if (seq <= h->acked_seq || seq > h->last_seq)
+                return NULL;
+
+        e = &log->entries[seq % h->size];
+        return e->seq == seq ? e : NULL;
+}
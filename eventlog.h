@@ -0,0 +1,81 @@
+#pragma once
+
+#include "orch.h"
+
+/* Job results a node has not yet seen acknowledged by the orchestrator,
+ * so they can be sent again after a reconnect. Results are numbered in
+ * the order they are sent, starting at 1 in each session, and the
+ * orchestrator acknowledges by the count it received. With a path the
+ * log is a file mapped into memory, so it also outlives the node.
+ * Alongside it is a journal of the job the node is running, so a
+ * restarted node can pick up the systemd job instead of losing it. */
+
+#define EVENT_LOG_MAGIC 0x4c45524f /* "OREL" */
+#define EVENT_LOG_VERSION 3
+
+#define EVENT_LOG_TARGET_MAX 256 /* systemd's limit on unit names */
+
+typedef struct EventLog EventLog;
+typedef struct EventLogHeader EventLogHeader;
+typedef struct EventLogEntry EventLogEntry;
+typedef struct EventLogJob EventLogJob;
+
+struct EventLogJob {
+        uint32_t id;              /* 0 if no job is running */
+        int32_t type;             /* NodeJobType */
+        uint32_t systemd_job_id;  /* 0 until systemd queued the job */
+        uint32_t padding;
+        char target[EVENT_LOG_TARGET_MAX];
+};
+
+struct EventLogHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t size;            /* entries following the header */
+        uint32_t next_job_id;     /* ids below are taken by earlier jobs */
+        uint8_t session[16];      /* all zero without a session */
+        uint8_t boot_id[16];      /* of the boot running_job was written in */
+        uint64_t last_seq;        /* of the newest result */
+        uint64_t acked_seq;       /* results up to here have arrived */
+        EventLogJob running_job;
+};
+
+struct EventLogEntry {
+        uint64_t seq;             /* slot is seq % size */
+        uint32_t id;
+        int8_t result;
+        uint8_t padding[3];
+};
+
+struct EventLog {
+        EventLogHeader *header;
+        EventLogEntry *entries;
+        size_t map_size;
+        uint64_t n_dropped;       /* overwritten before they were acknowledged */
+};
+
+/* Without path the log is kept in anonymous memory. Returns 1 if an
+ * existing log was loaded from path. */
+extern int event_log_open(EventLog *log, const char *path, uint32_t size);
+extern void event_log_close(EventLog *log);
+
+/* Starts over, for a new session */
+extern void event_log_reset(EventLog *log, sd_id128_t session);
+extern sd_id128_t event_log_get_session(EventLog *log);
+extern void event_log_set_next_job_id(EventLog *log, uint32_t next_job_id);
+
+/* The job running now, written before it gets its result */
+extern int event_log_set_running_job(EventLog *log, uint32_t id, int type, const char *target);
+/* Whether running_job is from an earlier boot, which ended it */
+extern bool event_log_running_job_is_stale(EventLog *log);
+extern void event_log_set_running_systemd_job(EventLog *log, uint32_t id, const char *job_object_path);
+extern void event_log_clear_running_job(EventLog *log, uint32_t id);
+
+/* Returns the seq the result got. When full the oldest unacknowledged
+ * result is dropped. */
+extern uint64_t event_log_append(EventLog *log, uint32_t id, int result);
+extern void event_log_ack(EventLog *log, uint64_t seq);
+/* Numbers the next result seq + 1, with nothing unacknowledged */
+extern void event_log_rebase(EventLog *log, uint64_t seq);
+/* NULL if seq is acknowledged or was dropped */
+extern const EventLogEntry *event_log_get(EventLog *log, uint64_t seq);
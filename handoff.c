@@ -0,0 +1,230 @@
+#include "handoff.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+HandoffRecord *handoff_record_new(const char *type, int fd) {
+        HandoffRecord *rec = malloc0(sizeof(HandoffRecord));
+
+        if (rec == NULL)
+                return NULL;
+
+        rec->fd = fd;
+        rec->f = open_memstream(&rec->data, &rec->size);
+        if (rec->f == NULL) {
+                free(rec);
+                return NULL;
+        }
+
+        handoff_record_put(rec, "record", "%s", type);
+        return rec;
+}
+
+void handoff_record_put(HandoffRecord *rec, const char *key, const char *format, ...) {
+        va_list ap;
+
+        fprintf(rec->f, "%s=", key);
+        va_start(ap, format);
+        vfprintf(rec->f, format, ap);
+        va_end(ap);
+        fputc('\0', rec->f);
+}
+
+int handoff_record_finish(HandoffRecord *rec) {
+        int r = ferror(rec->f) ? -ENOMEM : 0;
+
+        if (fclose(rec->f) != 0)
+                r = -ENOMEM;
+        rec->f = NULL;
+        if (r == 0 && rec->size > HANDOFF_MAX_RECORD)
+                r = -E2BIG;
+        return r;
+}
+
+void handoff_record_free_all(HandoffRecord *rec) {
+        while (rec) {
+                HandoffRecord *next = rec->next;
+
+                if (rec->f)
+                        fclose(rec->f);
+                free(rec->data);
+                free(rec);
+                rec = next;
+        }
+}
+
+static int handoff_send(int sock, const void *data, size_t size, int fd) {
+        union {
+                struct cmsghdr cmsghdr;
+                uint8_t buf[CMSG_SPACE(sizeof(int))];
+        } control = {};
+        struct iovec iov = { (void *) data, size };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+        };
+
+        if (fd >= 0) {
+                struct cmsghdr *cmsg;
+
+                msg.msg_control = &control;
+                msg.msg_controllen = sizeof(control);
+                cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+
+        while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+                if (errno != EINTR)
+                        return -errno;
+        }
+
+        return 0;
+}
+
+int handoff_start_sender(HandoffRecord *records) {
+        HandoffRecord *rec;
+        int sv[2];
+        pid_t pid;
+
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+                return -errno;
+
+        pid = fork();
+        if (pid < 0) {
+                int errsv = errno;
+                close(sv[0]);
+                close(sv[1]);
+                return -errsv;
+        }
+
+        if (pid == 0) {
+                /* Forked again so init reaps the sender, not the new instance */
+                pid = fork();
+                if (pid != 0)
+                        _exit(pid < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+                close(sv[1]);
+                for (rec = records; rec; rec = rec->next) {
+                        if (handoff_send(sv[0], rec->data, rec->size, rec->fd) < 0)
+                                _exit(EXIT_FAILURE);
+                }
+                _exit(EXIT_SUCCESS);
+        }
+
+        close(sv[0]);
+        (void) waitpid(pid, NULL, 0);
+        return sv[1];
+}
+
+ssize_t handoff_recv(int sock, char *buf, size_t size, int *fd_out) {
+        union {
+                struct cmsghdr cmsghdr;
+                uint8_t buf[CMSG_SPACE(sizeof(int))];
+        } control = {};
+        struct iovec iov = { buf, size };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg;
+        ssize_t n;
+
+        *fd_out = -1;
+
+        do
+                n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        while (n < 0 && errno == EINTR);
+        if (n < 0)
+                return -errno;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                        memcpy(fd_out, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+                if (*fd_out >= 0)
+                        close(*fd_out);
+                *fd_out = -1;
+                return -EMSGSIZE;
+        }
+
+        return n;
+}
+
+/* Not synced, the file is for a standby on the same host, which only
+ * loses the page cache along with us */
+int handoff_save(HandoffRecord *records, const char *path) {
+        _cleanup_free_ char *tmp = NULL;
+        HandoffRecord *rec;
+        FILE *f;
+        int r = 0;
+
+        if (asprintf(&tmp, "%s.tmp", path) < 0)
+                return -ENOMEM;
+
+        f = fopen(tmp, "we");
+        if (f == NULL)
+                return -errno;
+
+        for (rec = records; rec; rec = rec->next) {
+                uint32_t size = rec->size;
+
+                if (fwrite(&size, sizeof(size), 1, f) != 1 ||
+                    fwrite(rec->data, 1, rec->size, f) != rec->size)
+                        break;
+        }
+        if (fclose(f) != 0 || rec != NULL)
+                r = -EIO;
+        if (r == 0 && rename(tmp, path) < 0)
+                r = -errno;
+        if (r < 0)
+                (void) unlink(tmp);
+
+        return r;
+}
+
+ssize_t handoff_read(FILE *f, char *buf, size_t size) {
+        uint32_t n;
+
+        if (fread(&n, sizeof(n), 1, f) != 1)
+                return ferror(f) ? -EIO : 0;
+        if (n > size)
+                return -EMSGSIZE;
+        if (fread(buf, 1, n, f) != n)
+                return -EIO;
+
+        return n;
+}
+
+/* Returns 1 with the next KEY=VALUE split in place, 0 at the end */
+int handoff_next(char *buf, size_t size, size_t *offset, char **key, char **value) {
+        char *s = buf + *offset;
+        size_t len;
+        char *eq;
+
+        if (*offset >= size)
+                return 0;
+
+        len = strnlen(s, size - *offset);
+        if (*offset + len == size)
+                return -EBADMSG; /* not terminated */
+
+        eq = strchr(s, '=');
+        if (eq == NULL)
+                return -EBADMSG;
+
+        *eq = '\0';
+        *key = s;
+        *value = eq + 1;
+        *offset += len + 1;
+        return 1;
+}
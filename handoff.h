@@ -0,0 +1,43 @@
+#pragma once
+
+#include "orch.h"
+
+#include <sys/types.h>
+
+/* State passed from a running orchestrator to the instance replacing
+ * it, over a SOCK_SEQPACKET socket. Each packet is one record, with at
+ * most one fd attached: a run of NUL terminated KEY=VALUE strings, the
+ * first of which is "record=TYPE". D-Bus strings can't hold NUL, so
+ * values need no escaping. */
+
+#define HANDOFF_MAX_RECORD (64 * 1024)
+
+typedef struct HandoffRecord HandoffRecord;
+
+struct HandoffRecord {
+        FILE *f;
+        char *data;
+        size_t size;
+        int fd;                 /* sent along, -1 for none, not owned */
+        HandoffRecord *next;
+};
+
+extern HandoffRecord *handoff_record_new(const char *type, int fd);
+extern void handoff_record_put(HandoffRecord *rec, const char *key, const char *format, ...)
+        __attribute__((format(printf, 3, 4)));
+extern int handoff_record_finish(HandoffRecord *rec);
+extern void handoff_record_free_all(HandoffRecord *rec);
+
+/* Forks a process that sends the records on and exits, so the caller
+ * can exec right away. Returns the socket to pass to the new instance. */
+extern int handoff_start_sender(HandoffRecord *records);
+
+/* The same records, without fds, kept in a file. Each is written as a
+ * native u32 size followed by the data. The file is replaced at once. */
+extern int handoff_save(HandoffRecord *records, const char *path);
+/* Returns the record size, 0 at the end of the file */
+extern ssize_t handoff_read(FILE *f, char *buf, size_t size);
+
+/* Returns the record size, 0 at the end, and the attached fd or -1 */
+extern ssize_t handoff_recv(int sock, char *buf, size_t size, int *fd_out);
+extern int handoff_next(char *buf, size_t size, size_t *offset, char **key, char **value);
@@ -1,16 +1,119 @@
 #include "orch.h"
 #include "types.h"
+#include "eventlog.h"
 
+#include <fcntl.h>
+#include <math.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
 #include <sys/socket.h>
 
 typedef struct Node Node;
+typedef struct SystemdCall SystemdCall;
+typedef struct TcpConnect TcpConnect;
+
+typedef enum {
+        PRESSURE_CPU,
+        PRESSURE_MEMORY,
+        PRESSURE_IO,
+        _PRESSURE_MAX,
+} PressureResource;
+
+static const char* const pressure_resource_table[_PRESSURE_MAX] = {
+        [PRESSURE_CPU] = "cpu",
+        [PRESSURE_MEMORY] = "memory",
+        [PRESSURE_IO] = "io",
+};
 
 struct Node {
         Manager manager;
         sd_bus *local_bus;
+        /* Target of the last successful isolate, forgotten as soon as
+         * systemd queues any later job */
+        char *isolated_target;
+        char **isolated_units;  /* up right after it, NULL until listed */
+
+        /* Startup: subscribing to systemd and registering with the
+         * orchestrator run concurrently, jobs wait for the former */
+        const char *name;
+        uint64_t start_usec;
+        uint64_t subscribed_usec;            /* 0 until systemd confirmed Subscribe */
+        uint64_t connected_usec;             /* 0 until the TCP connection is up */
+        uint64_t registered_usec;            /* 0 until the orchestrator confirmed Register */
+        TcpConnect *connect;
+        const char *orchestrator_address;
+        int orchestrator_port;
+        sd_id128_t session;                  /* null until the orchestrator sent one */
+        sd_event_source *reconnect_timer;
+        /* Standby orchestrator, with --standby, taken over to when we lose
+         * the active one. Swapped with the above on failing over. */
+        const char *standby_address;         /* NULL without a standby */
+        int standby_port;
+        sd_bus *standby_bus;                 /* NULL until connected */
+        sd_bus_slot *standby_slot;           /* its Disconnected match */
+        TcpConnect *standby_connect;
+        sd_event_source *standby_timer;      /* next ping or connect */
+        /* Job results until acknowledged, with NODE_FEATURE_REPLAY */
+        EventLog event_log;
+        const char *event_log_path;          /* NULL to keep it in memory */
+        bool replaying;                      /* results wait for EventsAcked */
+        /* Job an earlier run left running, new ones wait until it is done */
+        uint32_t resumed_job_id;             /* 0 if there is none */
+        char *resumed_job_path;
+        JobTracker resumed_tracker;
+        const char **labels;                 /* KEY=VALUE, sent with the inventory */
+        uint64_t features;                   /* NODE_FEATURE_*, agreed with the orchestrator */
+        uint32_t op_credits;                 /* jobs we take at once, with NODE_FEATURE_CREDITS */
+        size_t n_labels;
+
+        /* Admission control on pressure stall information */
+        const char *psi_dir;
+        double psi_threshold[_PRESSURE_MAX]; /* "some" avg10 percentage, 0 disables */
+        uint64_t psi_max_hold_usec;
+        uint32_t held_job_id;                /* 0 if no job is held */
+        uint64_t held_since_usec;
+        sd_event_source *psi_timer;
+
+        /* Calls to systemd, paced by a token bucket and a window of
+         * calls in flight so bulk operations don't swamp PID1 */
+        double systemd_call_rate;            /* calls per second, 0 for no limit */
+        double systemd_call_burst;
+        uint32_t systemd_max_in_flight;      /* 0 for no limit */
+        double systemd_call_tokens;
+        uint64_t systemd_call_refill_usec;
+        LIST_HEAD(SystemdCall, systemd_calls); /* waiting, oldest first, and while disconnected */
+        SystemdCall *systemd_calls_tail;
+        uint32_t n_systemd_calls_queued;
+        uint32_t n_systemd_calls_in_flight;
+        sd_event_source *systemd_call_timer;
+        uint64_t n_systemd_calls;
+        uint64_t systemd_call_wait_usec;     /* total time calls spent queued */
+        uint64_t systemd_call_max_wait_usec;
+
+        /* Connection to systemd, made again when PID1 goes away */
+        bool systemd_subscribed;             /* jobs wait while we'd miss their JobRemoved */
+        uint64_t systemd_lost_usec;          /* 0 unless systemd is gone or being reconciled */
+        sd_event_source *systemd_reconnect_timer;
+
         LIST_HEAD(JobTracker, trackers);
 };
 
+/* Kept as arguments rather than a message, a call queued across a
+ * reconnect has to be built for the new connection */
+struct SystemdCall {
+        Node *node;
+        char *path;
+        const char *interface;
+        const char *member;
+        const char *signature;               /* 's', 'u' and a trailing "as" */
+        char **args;                         /* 'u' as a decimal string */
+        sd_bus_message_handler_t callback;
+        void *userdata;
+        uint64_t queued_usec;
+        LIST_FIELDS(SystemdCall, calls);
+};
+
 #define DEBUG_DBUS_MESSAGES 0
 
 static int getpeercred(int fd, struct ucred *ucred) {
@@ -60,14 +163,17 @@ static int bus_check_peercred(sd_bus *c) {
         return 1;
 }
 
+/* Returns 1 if connected to systemd directly, 0 for the system bus */
 static int connect_system_systemd(sd_bus **_bus) {
         _cleanup_(sd_bus_close_unrefp) sd_bus *bus = NULL;
         int r;
 
         assert(_bus);
 
-        if (geteuid() != 0)
-                return sd_bus_default_system(_bus);
+        /* Not the default bus, that would be the dead one on reconnecting.
+         * A system bus given explicitly, as by the tests, wins. */
+        if (geteuid() != 0 || getenv("DBUS_SYSTEM_BUS_ADDRESS") != NULL)
+                return sd_bus_open_system(_bus);
 
         r = sd_bus_new(&bus);
         if (r < 0)
@@ -79,7 +185,7 @@ static int connect_system_systemd(sd_bus **_bus) {
 
         r = sd_bus_start(bus);
         if (r < 0)
-                return sd_bus_default_system(_bus);
+                return sd_bus_open_system(_bus);
 
         r = bus_check_peercred(bus);
         if (r < 0)
@@ -87,18 +193,250 @@ static int connect_system_systemd(sd_bus **_bus) {
 
         *_bus = steal_pointer(&bus);
 
+        return 1;
+}
+
+static void node_dispatch_systemd_calls(Node *node);
+
+static void systemd_call_free(SystemdCall *call) {
+        free(call->path);
+        strv_free(call->args);
+        free(call);
+}
+
+static int systemd_call_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        SystemdCall *call = userdata;
+        Node *node = call->node;
+
+        node->n_systemd_calls_in_flight--;
+        call->callback(m, call->userdata, ret_error);
+        systemd_call_free(call);
+
+        node_dispatch_systemd_calls(node);
+        return 0;
+}
+
+static int systemd_call_new_message(SystemdCall *call, sd_bus_message **ret) {
+        _cleanup_sd_bus_message_ sd_bus_message *m = NULL;
+        char **a = call->args;
+        const char *t;
+        int r;
+
+        r = sd_bus_message_new_method_call(call->node->local_bus, &m, SYSTEMD_BUS_NAME,
+                                           call->path, call->interface, call->member);
+        for (t = call->signature; r >= 0 && *t; t++) {
+                switch (*t) {
+                case 's':
+                        r = sd_bus_message_append(m, "s", *a++);
+                        break;
+                case 'u':
+                        r = sd_bus_message_append(m, "u", (uint32_t)strtoul(*a++, NULL, 10));
+                        break;
+                case 'a':
+                        /* Takes the remaining arguments */
+                        r = sd_bus_message_append_strv(m, a);
+                        t++;
+                        break;
+                default:
+                        r = -EINVAL;
+                }
+        }
+        if (r < 0)
+                return r;
+
+        *ret = steal_pointer(&m);
+        return 0;
+}
+
+static void systemd_call_send(SystemdCall *call) {
+        Node *node = call->node;
+        _cleanup_sd_bus_message_ sd_bus_message *m = NULL, *error = NULL;
+        sd_bus_error e = SD_BUS_ERROR_NULL;
+        int r;
+
+        r = systemd_call_new_message(call, &m);
+        if (r >= 0)
+                r = sd_bus_call_async(node->local_bus, NULL, m, systemd_call_reply, call, DEFAULT_DBUS_TIMEOUT);
+        if (r >= 0) {
+                node->n_systemd_calls_in_flight++;
+                return;
+        }
+
+        /* Callers expect a reply, answer the call with the error. Replies
+         * need a sealed call to answer, which the one we built may not be. */
+        fprintf(stderr, "Failed to call %s on systemd: %s\n", call->member, strerror(-r));
+        (void) sd_bus_error_set_errnof(&e, r, "Failed to call %s on systemd: %s", call->member, strerror(-r));
+        m = sd_bus_message_unref(m);
+        if (sd_bus_message_new_method_call(node->local_bus, &m, SYSTEMD_BUS_NAME,
+                                           call->path, call->interface, call->member) >= 0 &&
+            sd_bus_message_seal(m, node->n_systemd_calls, 0) >= 0 &&
+            sd_bus_message_new_method_error(m, &error, &e) >= 0)
+                call->callback(error, call->userdata, NULL);
+        sd_bus_error_free(&e);
+        systemd_call_free(call);
+}
+
+static int systemd_call_timer_cb(sd_event_source *s, uint64_t usec, void *userdata) {
+        Node *node = userdata;
+
+        node_dispatch_systemd_calls(node);
+        return 0;
+}
+
+static void node_arm_systemd_call_timer(Node *node, uint64_t usec) {
+        int r;
+
+        if (node->systemd_call_timer == NULL) {
+                r = sd_event_add_time(node->manager.event, &node->systemd_call_timer, CLOCK_MONOTONIC,
+                                      usec, 0, systemd_call_timer_cb, node);
+                if (r < 0)
+                        fprintf(stderr, "Failed to add systemd call timer: %s\n", strerror(-r));
+                return;
+        }
+
+        (void) sd_event_source_set_time(node->systemd_call_timer, usec);
+        (void) sd_event_source_set_enabled(node->systemd_call_timer, SD_EVENT_ONESHOT);
+}
+
+static void node_dispatch_systemd_calls(Node *node) {
+        uint64_t now;
+
+        (void) sd_event_now(node->manager.event, CLOCK_MONOTONIC, &now);
+
+        if (node->systemd_call_rate > 0) {
+                node->systemd_call_tokens += (now - node->systemd_call_refill_usec) * node->systemd_call_rate / USEC_PER_SEC;
+                if (node->systemd_call_tokens > node->systemd_call_burst)
+                        node->systemd_call_tokens = node->systemd_call_burst;
+        }
+        node->systemd_call_refill_usec = now;
+
+        while (node->systemd_calls != NULL) {
+                SystemdCall *call = node->systemd_calls;
+                uint64_t wait;
+
+                if (sd_bus_is_open(node->local_bus) <= 0)
+                        return; /* Sent once we are connected again */
+
+                if (node->systemd_max_in_flight > 0 && node->n_systemd_calls_in_flight >= node->systemd_max_in_flight)
+                        return; /* The next reply dispatches more */
+
+                if (node->systemd_call_rate > 0) {
+                        if (node->systemd_call_tokens < 1) {
+                                node_arm_systemd_call_timer(node, now + (1 - node->systemd_call_tokens) * USEC_PER_SEC / node->systemd_call_rate);
+                                return;
+                        }
+                        node->systemd_call_tokens -= 1;
+                }
+
+                LIST_REMOVE(calls, node->systemd_calls, call);
+                if (node->systemd_calls_tail == call)
+                        node->systemd_calls_tail = NULL;
+                node->n_systemd_calls_queued--;
+
+                wait = now - call->queued_usec;
+                node->n_systemd_calls++;
+                node->systemd_call_wait_usec += wait;
+                if (wait > node->systemd_call_max_wait_usec)
+                        node->systemd_call_max_wait_usec = wait;
+
+                systemd_call_send(call);
+        }
+}
+
+/* Queues a call to systemd, taking args. The callback always gets a
+ * reply, and never before this returns. */
+static int node_call_systemd(Node *node, const char *path, const char *interface, const char *member,
+                             const char *signature, char **args,
+                             sd_bus_message_handler_t callback, void *userdata) {
+        SystemdCall *call;
+
+        call = malloc0(sizeof(SystemdCall));
+        if (call == NULL) {
+                strv_free(args);
+                return -ENOMEM;
+        }
+
+        call->node = node;
+        call->path = strdup(path);
+        call->interface = interface;
+        call->member = member;
+        call->signature = signature;
+        call->args = args;
+        call->callback = callback;
+        call->userdata = userdata;
+        if (call->path == NULL) {
+                systemd_call_free(call);
+                return -ENOMEM;
+        }
+        (void) sd_event_now(node->manager.event, CLOCK_MONOTONIC, &call->queued_usec);
+
+        LIST_INSERT_AFTER(calls, node->systemd_calls, node->systemd_calls_tail, call);
+        node->systemd_calls_tail = call;
+        node->n_systemd_calls_queued++;
+
+        /* Dispatched from the event loop so the first calls of a burst
+         * go out together */
+        node_arm_systemd_call_timer(node, 0);
+
         return 0;
 }
 
+/* Like node_call_systemd, "as" takes a count and that many strings */
+static int node_call_systemd_method(Node *node, const char *path, const char *interface, const char *member,
+                                    sd_bus_message_handler_t callback, void *userdata,
+                                    const char *types, ...) {
+        char **args = NULL;
+        const char *t;
+        va_list ap;
+        int r = 0;
+
+        va_start(ap, types);
+        for (t = types; r >= 0 && *t; t++) {
+                char buf[11];
+                int n;
+
+                switch (*t) {
+                case 's':
+                        r = strv_append(&args, va_arg(ap, const char *));
+                        break;
+                case 'u':
+                        snprintf(buf, sizeof(buf), "%u", va_arg(ap, uint32_t));
+                        r = strv_append(&args, buf);
+                        break;
+                case 'a':
+                        for (n = va_arg(ap, int); r >= 0 && n > 0; n--)
+                                r = strv_append(&args, va_arg(ap, const char *));
+                        t++;
+                        break;
+                default:
+                        r = -EINVAL;
+                }
+        }
+        va_end(ap);
+        if (r < 0) {
+                strv_free(args);
+                return r;
+        }
+
+        return node_call_systemd(node, path, interface, member, types, args, callback, userdata);
+}
+
 static void node_add_job_tracker(Node *node, JobTracker *tracker,
-                                 const char *object_path, job_tracker_callback callback,
-                                 void *userdata) {
+                                 const char *object_path, const char *unit,
+                                 job_tracker_callback callback, void *userdata) {
         tracker->object_path = object_path;
+        tracker->unit = unit;
         tracker->callback = callback;
+        tracker->hold_callback = NULL;
         tracker->userdata = userdata;
         LIST_PREPEND(trackers, node->trackers, tracker);
 }
 
+static void node_journal_job(Node *node, Job *job, const char *target) {
+        if (event_log_set_running_job(&node->event_log, job->id, job->type, target) < 0)
+                fprintf(stderr, "Can't journal job %d, target name too long\n", job->id);
+}
+
 typedef struct {
         Job job;
         const char *target; /* owned by source_message */
@@ -114,9 +452,80 @@ static void job_isolate_destroy(Job *job) {
                 sd_bus_message_unref(isolate->reply);
 }
 
+static bool active_state_is_up(const char *state) {
+        return strcmp(state, "active") == 0 || strcmp(state, "reloading") == 0 ||
+                strcmp(state, "activating") == 0;
+}
+
+static int node_isolated_units_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+        char **units = NULL;
+        size_t n = 0;
+        const char *name;
+        int r;
+
+        /* Without the list the next isolate to the target is done in full */
+        if (sd_bus_message_is_method_error(m, NULL) || node->isolated_target == NULL)
+                return 0;
+
+        r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(ssssssouso)");
+        while (r >= 0 &&
+               (r = sd_bus_message_read(m, "(ssssssouso)", &name, NULL, NULL, NULL, NULL,
+                                        NULL, NULL, NULL, NULL, NULL)) > 0) {
+                char **l = realloc(units, sizeof(char *) * (n + 2));
+                if (l == NULL) {
+                        r = -ENOMEM;
+                        break;
+                }
+                units = l;
+                units[n] = strdup(name);
+                if (units[n] == NULL) {
+                        r = -ENOMEM;
+                        break;
+                }
+                units[++n] = NULL;
+        }
+        if (r < 0) {
+                fprintf(stderr, "Failed to list units up after isolating to %s: %s\n",
+                        node->isolated_target, strerror(-r));
+                strv_free(units);
+                return 0;
+        }
+
+        strv_free(node->isolated_units);
+        node->isolated_units = units;
+        return 0;
+}
+
+/* Remembers what an isolate left running, so a repeat of it can check
+ * that instead of isolating again */
+static void node_set_isolated_target(Node *node, const char *target) {
+        int r;
+
+        free(node->isolated_target);
+        node->isolated_target = target ? strdup(target) : NULL;
+        strv_free(node->isolated_units);
+        node->isolated_units = NULL;
+
+        if (node->isolated_target == NULL)
+                return;
+
+        r = node_call_systemd_method(node,
+                                     SYSTEMD_OBJECT_PATH,
+                                     SYSTEMD_MANAGER_IFACE,
+                                     "ListUnitsFiltered",
+                                     node_isolated_units_cb, node,
+                                     "as", 3, "active", "reloading", "activating");
+        if (r < 0)
+                fprintf(stderr, "Failed to list units up after isolating to %s: %s\n",
+                        node->isolated_target, strerror(-r));
+}
+
 static void  job_isolate_request_done(sd_bus_message *m, const char *result, void *userdata) {
         Job *job = userdata;
         Manager *manager = job->manager;
+        Node *node = (Node *)manager;
+        IsolateJob *isolate = (IsolateJob *)job;
         JobResult res = JOB_DONE;
 
         printf ("job_isolate_request_done, result: %s\n", result);
@@ -126,6 +535,8 @@ static void  job_isolate_request_done(sd_bus_message *m, const char *result, voi
                 res = JOB_FAILED;
         }
 
+        node_set_isolated_target(node, res == JOB_DONE ? isolate->target : NULL);
+
         job->result = res;
         manager_finish_job(manager, job);
 }
@@ -153,8 +564,11 @@ static int job_isolate_request_cb (sd_bus_message *m, void *userdata, sd_bus_err
                         manager_finish_job(manager, job);
                 } else {
                         printf("got job_path %s\n", isolate->job_object_path);
+                        event_log_set_running_systemd_job(&node->event_log, job->id,
+                                                          isolate->job_object_path);
                         node_add_job_tracker(node, &isolate->tracker,
                                              isolate->job_object_path,
+                                             isolate->target,
                                              job_isolate_request_done,
                                              job);
                 }
@@ -163,290 +577,2682 @@ static int job_isolate_request_cb (sd_bus_message *m, void *userdata, sd_bus_err
         return 0;
 }
 
-static int job_isolate(Job *job) {
+static int job_isolate_start_unit(Job *job) {
         Manager *manager = job->manager;
         Node *node = (Node *)manager;
         IsolateJob *isolate = (IsolateJob *)job;
-        _cleanup_sd_bus_message_ sd_bus_message *m = NULL;
         int r;
 
-        printf ("Running job %d, Isolate %s\n", job->id, isolate->target);
-
-        r = sd_bus_message_new_method_call(node->local_bus, &m,
-                                           SYSTEMD_BUS_NAME,
-                                           SYSTEMD_OBJECT_PATH,
-                                           SYSTEMD_MANAGER_IFACE,
-                                           "StartUnit");
-        if (r >= 0)
-                r = sd_bus_message_append(m, "ss", isolate->target, "isolate");
-        if (r >= 0)
-                r = sd_bus_call_async(node->local_bus, NULL /*slot*/, m, job_isolate_request_cb, job, DEFAULT_DBUS_TIMEOUT);
+        r = node_call_systemd_method(node,
+                                     SYSTEMD_OBJECT_PATH,
+                                     SYSTEMD_MANAGER_IFACE,
+                                     "StartUnit",
+                                     job_isolate_request_cb, job,
+                                     "ss", isolate->target, "isolate");
         if (r < 0) {
                 fprintf(stderr, "Failed to send isolate request: %s\n", strerror(-r));
+                job->result = JOB_FAILED;
+                manager_finish_job(manager, job);
                 return 0;
         }
 
         return 0;
 }
 
-static int method_node_isolate(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-        Node *node = userdata;
-        Manager *manager = (Manager *)node;
-        const char *target;
-        _cleanup_(job_unrefp) Job *job = NULL;
-        IsolateJob *isolate;
+static int job_isolate_check_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Job *job = userdata;
+        IsolateJob *isolate = (IsolateJob *)job;
+        const char *name, *load_state, *active_state;
+        uint32_t job_id;
         int r;
 
-        r = sd_bus_message_read(m, "s", &target);
+        if (sd_bus_message_is_method_error(m, NULL))
+                goto isolate;
+
+        r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(ssssssouso)");
+        while (r >= 0 &&
+               (r = sd_bus_message_read(m, "(ssssssouso)", &name, NULL, &load_state, &active_state,
+                                        NULL, NULL, NULL, &job_id, NULL, NULL)) > 0) {
+                if (strcmp(load_state, "loaded") != 0 || !active_state_is_up(active_state) || job_id != 0) {
+                        printf("%s is %s %s since isolating to %s\n", name, load_state, active_state, isolate->target);
+                        goto isolate;
+                }
+        }
         if (r < 0)
-                return sd_bus_reply_method_errnof(m, -r, "Failed to create job: %m");
+                goto isolate;
 
-        printf("Got Isolate '%s'\n", target);
+        printf("Already isolated to %s\n", isolate->target);
+        job->result = JOB_DONE;
+        manager_finish_job(job->manager, job);
+        return 0;
 
-        r = manager_queue_job(manager, NODE_JOB_ISOLATE, sizeof(IsolateJob), m,
-                              job_isolate, NULL, job_isolate_destroy,
-                              &job);
-        if (r < 0)
-                return sd_bus_reply_method_errnof(m, -r, "Failed to create job: %m");
+isolate:
+        node_set_isolated_target((Node *)job->manager, NULL);
+        job_isolate_start_unit(job);
+        return 0;
+}
 
-        isolate = (IsolateJob *)job;
-        isolate->target = target;
+/* If nothing was queued since our last isolate to the same target the
+ * node can only have deviated by units going down on their own. Those
+ * are among the units the isolate left up, so checking that they still
+ * are is cheaper than redoing the isolate. Units that were down already,
+ * like an unrelated failed one, don't matter: the isolate would not
+ * touch them either. */
+static int job_isolate_check_current(Job *job) {
+        Node *node = (Node *)job->manager;
+        char **units = NULL, **u;
+        int r = 0;
+
+        if (node->isolated_units == NULL)
+                return -ENODATA;
 
-        return sd_bus_reply_method_return(m, "o", job->object_path);
+        for (u = node->isolated_units; r >= 0 && *u; u++)
+                r = strv_append(&units, *u);
+        if (r < 0) {
+                strv_free(units);
+                return r;
+        }
+
+        return node_call_systemd(node, SYSTEMD_OBJECT_PATH, SYSTEMD_MANAGER_IFACE, "ListUnitsByNames",
+                                 "as", units, job_isolate_check_cb, job);
 }
 
+static int job_isolate(Job *job) {
+        Manager *manager = job->manager;
+        Node *node = (Node *)manager;
+        IsolateJob *isolate = (IsolateJob *)job;
 
-static const sd_bus_vtable node_vtable[] = {
-        SD_BUS_VTABLE_START(0),
-        SD_BUS_METHOD("Isolate", "s", "o", method_node_isolate, 0),
-        SD_BUS_VTABLE_END
-};
+        printf ("Running job %d, Isolate %s\n", job->id, isolate->target);
+        node_journal_job(node, job, isolate->target);
 
-static int
-all_messages_handler (sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
-{
-        printf("Incomming message from orchestrator: path: %s, iface: %s, member: %s, signature: '%s'\n",
-               sd_bus_message_get_path (m),
-               sd_bus_message_get_interface (m),
-               sd_bus_message_get_member (m),
-               sd_bus_message_get_signature (m, true));
-        return 0;
+        if (node->isolated_target && strcmp(node->isolated_target, isolate->target) == 0 &&
+            job_isolate_check_current(job) >= 0)
+                return 0;
+
+        return job_isolate_start_unit(job);
 }
 
-static int node_match_job_removed(sd_bus_message *m, void *userdata, sd_bus_error *error) {
-        Node *node = userdata;
-        JobTracker *tracker, *next_tracker;
-        const char *job_path;
-        const char *unit;
-        const char *result;
-        uint32_t id;
-        int r;
+/* Moves the strings of b to the end of *a */
+static int strv_extend_move(char ***a, char **b) {
+        size_t n = strv_length(*a), m = strv_length(b);
+        char **l;
 
-        r = sd_bus_message_read(m, "uoss", &id, &job_path, &unit, &result);
-        if (r < 0) {
-                fprintf(stderr, "Can't parse job result\n");
+        if (m == 0) {
+                free(b);
                 return 0;
         }
-        (void)sd_bus_message_rewind(m, true);
-
-        printf("Removed Job %s %s %s\n", job_path, unit, result);
 
-        LIST_FOREACH_SAFE(trackers, tracker, next_tracker, node->trackers) {
-                if (strcmp(tracker->object_path, job_path) == 0) {
-                        tracker->callback(m, result, tracker->userdata);
-                        LIST_REMOVE(trackers, node->trackers, tracker);
-                }
+        l = realloc(*a, sizeof(char *) * (n + m + 1));
+        if (l == NULL) {
+                strv_free(b);
+                return -ENOMEM;
         }
 
+        memcpy(l + n, b, sizeof(char *) * (m + 1));
+        free(b);
+        *a = l;
         return 0;
 }
 
-static int system_bus_disconnected(sd_bus_message *message, void *userdata, sd_bus_error *error) {
-        printf("System bus disconnected\n");
-        return 0;
+static bool strv_contains(char **l, const char *s) {
+        while (l && *l) {
+                if (strcmp(*l, s) == 0)
+                        return true;
+                l++;
+        }
+        return false;
 }
 
+static bool active_state_is_inactive(const char *state) {
+        return strcmp(state, "inactive") == 0 || strcmp(state, "failed") == 0;
+}
 
-int main(int argc, char *argv[]) {
-        _cleanup_sd_event_ sd_event *event = NULL;
-        _cleanup_sd_bus_ sd_bus *bus = NULL;
-        _cleanup_sd_bus_ sd_bus *orch = NULL;
-        sd_bus_error error = SD_BUS_ERROR_NULL;
-        _cleanup_sd_bus_message_ sd_bus_message *m = NULL;
+/* Reads the ActiveState, dependencies (Wants, Requires) and conflicts
+ * (Conflicts, ConflictedBy) out of a Properties.GetAll reply */
+static int read_unit_properties(sd_bus_message *m, char **active_state, char ***deps, char ***conflicts) {
+        const char *name;
         int r;
-        _cleanup_free_ char *dbus_addr = NULL;
-        int orchestrator_port = 1999;
-        const char *orchestrator_address;
-        const char *node_name;
-        Node node = { };
 
-        if (argc < 2) {
-                fprintf(stderr, "No orchestrator address given\n");
-                return EXIT_FAILURE;
+        r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "{sv}");
+        if (r < 0)
+                return r;
+
+        while ((r = sd_bus_message_enter_container(m, SD_BUS_TYPE_DICT_ENTRY, "sv")) > 0) {
+                char ***list = NULL;
+
+                r = sd_bus_message_read(m, "s", &name);
+                if (r < 0)
+                        return r;
+
+                if (strcmp(name, "Wants") == 0 || strcmp(name, "Requires") == 0)
+                        list = deps;
+                else if (strcmp(name, "Conflicts") == 0 || strcmp(name, "ConflictedBy") == 0)
+                        list = conflicts;
+
+                if (list != NULL) {
+                        char **l = NULL;
+
+                        r = sd_bus_message_enter_container(m, SD_BUS_TYPE_VARIANT, "as");
+                        if (r >= 0)
+                                r = sd_bus_message_read_strv(m, &l);
+                        if (r >= 0)
+                                r = strv_extend_move(list, l);
+                        if (r >= 0)
+                                r = sd_bus_message_exit_container(m);
+                } else if (strcmp(name, "ActiveState") == 0 && active_state != NULL) {
+                        const char *state;
+
+                        r = sd_bus_message_read(m, "v", "s", &state);
+                        if (r >= 0) {
+                                free(*active_state);
+                                *active_state = strdup(state);
+                                if (*active_state == NULL)
+                                        r = -ENOMEM;
+                        }
+                } else
+                        r = sd_bus_message_skip(m, "v");
+                if (r < 0)
+                        return r;
+
+                r = sd_bus_message_exit_container(m);
+                if (r < 0)
+                        return r;
         }
+        if (r < 0)
+                return r;
 
-        orchestrator_address = argv[1];
+        return sd_bus_message_exit_container(m);
+}
 
-        if (argc < 3) {
-                fprintf(stderr, "No node name given\n");
-                return EXIT_FAILURE;
-        }
+static int get_unit_properties(Node *node, const char *unit, sd_bus_message_handler_t callback, void *userdata) {
+        _cleanup_free_ char *path = NULL;
+        int r;
 
-        node_name = argv[2];
+        r = sd_bus_path_encode(SYSTEMD_UNIT_OBJECT_PATH_PREFIX, unit, &path);
+        if (r < 0)
+                return r;
 
-        r = sd_event_default(&event);
-        if (r < 0) {
-                fprintf(stderr, "Failed to create event: %s\n", strerror(-r));
-                return EXIT_FAILURE;
-        }
+        return node_call_systemd_method(node,
+                                        path,
+                                        "org.freedesktop.DBus.Properties",
+                                        "GetAll",
+                                        callback, userdata,
+                                        "s", SYSTEMD_UNIT_IFACE);
+}
 
-        node.manager.event = event;
+typedef struct PrepareJob PrepareJob;
+typedef struct PrepareUnit PrepareUnit;
+
+/* A unit the target pulls in, directly or not, that we may start ahead
+ * of the isolate */
+struct PrepareUnit {
+        PrepareJob *prepare;
+        char *name;
+        char **deps;
+        char **conflicts;
+        bool active;
+        bool blocked;  /* conflicts with an active unit, or pulls in one that does */
+        char *job_object_path;
+        JobTracker tracker;
+        LIST_FIELDS(PrepareUnit, units);
+};
 
-        /* Connect to system bus (for talking to systemd) */
+struct PrepareJob {
+        Job job;
+        const char *target; /* owned by source_message */
+        int n_pending;
+        int n_started;
+        int n_failed;
+        bool incomplete; /* ran out of memory walking the dependencies */
+        LIST_HEAD(PrepareUnit, units);
+};
 
-        r = connect_system_systemd(&bus);
-        if (r < 0) {
-                fprintf(stderr, "Failed to connect to system bus: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+static void job_prepare_destroy(Job *job) {
+        PrepareJob *prepare = (PrepareJob *)job;
+
+        while (prepare->units) {
+                PrepareUnit *unit = prepare->units;
+
+                LIST_REMOVE(units, prepare->units, unit);
+                free(unit->name);
+                strv_free(unit->deps);
+                strv_free(unit->conflicts);
+                free(unit->job_object_path);
+                free(unit);
         }
+}
 
-        r = sd_bus_match_signal_async(
-                        bus,
-                        NULL,
-                        "org.freedesktop.DBus.Local",
-                        "/org/freedesktop/DBus/Local",
-                        "org.freedesktop.DBus.Local",
-                        "Disconnected",
-                        system_bus_disconnected, NULL, NULL);
-        if (r < 0) {
-                fprintf(stderr, "Failed to request match for Disconnected message: %s\n", strerror(-r));
-                return 0;
+static void job_prepare_finish(PrepareJob *prepare) {
+        PrepareUnit *unit;
+        int n_active = 0, n_blocked = 0;
+
+        LIST_FOREACH(units, unit, prepare->units) {
+                if (unit->active)
+                        n_active++;
+                else if (unit->blocked)
+                        n_blocked++;
         }
 
-        node.local_bus = bus;
+        printf("Prepared %s: %d units started, %d failed, %d already active, %d left to the isolate due to conflicts\n",
+               prepare->target, prepare->n_started, prepare->n_failed, n_active, n_blocked);
 
-        r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
-        if (r < 0) {
-                fprintf(stderr, "Failed to attach new connection bus to event loop: %s\n", strerror(-r));
-                return 0;
+        prepare->job.result = prepare->n_failed > 0 ? JOB_FAILED : JOB_DONE;
+        manager_finish_job(prepare->job.manager, &prepare->job);
+}
+
+static void job_prepare_unit_done(sd_bus_message *m, const char *result, void *userdata) {
+        PrepareUnit *unit = userdata;
+        PrepareJob *prepare = unit->prepare;
+
+        if (strcmp(result, "done") == 0)
+                prepare->n_started++;
+        else {
+                fprintf(stderr, "Starting %s failed with '%s'\n", unit->name, result);
+                prepare->n_failed++;
         }
 
+        if (--prepare->n_pending == 0)
+                job_prepare_finish(prepare);
+}
 
-        r = sd_bus_call_method(bus,
-                               SYSTEMD_BUS_NAME,
-                               SYSTEMD_OBJECT_PATH,
-                               SYSTEMD_MANAGER_IFACE,
-                               "Subscribe",
-                               &error,
-                               &m,
-                               "");
-        if (r < 0) {
-                fprintf(stderr, "Failed to subscribe call: %s\n", error.message);
-                sd_bus_error_free(&error);
-                return EXIT_FAILURE;
+static int job_prepare_start_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        PrepareUnit *unit = userdata;
+        PrepareJob *prepare = unit->prepare;
+        Node *node = (Node *)prepare->job.manager;
+        const char *job_object_path;
+        int r;
+
+        if (sd_bus_message_is_method_error(m, NULL)) {
+                const sd_bus_error* e = sd_bus_message_get_error(m);
+                fprintf(stderr, "Error starting %s: %s %s\n", unit->name, e->name, e->message);
+                r = -EIO;
+        } else {
+                r = sd_bus_message_read(m, "o", &job_object_path);
+                if (r >= 0) {
+                        unit->job_object_path = strdup(job_object_path);
+                        if (unit->job_object_path == NULL)
+                                r = -ENOMEM;
+                }
         }
 
-        r = sd_bus_match_signal(
-                        bus,
-                        NULL,
-                        SYSTEMD_BUS_NAME,
-                        SYSTEMD_OBJECT_PATH,
-                        SYSTEMD_MANAGER_IFACE,
-                        "JobRemoved",
-                        node_match_job_removed, &node);
         if (r < 0) {
-                fprintf(stderr, "Failed to job-removed peer bus match: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+                prepare->n_failed++;
+                if (--prepare->n_pending == 0)
+                        job_prepare_finish(prepare);
+                return 0;
         }
 
-        /* Connect to orchestrator */
+        node_add_job_tracker(node, &unit->tracker, unit->job_object_path, unit->name,
+                             job_prepare_unit_done, unit);
+        return 0;
+}
+
+static PrepareUnit *job_prepare_find_unit(PrepareJob *prepare, const char *name) {
+        PrepareUnit *unit;
+
+        LIST_FOREACH(units, unit, prepare->units) {
+                if (strcmp(unit->name, name) == 0)
+                        return unit;
+        }
+
+        return NULL;
+}
+
+/* Starting a unit starts what it pulls in too, so it is blocked if any
+ * of that is */
+static void job_prepare_block_dependents(PrepareJob *prepare) {
+        PrepareUnit *unit, *dep;
+        bool changed;
+        char **d;
+
+        do {
+                changed = false;
+                LIST_FOREACH(units, unit, prepare->units) {
+                        if (unit->blocked)
+                                continue;
+                        for (d = unit->deps; d && *d; d++) {
+                                dep = job_prepare_find_unit(prepare, *d);
+                                if (dep != NULL && dep->blocked) {
+                                        unit->blocked = changed = true;
+                                        break;
+                                }
+                        }
+                }
+        } while (changed);
+}
+
+static void job_prepare_start_units(PrepareJob *prepare) {
+        Node *node = (Node *)prepare->job.manager;
+        PrepareUnit *unit;
+        int r;
+
+        job_prepare_block_dependents(prepare);
+
+        /* Hold off finishing until every start has been sent */
+        prepare->n_pending = 1;
+
+        LIST_FOREACH(units, unit, prepare->units) {
+                if (unit->active || unit->blocked)
+                        continue;
+
+                /* "fail" refuses to undo jobs that are already queued */
+                r = node_call_systemd_method(node,
+                                             SYSTEMD_OBJECT_PATH,
+                                             SYSTEMD_MANAGER_IFACE,
+                                             "StartUnit",
+                                             job_prepare_start_cb, unit,
+                                             "ss", unit->name, "fail");
+                if (r < 0) {
+                        fprintf(stderr, "Failed to start %s: %s\n", unit->name, strerror(-r));
+                        prepare->n_failed++;
+                        continue;
+                }
+                prepare->n_pending++;
+        }
+
+        if (--prepare->n_pending == 0)
+                job_prepare_finish(prepare);
+}
+
+static int job_prepare_conflicts_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        PrepareJob *prepare = userdata;
+        const char *name, *active_state;
+        PrepareUnit *unit;
+        int r;
+
+        if (sd_bus_message_is_method_error(m, NULL)) {
+                /* Without knowing what is running, don't touch anything that could conflict */
+                LIST_FOREACH(units, unit, prepare->units) {
+                        if (unit->conflicts != NULL)
+                                unit->blocked = true;
+                }
+        } else {
+                r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(ssssssouso)");
+                while (r >= 0 &&
+                       (r = sd_bus_message_read(m, "(ssssssouso)",
+                                                &name, NULL, NULL, &active_state, NULL,
+                                                NULL, NULL, NULL, NULL, NULL)) > 0) {
+                        if (active_state_is_inactive(active_state))
+                                continue;
+
+                        LIST_FOREACH(units, unit, prepare->units) {
+                                if (strv_contains(unit->conflicts, name))
+                                        unit->blocked = true;
+                        }
+                }
+                if (r < 0)
+                        fprintf(stderr, "Failed to parse unit states: %s\n", strerror(-r));
+        }
+
+        job_prepare_start_units(prepare);
+        return 0;
+}
+
+/* Only units that can run alongside what is active now are started,
+ * stopping anything is left to the isolate */
+static void job_prepare_check_conflicts(PrepareJob *prepare) {
+        Node *node = (Node *)prepare->job.manager;
+        char **conflicts = NULL;
+        PrepareUnit *unit;
+        bool any_conflicts = false;
+        int r = 0;
+
+        /* A unit we didn't look at could conflict with anything */
+        if (prepare->incomplete) {
+                fprintf(stderr, "Failed to walk the dependencies of %s: %s\n", prepare->target, strerror(ENOMEM));
+                prepare->job.result = JOB_FAILED;
+                manager_finish_job(prepare->job.manager, &prepare->job);
+                return;
+        }
+
+        LIST_FOREACH(units, unit, prepare->units) {
+                if (!unit->active && unit->conflicts != NULL)
+                        any_conflicts = true;
+        }
+        if (!any_conflicts) {
+                job_prepare_start_units(prepare);
+                return;
+        }
+
+        LIST_FOREACH(units, unit, prepare->units) {
+                char **c;
+
+                if (unit->active)
+                        continue;
+                for (c = unit->conflicts; r >= 0 && c && *c; c++)
+                        r = strv_append(&conflicts, *c);
+        }
+        if (r >= 0)
+                r = node_call_systemd(node, SYSTEMD_OBJECT_PATH, SYSTEMD_MANAGER_IFACE, "ListUnitsByNames",
+                                      "as", steal_pointer(&conflicts), job_prepare_conflicts_cb, prepare);
+        else
+                strv_free(conflicts);
+        if (r < 0) {
+                fprintf(stderr, "Failed to check for conflicts: %s\n", strerror(-r));
+                prepare->job.result = JOB_FAILED;
+                manager_finish_job(prepare->job.manager, &prepare->job);
+        }
+}
+
+static int job_prepare_unit_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+
+/* Looks at name unless it is the target or was looked at already */
+static void job_prepare_add_unit(PrepareJob *prepare, const char *name) {
+        Node *node = (Node *)prepare->job.manager;
+        PrepareUnit *unit;
+        int r;
+
+        if (strcmp(name, prepare->target) == 0 || job_prepare_find_unit(prepare, name) != NULL)
+                return;
+
+        unit = malloc0(sizeof(PrepareUnit));
+        if (unit == NULL || (unit->name = strdup(name)) == NULL) {
+                free(unit);
+                prepare->incomplete = true;
+                return;
+        }
+        unit->prepare = prepare;
+        LIST_PREPEND(units, prepare->units, unit);
+
+        r = get_unit_properties(node, unit->name, job_prepare_unit_cb, unit);
+        if (r < 0) {
+                fprintf(stderr, "Failed to load %s: %s\n", unit->name, strerror(-r));
+                unit->blocked = true;
+                return;
+        }
+        prepare->n_pending++;
+}
+
+static int job_prepare_unit_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        PrepareUnit *unit = userdata;
+        PrepareJob *prepare = unit->prepare;
+        _cleanup_free_ char *active_state = NULL;
+        char **d;
+        int r;
+
+        if (sd_bus_message_is_method_error(m, NULL)) {
+                const sd_bus_error* e = sd_bus_message_get_error(m);
+                fprintf(stderr, "Error loading %s: %s %s\n", unit->name, e->name, e->message);
+                unit->blocked = true;
+        } else {
+                r = read_unit_properties(m, &active_state, &unit->deps, &unit->conflicts);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to parse properties of %s: %s\n", unit->name, strerror(-r));
+                        unit->blocked = true;
+                } else
+                        unit->active = active_state != NULL && !active_state_is_inactive(active_state);
+        }
+
+        /* The isolate starts everything the target pulls in, not just
+         * its direct dependencies */
+        for (d = unit->deps; d && *d; d++)
+                job_prepare_add_unit(prepare, *d);
+
+        if (--prepare->n_pending == 0)
+                job_prepare_check_conflicts(prepare);
+
+        return 0;
+}
+
+static int job_prepare_target_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        PrepareJob *prepare = userdata;
+        Job *job = &prepare->job;
+        char **deps = NULL, **d;
+        int r;
+
+        if (sd_bus_message_is_method_error(m, NULL)) {
+                const sd_bus_error* e = sd_bus_message_get_error(m);
+                fprintf(stderr, "Error loading %s: %s %s\n", prepare->target, e->name, e->message);
+                r = -EIO;
+        } else
+                r = read_unit_properties(m, NULL, &deps, NULL);
+        if (r < 0) {
+                strv_free(deps);
+                job->result = JOB_FAILED;
+                manager_finish_job(job->manager, job);
+                return 0;
+        }
+
+        /* Hold off the conflict check until the whole closure was looked at */
+        prepare->n_pending = 1;
+
+        for (d = deps; d && *d; d++)
+                job_prepare_add_unit(prepare, *d);
+        strv_free(deps);
+
+        if (--prepare->n_pending == 0)
+                job_prepare_check_conflicts(prepare);
+
+        return 0;
+}
+
+static int job_prepare(Job *job) {
+        Node *node = (Node *)job->manager;
+        PrepareJob *prepare = (PrepareJob *)job;
+        int r;
+
+        printf ("Running job %d, Prepare %s\n", job->id, prepare->target);
+        node_journal_job(node, job, prepare->target);
+
+        r = get_unit_properties(node, prepare->target, job_prepare_target_cb, prepare);
+        if (r < 0) {
+                fprintf(stderr, "Failed to load %s: %s\n", prepare->target, strerror(-r));
+                job->result = JOB_FAILED;
+                manager_finish_job(job->manager, job);
+        }
+
+        return 0;
+}
+
+/* With flow control the orchestrator keeps to our credits, this only
+ * guards against one that doesn't */
+static int node_check_op_credits(Node *node, uint32_t n_ops) {
+        Job *job;
+        uint32_t n_jobs = 0;
+
+        if (!(node->features & NODE_FEATURE_CREDITS))
+                return 0;
+
+        LIST_FOREACH(jobs, job, node->manager.jobs)
+                n_jobs++;
+
+        return n_jobs + n_ops > node->op_credits ? -EBUSY : 0;
+}
+
+/* target must be owned by m */
+static int node_queue_prepare(Node *node, sd_bus_message *m, const char *target, Job **job_out) {
+        Manager *manager = (Manager *)node;
+        Job *job;
+        int r;
+
+        printf("Got Prepare '%s'\n", target);
+
+        r = manager_queue_job(manager, NODE_JOB_PREPARE, sizeof(PrepareJob), m,
+                              job_prepare, NULL, job_prepare_destroy,
+                              &job);
+        if (r < 0)
+                return r;
+        event_log_set_next_job_id(&node->event_log, manager->next_job_id);
+
+        ((PrepareJob *)job)->target = target;
+
+        *job_out = job;
+        return 0;
+}
+
+/* target must be owned by m */
+static int node_queue_isolate(Node *node, sd_bus_message *m, const char *target, Job **job_out) {
+        Manager *manager = (Manager *)node;
+        Job *job;
+        int r;
+
+        printf("Got Isolate '%s'\n", target);
+
+        r = manager_queue_job(manager, NODE_JOB_ISOLATE, sizeof(IsolateJob), m,
+                              job_isolate, NULL, job_isolate_destroy,
+                              &job);
+        if (r < 0)
+                return r;
+        event_log_set_next_job_id(&node->event_log, manager->next_job_id);
+
+        ((IsolateJob *)job)->target = target;
+
+        *job_out = job;
+        return 0;
+}
+
+static int method_node_prepare(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+        const char *target;
+        _cleanup_(job_unrefp) Job *job = NULL;
+        int r;
+
+        r = sd_bus_message_read(m, "s", &target);
+        if (r >= 0)
+                r = node_check_op_credits(node, 1);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to create job: %m");
+
+        r = node_queue_prepare(node, m, target, &job);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to create job: %m");
+
+        return sd_bus_reply_method_return(m, "o", job->object_path);
+}
+
+static int method_node_isolate(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+        const char *target;
+        _cleanup_(job_unrefp) Job *job = NULL;
+        int r;
+
+        r = sd_bus_message_read(m, "s", &target);
+        if (r >= 0)
+                r = node_check_op_credits(node, 1);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to create job: %m");
+
+        r = node_queue_isolate(node, m, target, &job);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to create job: %m");
+
+        return sd_bus_reply_method_return(m, "o", job->object_path);
+}
+
+/* Queues an array of (operation, target) and replies with the job paths,
+ * in the same order. Everything is checked before any job is queued, and
+ * if queueing fails partway the jobs queued so far are taken back. So
+ * either all of the batch runs, or none of it and the call fails. */
+static int method_node_batch(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+        _cleanup_sd_bus_message_ sd_bus_message *reply = NULL;
+        const char *operation, *target;
+        Job *jobs[MAX_NODE_BATCH];
+        uint32_t i, n_ops = 0, n_queued = 0;
+        int r;
+
+        r = sd_bus_message_enter_container(m, 'a', "(ss)");
+        while (r >= 0 && (r = sd_bus_message_read(m, "(ss)", &operation, &target)) > 0) {
+                if (strcmp(operation, "Isolate") != 0 && strcmp(operation, "Prepare") != 0)
+                        return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS,
+                                                          "Unknown operation '%s'", operation);
+                if (++n_ops > MAX_NODE_BATCH)
+                        return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS,
+                                                          "More than %d operations in a batch", MAX_NODE_BATCH);
+        }
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to parse batch: %m");
+
+        printf("Got Batch of %u operations\n", n_ops);
+
+        r = node_check_op_credits(node, n_ops);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to create jobs: %m");
+
+        r = sd_bus_message_rewind(m, true);
+        if (r >= 0)
+                r = sd_bus_message_enter_container(m, 'a', "(ss)");
+        if (r >= 0)
+                r = sd_bus_message_new_method_return(m, &reply);
+        if (r >= 0)
+                r = sd_bus_message_open_container(reply, 'a', "o");
+        for (i = 0; r >= 0 && i < n_ops; i++) {
+                r = sd_bus_message_read(m, "(ss)", &operation, &target);
+                if (r < 0)
+                        break;
+
+                if (strcmp(operation, "Isolate") == 0)
+                        r = node_queue_isolate(node, m, target, &jobs[n_queued]);
+                else
+                        r = node_queue_prepare(node, m, target, &jobs[n_queued]);
+                if (r >= 0)
+                        r = sd_bus_message_append(reply, "o", jobs[n_queued++]->object_path);
+        }
+        if (r >= 0)
+                r = sd_bus_message_close_container(reply);
+        if (r >= 0)
+                r = sd_bus_send(NULL, reply, NULL);
+
+        for (i = 0; i < n_queued; i++) {
+                if (r < 0)
+                        manager_unqueue_job(&node->manager, jobs[i]);
+                job_unref(jobs[i]);
+        }
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to create jobs: %m");
+
+        return 0;
+}
+
+static const sd_bus_vtable node_vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_METHOD("Isolate", "s", "o", method_node_isolate, 0),
+        SD_BUS_METHOD("Prepare", "s", "o", method_node_prepare, 0),
+        SD_BUS_METHOD("Batch", "a(ss)", "ao", method_node_batch, 0),
+        SD_BUS_PROPERTY("SystemdCalls", "t", NULL, offsetof(Node, n_systemd_calls), 0),
+        SD_BUS_PROPERTY("SystemdCallsQueued", "u", NULL, offsetof(Node, n_systemd_calls_queued), 0),
+        SD_BUS_PROPERTY("SystemdCallsInFlight", "u", NULL, offsetof(Node, n_systemd_calls_in_flight), 0),
+        SD_BUS_PROPERTY("SystemdCallWaitUSec", "t", NULL, offsetof(Node, systemd_call_wait_usec), 0),
+        SD_BUS_PROPERTY("SystemdCallMaxWaitUSec", "t", NULL, offsetof(Node, systemd_call_max_wait_usec), 0),
+        SD_BUS_PROPERTY("OperationCredits", "u", NULL, offsetof(Node, op_credits), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("EventCredits", "u", NULL, offsetof(Node, manager.event_credits), 0),
+        SD_BUS_PROPERTY("EventsQueued", "u", NULL, offsetof(Node, manager.n_job_removed_batch), 0),
+        SD_BUS_VTABLE_END
+};
+
+static int
+all_messages_handler (sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+        printf("Incomming message from orchestrator: path: %s, iface: %s, member: %s, signature: '%s'\n",
+               sd_bus_message_get_path (m),
+               sd_bus_message_get_interface (m),
+               sd_bus_message_get_member (m),
+               sd_bus_message_get_signature (m, true));
+        return 0;
+}
+
+static int node_match_job_removed(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+        JobTracker *tracker, *next_tracker;
+        const char *job_path;
+        const char *unit;
+        const char *result;
+        uint32_t id;
+        int r;
+
+        r = sd_bus_message_read(m, "uoss", &id, &job_path, &unit, &result);
+        if (r < 0) {
+                fprintf(stderr, "Can't parse job result\n");
+                return 0;
+        }
+        (void)sd_bus_message_rewind(m, true);
+
+        printf("Removed Job %s %s %s\n", job_path, unit, result);
+
+        LIST_FOREACH_SAFE(trackers, tracker, next_tracker, node->trackers) {
+                if (strcmp(tracker->object_path, job_path) == 0) {
+                        tracker->callback(m, result, tracker->userdata);
+                        LIST_REMOVE(trackers, node->trackers, tracker);
+                }
+        }
+
+        return 0;
+}
+
+static int node_match_job_new(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+        const char *job_path;
+        const char *unit;
+        uint32_t id;
+        int r;
+
+        if (node->isolated_target == NULL)
+                return 0;
+
+        r = sd_bus_message_read(m, "uos", &id, &job_path, &unit);
+        if (r < 0) {
+                fprintf(stderr, "Can't parse new job\n");
+                return 0;
+        }
+        (void)sd_bus_message_rewind(m, true);
+
+        /* Jobs queued while an isolate runs are part of it, the
+         * isolate job reaching "done" re-establishes the target */
+        printf("New job %s for %s, no longer known to be isolated to %s\n", job_path, unit, node->isolated_target);
+        node_set_isolated_target(node, NULL);
+
+        return 0;
+}
+
+/* Reads the share of time in the last 10s some task stalled on resource */
+static int read_pressure(Node *node, PressureResource resource, double *avg10) {
+        _cleanup_free_ char *path = NULL;
+        FILE *f;
+        int r;
+
+        if (asprintf(&path, "%s/%s", node->psi_dir, pressure_resource_table[resource]) < 0)
+                return -ENOMEM;
+
+        f = fopen(path, "re");
+        if (f == NULL)
+                return -errno;
+
+        r = fscanf(f, "some avg10=%lf", avg10);
+        fclose(f);
+
+        return r == 1 ? 0 : -EINVAL;
+}
+
+static int psi_timer_cb(sd_event_source *s, uint64_t usec, void *userdata) {
+        Node *node = userdata;
+
+        manager_retry_admission(&node->manager);
+        return 0;
+}
+
+static void node_admit_held_job(Node *node, Job *job, uint64_t now) {
+        Manager *manager = &node->manager;
+
+        if (node->held_job_id != job->id)
+                return;
+
+        printf("Admitting job %d after holding it for %" PRIu64 " ms\n",
+               job->id, (now - node->held_since_usec) / 1000);
+        if (!manager->paused)
+                (void) sd_bus_emit_signal(manager->bus, manager->manager_path, manager->manager_iface,
+                                  "JobAdmitted", "uo", job->id, job->object_path);
+        node->held_job_id = 0;
+}
+
+static bool node_admit_job(Manager *manager, Job *job) {
+        Node *node = (Node *)manager;
+        PressureResource resource;
+        double pressure = 0;
+        uint64_t now;
+        int r;
+
+        /* Without a subscription we would miss the job's completion */
+        if (!node->systemd_subscribed)
+                return false;
+        if (node->resumed_job_id != 0)
+                return false;
+
+        (void) sd_event_now(manager->event, CLOCK_MONOTONIC, &now);
+
+        for (resource = 0; resource < _PRESSURE_MAX; resource++) {
+                if (node->psi_threshold[resource] <= 0)
+                        continue;
+
+                /* Without PSI in the kernel there is nothing to hold for */
+                if (read_pressure(node, resource, &pressure) < 0)
+                        continue;
+                if (pressure > node->psi_threshold[resource])
+                        break;
+        }
+
+        if (resource == _PRESSURE_MAX) {
+                node_admit_held_job(node, job, now);
+                return true;
+        }
+
+        if (node->held_job_id != job->id) {
+                printf("Holding job %d: %s pressure %.1f%% is above %.1f%%\n",
+                       job->id, pressure_resource_table[resource], pressure, node->psi_threshold[resource]);
+                node->held_job_id = job->id;
+                node->held_since_usec = now;
+                if (!manager->paused)
+                        (void) sd_bus_emit_signal(manager->bus, manager->manager_path, manager->manager_iface,
+                                                  "JobHeld", "uosd", job->id, job->object_path,
+                                                  pressure_resource_table[resource], pressure);
+        } else if (node->psi_max_hold_usec > 0 && now - node->held_since_usec >= node->psi_max_hold_usec) {
+                printf("Job %d held too long, starting it under %s pressure\n",
+                       job->id, pressure_resource_table[resource]);
+                node_admit_held_job(node, job, now);
+                return true;
+        }
+
+        if (node->psi_timer == NULL) {
+                r = sd_event_add_time_relative(manager->event, &node->psi_timer, CLOCK_MONOTONIC,
+                                               PSI_POLL_INTERVAL, 0, psi_timer_cb, node);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to add pressure timer: %s\n", strerror(-r));
+                        node_admit_held_job(node, job, now);
+                        return true;
+                }
+        } else {
+                (void) sd_event_source_set_time_relative(node->psi_timer, PSI_POLL_INTERVAL);
+                (void) sd_event_source_set_enabled(node->psi_timer, SD_EVENT_ONESHOT);
+        }
+
+        return false;
+}
+
+static void node_startup_step_done(Node *node) {
+        uint64_t ready_usec;
+
+        if (node->subscribed_usec == 0 || node->registered_usec == 0)
+                return;
+
+        ready_usec = node->subscribed_usec > node->registered_usec ? node->subscribed_usec : node->registered_usec;
+        printf("Ready in %.1f ms (subscribed after %.1f ms, connected after %.1f ms, registered after %.1f ms)\n",
+               (ready_usec - node->start_usec) / 1000.0,
+               (node->subscribed_usec - node->start_usec) / 1000.0,
+               (node->connected_usec - node->start_usec) / 1000.0,
+               (node->registered_usec - node->start_usec) / 1000.0);
+}
+
+static void node_finish_resumed_job(Node *node, JobResult result) {
+        EventLogJob *j = &node->event_log.header->running_job;
+        uint32_t id = node->resumed_job_id;
+        int r;
+
+        printf("Job %u from before the restart finished, result: %s\n", id, job_result_to_string(result));
+
+        if (j->type == NODE_JOB_ISOLATE)
+                node_set_isolated_target(node, result == JOB_DONE ? j->target : NULL);
+
+        /* Until the session is resumed the log is all there is, EventsAcked sends it on */
+        (void) event_log_append(&node->event_log, id, result);
+        event_log_clear_running_job(&node->event_log, id);
+        if (node->registered_usec != 0 && !node->replaying) {
+                r = manager_queue_job_removed(&node->manager, id, result);
+                if (r < 0)
+                        fprintf(stderr, "Failed to queue result of job %u: %s\n", id, strerror(-r));
+        }
+
+        node->resumed_job_id = 0;
+        free(node->resumed_job_path);
+        node->resumed_job_path = NULL;
+        manager_retry_admission(&node->manager);
+}
+
+static void node_resumed_job_done(sd_bus_message *m, const char *result, void *userdata) {
+        Node *node = userdata;
+
+        node_finish_resumed_job(node, strcmp(result, "done") == 0 ? JOB_DONE : JOB_FAILED);
+}
+
+static int node_resumed_target_state_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+        const char *active_state;
+        uint32_t job_id;
+        bool active = false;
+        int r;
+
+        r = sd_bus_message_is_method_error(m, NULL) ? -EIO :
+                sd_bus_message_read(m, "a(ssssssouso)", 1,
+                                    NULL, NULL, NULL, &active_state, NULL,
+                                    NULL, NULL, &job_id, NULL, NULL);
+        if (r > 0)
+                active = strcmp(active_state, "active") == 0 && job_id == 0;
+
+        node_finish_resumed_job(node, active ? JOB_DONE : JOB_FAILED);
+        return 0;
+}
+
+/* With the systemd job gone, the state it left the target in is all
+ * that tells how it went */
+static void node_check_resumed_target(Node *node) {
+        EventLogJob *j = &node->event_log.header->running_job;
+        int r;
+
+        /* Which units a prepare got to start is not known */
+        if (j->type != NODE_JOB_ISOLATE) {
+                node_finish_resumed_job(node, JOB_FAILED);
+                return;
+        }
+
+        r = node_call_systemd_method(node,
+                                     SYSTEMD_OBJECT_PATH,
+                                     SYSTEMD_MANAGER_IFACE,
+                                     "ListUnitsByNames",
+                                     node_resumed_target_state_cb, node,
+                                     "as", 1, j->target);
+        if (r < 0) {
+                fprintf(stderr, "Failed to check %s: %s\n", j->target, strerror(-r));
+                node_finish_resumed_job(node, JOB_FAILED);
+        }
+}
+
+static int node_resumed_get_job_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+        const char *job_object_path;
+        int r;
+
+        if (sd_bus_message_is_method_error(m, NULL)) {
+                const sd_bus_error* e = sd_bus_message_get_error(m);
+                if (!sd_bus_error_has_name(e, "org.freedesktop.systemd1.NoSuchJob"))
+                        fprintf(stderr, "Error looking up job: %s %s\n", e->name, e->message);
+                r = -ENOENT;
+        } else {
+                r = sd_bus_message_read(m, "o", &job_object_path);
+                if (r >= 0) {
+                        node->resumed_job_path = strdup(job_object_path);
+                        if (node->resumed_job_path == NULL)
+                                r = -ENOMEM;
+                }
+        }
+
+        if (r < 0) {
+                node_check_resumed_target(node);
+                return 0;
+        }
+
+        /* The subscription is older than this reply, so JobRemoved can't have passed us */
+        printf("Tracking job %u again, systemd job %s\n", node->resumed_job_id, node->resumed_job_path);
+        node_add_job_tracker(node, &node->resumed_tracker, node->resumed_job_path,
+                             node->event_log.header->running_job.target,
+                             node_resumed_job_done, node);
+        return 0;
+}
+
+/* Picks up the job that was running when the node went down, without
+ * starting it again */
+static void node_resume_journaled_job(Node *node) {
+        EventLogJob *j = &node->event_log.header->running_job;
+        int r;
+
+        if (j->id == 0 || node->resumed_job_id != 0)
+                return;
+
+        j->target[sizeof(j->target) - 1] = '\0';
+        node->resumed_job_id = j->id;
+
+        /* systemd numbers its jobs afresh on each boot, and the reboot
+         * ended ours */
+        if (event_log_running_job_is_stale(&node->event_log)) {
+                printf("Job %u was running before a reboot, discarding it\n", j->id);
+                node_finish_resumed_job(node, JOB_FAILED);
+                return;
+        }
+
+        printf("Job %u was running before the restart, checking on it\n", j->id);
+
+        if (j->systemd_job_id == 0) {
+                node_check_resumed_target(node);
+                return;
+        }
+
+        r = node_call_systemd_method(node,
+                                     SYSTEMD_OBJECT_PATH,
+                                     SYSTEMD_MANAGER_IFACE,
+                                     "GetJob",
+                                     node_resumed_get_job_cb, node,
+                                     "u", j->systemd_job_id);
+        if (r < 0) {
+                fprintf(stderr, "Failed to look up job: %s\n", strerror(-r));
+                node_check_resumed_target(node);
+        }
+}
+
+static int node_subscribe_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+
+        /* On the system bus systemd remembers subscriptions over a reexec */
+        if (sd_bus_message_is_method_error(m, NULL) &&
+            !sd_bus_message_is_method_error(m, "org.freedesktop.systemd1.AlreadySubscribed")) {
+                fprintf(stderr, "Failed to subscribe call: %s\n", sd_bus_message_get_error(m)->message);
+                if (node->subscribed_usec == 0)
+                        sd_event_exit(node->manager.event, EXIT_FAILURE);
+                return 0;
+        }
+
+        node->systemd_subscribed = true;
+        if (node->subscribed_usec == 0) {
+                (void) sd_event_now(node->manager.event, CLOCK_MONOTONIC, &node->subscribed_usec);
+                node_startup_step_done(node);
+
+                node_resume_journaled_job(node);
+        }
+
+        /* Jobs queued meanwhile can run now */
+        manager_retry_admission(&node->manager);
+        return 0;
+}
+
+static void node_lost_orchestrator(Node *node);
+static void node_fail_back(Node *node);
+static int node_send_register(Node *node, sd_bus *bus);
+
+/* The orchestrator doesn't know our session, results from it mean
+ * nothing to the one it starts next */
+static int node_register_afresh(Node *node) {
+        if (node->manager.n_job_removed_batch > 0)
+                printf("Registering afresh, dropping %u held back job results\n",
+                       node->manager.n_job_removed_batch);
+        else
+                printf("Registering afresh\n");
+
+        manager_clear_job_removed(&node->manager);
+        node->session = SD_ID128_NULL;
+        node->replaying = false;
+
+        return node_send_register(node, node->manager.bus);
+}
+
+static int node_register_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+        uint32_t protocol_version;
+        int r;
+
+        if (sd_bus_message_is_method_error(m, NULL)) {
+                bool resuming = !sd_id128_is_null(node->session);
+
+                fprintf(stderr, "Failed to %s: %s\n", resuming ? "resume session" : "register",
+                        sd_bus_message_get_error(m)->message);
+                /* The standby may know the session, or become the active one */
+                if (sd_bus_error_has_name(sd_bus_message_get_error(m), ORCHESTRATOR_ERROR_STANDBY))
+                        node_fail_back(node);
+                else if (node->registered_usec != 0 && node->standby_bus != NULL)
+                        node_lost_orchestrator(node);
+                else if (resuming) {
+                        r = node_register_afresh(node);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to register: %s\n", strerror(-r));
+                                sd_event_exit(node->manager.event, EXIT_FAILURE);
+                        }
+                } else
+                        sd_event_exit(node->manager.event, EXIT_FAILURE);
+                return 0;
+        }
+
+        /* Orchestrators that predate negotiation reply with nothing */
+        if (sd_bus_message_at_end(m, true) > 0) {
+                protocol_version = 0;
+                node->features = 0;
+                r = 0;
+        } else
+                r = sd_bus_message_read(m, "ut", &protocol_version, &node->features);
+        if (r < 0) {
+                fprintf(stderr, "Failed to parse register reply: %s\n", strerror(-r));
+                sd_event_exit(node->manager.event, EXIT_FAILURE);
+                return 0;
+        }
+        node->features &= NODE_FEATURES_SUPPORTED;
+        node->manager.quiet_job_new = (node->features & NODE_FEATURE_QUIET_JOB_NEW) != 0;
+        /* Event credits are counted in JobsRemoved signals */
+        node->manager.event_credits_enabled = (node->features & NODE_FEATURE_CREDITS) != 0;
+        /* Handoff and reconnects hold events back in the batch */
+        node->manager.batch_job_removed = (node->features & (NODE_FEATURE_JOBS_REMOVED | NODE_FEATURE_CREDITS |
+                                                             NODE_FEATURE_HANDOFF | NODE_FEATURE_SESSION)) != 0;
+
+        /* Whatever we held back waits for EventsAcked, or for Session if
+         * the orchestrator has forgotten the session */
+        if (!sd_id128_is_null(node->session) && (node->features & NODE_FEATURE_REPLAY)) {
+                node->replaying = true;
+                node->manager.paused = true;
+        }
+
+        if (node->registered_usec != 0) {
+                printf("Registered again as '%s'\n", node->name);
+
+                /* Granted again by the orchestrator */
+                node->manager.event_credits = 0;
+                if (!node->replaying) {
+                        node->manager.paused = false;
+                        r = manager_flush_job_removed(&node->manager);
+                        if (r < 0)
+                                fprintf(stderr, "Failed to send JobsRemoved signal: %s\n", strerror(-r));
+                }
+                return 0;
+        }
+
+        printf("Registered as '%s' (orchestrator protocol %u, features 0x%" PRIx64 ")\n",
+               node->name, protocol_version, node->features);
+
+        (void) sd_event_now(node->manager.event, CLOCK_MONOTONIC, &node->registered_usec);
+        node_startup_step_done(node);
+        return 0;
+}
+
+/* Sent along with Register, so the orchestrator needs no extra round
+ * trips to learn about us */
+static int node_append_inventory(Node *node, sd_bus_message *m) {
+        static const char * const capabilities[] = { "Isolate", "Prepare", NULL };
+        size_t i;
+        int r;
+
+        r = sd_bus_message_append(m, "u", NODE_INVENTORY_VERSION);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_open_container(m, 'a', "{sv}");
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_append(m, "{sv}", "AgentVersion", "s", ORCH_VERSION);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_append(m, "{sv}", "ProtocolVersion", "u", NODE_PROTOCOL_VERSION);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_append(m, "{sv}", "Features", "t", (uint64_t) NODE_FEATURES_SUPPORTED);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_append(m, "{sv}", "OperationCredits", "u", node->op_credits);
+        if (r < 0)
+                return r;
+
+        if (!sd_id128_is_null(node->session)) {
+                char token[SD_ID128_STRING_MAX];
+
+                r = sd_bus_message_append(m, "{sv}", "SessionToken", "s", sd_id128_to_string(node->session, token));
+                if (r < 0)
+                        return r;
+        }
+
+        r = sd_bus_message_open_container(m, 'e', "sv");
+        if (r < 0)
+                return r;
+        r = sd_bus_message_append(m, "s", "Capabilities");
+        if (r < 0)
+                return r;
+        r = sd_bus_message_open_container(m, 'v', "as");
+        if (r < 0)
+                return r;
+        r = sd_bus_message_append_strv(m, (char **)capabilities);
+        if (r < 0)
+                return r;
+        r = sd_bus_message_close_container(m);
+        if (r < 0)
+                return r;
+        r = sd_bus_message_close_container(m);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_open_container(m, 'e', "sv");
+        if (r < 0)
+                return r;
+        r = sd_bus_message_append(m, "s", "Labels");
+        if (r < 0)
+                return r;
+        r = sd_bus_message_open_container(m, 'v', "a{ss}");
+        if (r < 0)
+                return r;
+        r = sd_bus_message_open_container(m, 'a', "{ss}");
+        if (r < 0)
+                return r;
+        for (i = 0; i < node->n_labels; i++) {
+                const char *eq = strchr(node->labels[i], '=');
+                _cleanup_free_ char *key = strndup(node->labels[i], eq - node->labels[i]);
+
+                if (key == NULL)
+                        return -ENOMEM;
+
+                r = sd_bus_message_append(m, "{ss}", key, eq + 1);
+                if (r < 0)
+                        return r;
+        }
+        r = sd_bus_message_close_container(m);
+        if (r < 0)
+                return r;
+        r = sd_bus_message_close_container(m);
+        if (r < 0)
+                return r;
+        r = sd_bus_message_close_container(m);
+        if (r < 0)
+                return r;
+
+        return sd_bus_message_close_container(m);
+}
+
+/* Queued until the connection is authenticated */
+static int node_send_register(Node *node, sd_bus *bus) {
+        _cleanup_sd_bus_message_ sd_bus_message *m = NULL;
+        int r;
+
+        r = sd_bus_message_new_method_call(bus,
+                                           &m,
+                                           ORCHESTRATOR_BUS_NAME,
+                                           ORCHESTRATOR_OBJECT_PATH,
+                                           ORCHESTRATOR_PEER_IFACE,
+                                           "RegisterWithInventory");
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_append(m, "s", node->name);
+        if (r < 0)
+                return r;
+
+        r = node_append_inventory(node, m);
+        if (r < 0)
+                return r;
+
+        return sd_bus_call_async(bus, NULL, m, node_register_cb, node, 0);
+}
+
+static int orchestrator_event_credits(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+        uint32_t n;
+        int r;
+
+        r = sd_bus_message_read(m, "u", &n);
+        if (r < 0) {
+                fprintf(stderr, "Can't parse EventCredits\n");
+                return 0;
+        }
+
+        manager_add_event_credits(&node->manager, n);
+        return 0;
+}
+
+static void node_stop_replaying(Node *node) {
+        int r;
+
+        node->replaying = false;
+        node->manager.paused = false;
+        r = manager_flush_job_removed(&node->manager);
+        if (r < 0)
+                fprintf(stderr, "Failed to send JobsRemoved signal: %s\n", strerror(-r));
+}
+
+/* A new session, results from before it mean nothing to the orchestrator */
+static int orchestrator_session(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+        const char *token;
+        int r;
+
+        r = sd_bus_message_read(m, "s", &token);
+        if (r >= 0)
+                r = sd_id128_from_string(token, &node->session);
+        if (r < 0) {
+                fprintf(stderr, "Can't parse Session\n");
+                return 0;
+        }
+
+        event_log_reset(&node->event_log, node->session);
+
+        if (node->replaying) {
+                printf("Orchestrator started a new session, dropping %u held back job results\n",
+                       node->manager.n_job_removed_batch);
+                manager_clear_job_removed(&node->manager);
+                node_stop_replaying(node);
+        }
+
+        return 0;
+}
+
+static int orchestrator_events_acked(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+        Manager *manager = &node->manager;
+        EventLog *log = &node->event_log;
+        uint64_t n_received, seq, last_seq;
+        uint32_t i;
+        int r;
+
+        r = sd_bus_message_read(m, "t", &n_received);
+        if (r < 0) {
+                fprintf(stderr, "Can't parse EventsAcked\n");
+                return 0;
+        }
+
+        event_log_ack(log, n_received);
+        if (!node->replaying)
+                return 0;
+
+        /* The batch is rebuilt from what the orchestrator didn't get */
+        manager_clear_job_removed(manager);
+        last_seq = log->header->last_seq;
+        for (seq = log->header->acked_seq + 1; seq <= last_seq; seq++) {
+                const EventLogEntry *e = event_log_get(log, seq);
+
+                if (e != NULL && manager_queue_job_removed(manager, e->id, e->result) < 0)
+                        fprintf(stderr, "Failed to replay result of job %u\n", e->id);
+        }
+
+        /* Numbered on from its count, whatever was dropped meanwhile */
+        event_log_rebase(log, n_received);
+        for (i = 0; i < manager->n_job_removed_batch; i++)
+                (void) event_log_append(log, manager->job_removed_batch[i].id, manager->job_removed_batch[i].result);
+
+        printf("Orchestrator has %" PRIu64 " job results, sending %u again\n",
+               n_received, manager->n_job_removed_batch);
+        if (log->n_dropped > 0)
+                fprintf(stderr, "Dropped %" PRIu64 " job results the orchestrator never got\n", log->n_dropped);
+
+        node_stop_replaying(node);
+        return 0;
+}
+
+static void node_job_removed(Manager *manager, Job *job) {
+        Node *node = (Node *)manager;
+
+        if (node->features & NODE_FEATURE_REPLAY)
+                (void) event_log_append(&node->event_log, job->id, job->result);
+        event_log_clear_running_job(&node->event_log, job->id);
+}
+
+static int node_connect_orchestrator(Node *node, const char *address, int port);
+static int node_fail_over(Node *node);
+
+static int node_reconnect(sd_event_source *s, uint64_t usec, void *userdata);
+
+static void node_schedule_reconnect(Node *node) {
+        int r;
+
+        if (node->reconnect_timer != NULL)
+                return;
+
+        r = sd_event_add_time_relative(node->manager.event, &node->reconnect_timer, CLOCK_MONOTONIC,
+                                       NODE_RECONNECT_INTERVAL, 0, node_reconnect, node);
+        if (r < 0) {
+                fprintf(stderr, "Failed to add reconnect timer: %s\n", strerror(-r));
+                sd_event_exit(node->manager.event, EXIT_FAILURE);
+        }
+}
+
+static int node_reconnect(sd_event_source *s, uint64_t usec, void *userdata) {
+        Node *node = userdata;
+        int r;
+
+        node->reconnect_timer = sd_event_source_disable_unref(node->reconnect_timer);
+
+        r = node_connect_orchestrator(node, node->orchestrator_address, node->orchestrator_port);
+        if (r < 0) {
+                fprintf(stderr, "Failed to reconnect to orchestrator: %s\n", strerror(-r));
+                node_schedule_reconnect(node);
+        }
+
+        return 0;
+}
+
+/* A standby takes over our session, the active one may just restart */
+static void node_lost_orchestrator(Node *node) {
+        int r;
+
+        node->manager.paused = true;
+
+        if (node->standby_bus != NULL) {
+                r = node_fail_over(node);
+                if (r >= 0)
+                        return;
+                fprintf(stderr, "Failed to fail over to standby orchestrator: %s\n", strerror(-r));
+        }
+
+        node_schedule_reconnect(node);
+}
+
+static int orchestrator_disconnected(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+
+        printf("Orchestrator disconnected\n");
+
+        /* Nobody to register with */
+        if (node->registered_usec == 0) {
+                fprintf(stderr, "Failed to connect to orchestrator\n");
+                sd_event_exit(node->manager.event, EXIT_FAILURE);
+                return 0;
+        }
+
+        /* Jobs keep running, their events wait for the new connection */
+        if (!sd_id128_is_null(node->session))
+                node_lost_orchestrator(node);
+
+        return 0;
+}
+
+static int node_start_orchestrator_bus(Node *node, int fd, bool do_register);
+
+/* The old orchestrator has stopped reading, the new one has the
+ * connection. Everything from here on is for the new one. */
+static int node_handoff_ready_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+        Manager *manager = &node->manager;
+        _cleanup_sd_bus_ sd_bus *old = NULL;
+        int fd, r;
+
+        if (sd_bus_message_is_method_error(m, NULL)) {
+                fprintf(stderr, "Orchestrator handoff canceled: %s\n", sd_bus_message_get_error(m)->message);
+                manager->paused = false;
+                (void) manager_flush_job_removed(manager);
+                return 0;
+        }
+
+        fd = fcntl(sd_bus_get_fd(manager->bus), F_DUPFD_CLOEXEC, 3);
+        if (fd < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        /* Detached before the fd closes, the dup keeps it in epoll otherwise */
+        old = steal_pointer(&manager->bus);
+        (void) sd_bus_detach_event(old);
+        sd_bus_close(old);
+
+        r = node_start_orchestrator_bus(node, fd, false); /* The bus closes fd from here on */
+        if (r < 0)
+                goto fail;
+
+        printf("Connection handed off to new orchestrator\n");
+
+        /* Queued until authenticated */
+        manager->paused = false;
+        r = manager_flush_job_removed(manager);
+        if (r < 0)
+                fprintf(stderr, "Failed to send JobsRemoved signal: %s\n", strerror(-r));
+        return 0;
+
+fail:
+        fprintf(stderr, "Failed to follow orchestrator handoff: %s\n", strerror(-r));
+        sd_event_exit(manager->event, EXIT_FAILURE);
+        return 0;
+}
+
+/* The orchestrator is being upgraded and passes our connection on */
+static int orchestrator_handoff(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+        Manager *manager = &node->manager;
+        int r;
+
+        if (manager->paused)
+                return 0;
+
+        /* What the credits allow goes out now, the rest to the new instance */
+        r = manager_flush_job_removed(manager);
+        if (r < 0)
+                fprintf(stderr, "Failed to send JobsRemoved signal: %s\n", strerror(-r));
+
+        r = sd_bus_call_method_async(manager->bus, NULL, ORCHESTRATOR_BUS_NAME, ORCHESTRATOR_OBJECT_PATH,
+                                     ORCHESTRATOR_PEER_IFACE, "HandoffReady",
+                                     node_handoff_ready_cb, node, "");
+        if (r < 0) {
+                fprintf(stderr, "Failed to answer orchestrator handoff: %s\n", strerror(-r));
+                return 0;
+        }
+
+        printf("Orchestrator is handing off the connection\n");
+        manager->paused = true;
+        return 0;
+}
+
+/* Sets up a connection to an orchestrator on fd, the bus closes fd from
+ * here on. Nothing is sent on it until authenticated. */
+static int node_new_orchestrator_bus(Node *node, int fd, sd_bus **ret) {
+        _cleanup_sd_bus_ sd_bus *orch = NULL;
+        int r;
+
+        r = sd_bus_new(&orch);
+        if (r < 0) {
+                close(fd);
+                return r;
+        }
+
+        (void) sd_bus_set_description(orch, "orchestrator");
+        r = sd_bus_set_trusted (orch, true); /* we trust everything from the orchestrator, there is only one peer anyway */
+        if (r < 0) {
+                close(fd);
+                return r;
+        }
+
+        r = sd_bus_set_fd(orch, fd, fd);
+        if (r < 0) {
+                close(fd);
+                return r;
+        }
+
+        r = sd_bus_start(orch);
+        if (r < 0)
+                return r;
+
+        if (DEBUG_DBUS_MESSAGES)
+                sd_bus_add_filter(orch, NULL, all_messages_handler, NULL);
+
+        r = sd_bus_attach_event(orch, node->manager.event, SD_EVENT_PRIORITY_NORMAL);
+        if (r < 0)
+                return r;
+
+        *ret = steal_pointer(&orch);
+        return 0;
+}
+
+/* Makes orch the connection we work for, taking it over on success.
+ * Without register, we resume a registration a previous orchestrator
+ * instance handed off to it. */
+static int node_setup_orchestrator_bus(Node *node, sd_bus **orchp, bool do_register) {
+        sd_bus *orch = *orchp;
+        int r;
+
+        r = sd_bus_match_signal_async(
+                        orch,
+                        NULL,
+                        "org.freedesktop.DBus.Local",
+                        "/org/freedesktop/DBus/Local",
+                        "org.freedesktop.DBus.Local",
+                        "Disconnected",
+                        orchestrator_disconnected, NULL, node);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_match_signal_async(
+                        orch,
+                        NULL,
+                        NULL,
+                        ORCHESTRATOR_OBJECT_PATH,
+                        ORCHESTRATOR_PEER_IFACE,
+                        "EventCredits",
+                        orchestrator_event_credits, NULL, node);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_match_signal_async(
+                        orch,
+                        NULL,
+                        NULL,
+                        ORCHESTRATOR_OBJECT_PATH,
+                        ORCHESTRATOR_PEER_IFACE,
+                        "Handoff",
+                        orchestrator_handoff, NULL, node);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_match_signal_async(
+                        orch,
+                        NULL,
+                        NULL,
+                        ORCHESTRATOR_OBJECT_PATH,
+                        ORCHESTRATOR_PEER_IFACE,
+                        "Session",
+                        orchestrator_session, NULL, node);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_match_signal_async(
+                        orch,
+                        NULL,
+                        NULL,
+                        ORCHESTRATOR_OBJECT_PATH,
+                        ORCHESTRATOR_PEER_IFACE,
+                        "EventsAcked",
+                        orchestrator_events_acked, NULL, node);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_add_object_vtable(orch,
+                                     NULL,
+                                     NODE_PEER_OBJECT_PATH,
+                                     NODE_PEER_IFACE,
+                                     node_vtable,
+                                     node);
+        if (r < 0)
+                return r;
+
+        if (!do_register) {
+                node->manager.bus = steal_pointer(orchp);
+                return 0;
+        }
+
+        r = node_send_register(node, orch);
+        if (r < 0)
+                return r;
+
+        /* The connection we lost, when reconnecting */
+        sd_bus_close_unref(node->manager.bus);
+        node->manager.bus = steal_pointer(orchp);
+        return 0;
+}
+
+static int node_start_orchestrator_bus(Node *node, int fd, bool do_register) {
+        _cleanup_sd_bus_ sd_bus *orch = NULL;
+        int r;
+
+        r = node_new_orchestrator_bus(node, fd, &orch);
+        if (r < 0)
+                return r;
+
+        return node_setup_orchestrator_bus(node, &orch, do_register);
+}
+
+/* A TCP connect in the background, trying the addresses of host one
+ * after the other. getaddrinfo() can block for as long as DNS takes, so
+ * anything but an address is resolved in a thread, which closes its end
+ * of resolve_fds once done. */
+typedef void (*tcp_connect_handler_t)(Node *node, int fd); /* fd, or a negative errno */
+
+struct TcpConnect {
+        Node *node;
+        tcp_connect_handler_t handler;       /* NULL once freed while resolving */
+        char *host;
+        char port[16];
+        bool resolving;
+        pthread_t resolver;
+        int resolve_fds[2];
+        int resolve_error;                   /* set by the resolver */
+        struct addrinfo *addresses;
+        struct addrinfo *address;            /* being tried */
+        int fd;
+        int error;                           /* of the last address tried */
+        sd_event_source *source;
+        sd_event_source *timer;
+};
+
+/* Stops the connect. The resolver can't be stopped, while it runs only
+ * the handler is dropped and the rest goes once it is done. */
+static TcpConnect *tcp_connect_free(TcpConnect *c) {
+        if (c == NULL)
+                return NULL;
+
+        if (c->resolving) {
+                c->handler = NULL;
+                return NULL;
+        }
+
+        sd_event_source_disable_unref(c->source);
+        sd_event_source_disable_unref(c->timer);
+        closep(&c->fd);
+        closep(&c->resolve_fds[0]);
+        if (c->addresses != NULL)
+                freeaddrinfo(c->addresses);
+        free(c->host);
+        free(c);
+        return NULL;
+}
+
+static int tcp_connect_io(sd_event_source *s, int fd, uint32_t revents, void *userdata);
+static int tcp_connect_timeout(sd_event_source *s, uint64_t usec, void *userdata);
+
+/* Starts connecting to the next address, a negative errno if none is left */
+static int tcp_connect_next(TcpConnect *c) {
+        int r;
+
+        for (; c->address != NULL; c->address = c->address->ai_next) {
+                c->source = sd_event_source_disable_unref(c->source);
+                c->timer = sd_event_source_disable_unref(c->timer);
+                closep(&c->fd);
+
+                c->fd = socket(c->address->ai_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+                if (c->fd < 0 || (connect(c->fd, c->address->ai_addr, c->address->ai_addrlen) < 0 &&
+                                  errno != EINPROGRESS)) {
+                        c->error = -errno;
+                        continue;
+                }
+
+                r = sd_event_add_io(c->node->manager.event, &c->source, c->fd, EPOLLOUT, tcp_connect_io, c);
+                if (r >= 0)
+                        r = sd_event_add_time_relative(c->node->manager.event, &c->timer, CLOCK_MONOTONIC,
+                                                       NODE_CONNECT_TIMEOUT, 1, tcp_connect_timeout, c);
+                if (r >= 0)
+                        return 0;
+                c->error = r;
+        }
+
+        return c->error;
+}
+
+/* Calls back with the connected fd, or on error moves on to the next
+ * address and calls back once none is left */
+static void tcp_connect_done(TcpConnect *c, int error) {
+        int r;
+
+        if (error == 0) {
+                r = c->fd;
+                c->fd = -1; /* The handler's, which frees c */
+        } else {
+                c->error = error;
+                c->address = c->address->ai_next;
+                r = tcp_connect_next(c);
+                if (r >= 0)
+                        return;
+        }
+
+        c->handler(c->node, r);
+}
+
+static int tcp_connect_io(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        TcpConnect *c = userdata;
+        socklen_t len = sizeof(int);
+        int error = 0;
+
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+                error = errno;
+
+        tcp_connect_done(c, -error);
+        return 0;
+}
+
+static int tcp_connect_timeout(sd_event_source *s, uint64_t usec, void *userdata) {
+        TcpConnect *c = userdata;
+
+        tcp_connect_done(c, -ETIMEDOUT);
+        return 0;
+}
+
+static void *tcp_connect_resolve(void *userdata) {
+        TcpConnect *c = userdata;
+        struct addrinfo hints = {
+                .ai_socktype = SOCK_STREAM,
+        };
+        int r;
+
+        r = getaddrinfo(c->host, c->port, &hints, &c->addresses);
+        if (r != 0)
+                c->resolve_error = r == EAI_SYSTEM ? -errno : -EHOSTUNREACH;
+        close(c->resolve_fds[1]);
+        return NULL;
+}
+
+static int tcp_connect_resolved(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        TcpConnect *c = userdata;
+        int r;
+
+        (void) pthread_join(c->resolver, NULL);
+        c->resolving = false;
+        c->source = sd_event_source_disable_unref(c->source);
+        if (c->handler == NULL) {
+                tcp_connect_free(c);
+                return 0;
+        }
+
+        c->address = c->addresses;
+        r = c->resolve_error;
+        if (r >= 0)
+                r = tcp_connect_next(c);
+        if (r < 0)
+                c->handler(c->node, r);
+
+        return 0;
+}
+
+/* Starts a non-blocking TCP connect, calling back once it is done */
+static int tcp_connect_new(Node *node, const char *host, int port, tcp_connect_handler_t handler,
+                           TcpConnect **ret) {
+        struct addrinfo hints = {
+                .ai_socktype = SOCK_STREAM,
+                .ai_flags = AI_NUMERICHOST,
+        };
+        TcpConnect *c;
+        int r;
+
+        c = malloc0(sizeof(TcpConnect));
+        if (c == NULL)
+                return -ENOMEM;
+        c->node = node;
+        c->handler = handler;
+        c->fd = -1;
+        c->resolve_fds[0] = -1;
+        c->error = -EHOSTUNREACH;
+        snprintf(c->port, sizeof(c->port), "%d", port);
+
+        /* An address, which doesn't need the resolver */
+        r = getaddrinfo(host, c->port, &hints, &c->addresses);
+        if (r == 0) {
+                c->address = c->addresses;
+                r = tcp_connect_next(c);
+                if (r < 0) {
+                        tcp_connect_free(c);
+                        return r;
+                }
+                *ret = c;
+                return 0;
+        }
+
+        c->host = strdup(host);
+        if (c->host == NULL || pipe2(c->resolve_fds, O_CLOEXEC) < 0) {
+                r = c->host == NULL ? -ENOMEM : -errno;
+                tcp_connect_free(c);
+                return r;
+        }
+
+        r = sd_event_add_io(node->manager.event, &c->source, c->resolve_fds[0], EPOLLIN,
+                            tcp_connect_resolved, c);
+        if (r >= 0)
+                r = -pthread_create(&c->resolver, NULL, tcp_connect_resolve, c);
+        if (r < 0) {
+                close(c->resolve_fds[1]);
+                tcp_connect_free(c);
+                return r;
+        }
+
+        c->resolving = true;
+        *ret = c;
+        return 0;
+}
+
+static void node_orchestrator_connected(Node *node, int fd) {
+        int r = fd;
+
+        node->connect = tcp_connect_free(node->connect);
+
+        if (r >= 0) {
+                (void) sd_event_now(node->manager.event, CLOCK_MONOTONIC, &node->connected_usec);
+                r = node_start_orchestrator_bus(node, fd, true); /* The bus closes fd from here on */
+        }
+        if (r < 0 && !sd_id128_is_null(node->session)) {
+                fprintf(stderr, "Failed to reconnect to orchestrator: %s\n", strerror(-r));
+                node_lost_orchestrator(node);
+        } else if (r < 0) {
+                fprintf(stderr, "Failed to connect to orchestrator: %s\n", strerror(-r));
+                sd_event_exit(node->manager.event, EXIT_FAILURE);
+        }
+}
+
+static int node_connect_orchestrator(Node *node, const char *address, int port) {
+        return tcp_connect_new(node, address, port, node_orchestrator_connected, &node->connect);
+}
+
+static void node_schedule_standby(Node *node, uint64_t usec) {
+        int r;
+
+        r = sd_event_source_set_time_relative(node->standby_timer, usec);
+        if (r >= 0)
+                r = sd_event_source_set_enabled(node->standby_timer, SD_EVENT_ONESHOT);
+        if (r < 0)
+                fprintf(stderr, "Failed to schedule standby orchestrator check: %s\n", strerror(-r));
+}
+
+/* Connected again after NODE_RECONNECT_INTERVAL */
+static void node_drop_standby(Node *node) {
+        node->standby_slot = sd_bus_slot_unref(node->standby_slot);
+        node->standby_bus = sd_bus_close_unref(node->standby_bus);
+        node_schedule_standby(node, NODE_RECONNECT_INTERVAL);
+}
+
+static int standby_ping_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+
+        /* Answered by a connection we dropped or took over since */
+        if (sd_bus_message_get_bus(m) != node->standby_bus || node->standby_slot == NULL)
+                return 0;
+
+        if (sd_bus_message_is_method_error(m, NULL)) {
+                fprintf(stderr, "Standby orchestrator is not answering: %s\n",
+                        sd_bus_message_get_error(m)->message);
+                node_drop_standby(node);
+        }
+
+        return 0;
+}
+
+static int standby_disconnected(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+
+        printf("Standby orchestrator disconnected\n");
+        node_drop_standby(node);
+        return 0;
+}
+
+/* Registers with the standby, which answers once it has taken over. The
+ * old active orchestrator becomes the standby, if it comes back. */
+static int node_fail_over(Node *node) {
+        _cleanup_sd_bus_ sd_bus *orch = NULL;
+        const char *address = node->orchestrator_address;
+        int port = node->orchestrator_port;
+        int r;
 
-        r = sd_bus_new(&orch);
+        node->standby_slot = sd_bus_slot_unref(node->standby_slot);
+        orch = steal_pointer(&node->standby_bus);
+
+        r = node_setup_orchestrator_bus(node, &orch, true);
         if (r < 0) {
-                fprintf(stderr, "Failed to create bus: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+                node_drop_standby(node);
+                return r;
         }
 
-        node.manager.bus = orch;
-        node.manager.job_path_prefix = NODE_PEER_JOBS_OBJECT_PATH_PREFIX;
-        node.manager.manager_path = NODE_PEER_OBJECT_PATH;
-        node.manager.manager_iface = NODE_IFACE;
+        printf("Failing over to standby orchestrator %s:%d\n", node->standby_address, node->standby_port);
 
-        (void) sd_bus_set_description(bus, "orchestrator");
-        r = sd_bus_set_trusted (orch, true); /* we trust everything from the orchestrator, there is only one peer anyway */
+        node->reconnect_timer = sd_event_source_disable_unref(node->reconnect_timer);
+        node->orchestrator_address = node->standby_address;
+        node->orchestrator_port = node->standby_port;
+        node->standby_address = address;
+        node->standby_port = port;
+
+        node_schedule_standby(node, NODE_RECONNECT_INTERVAL);
+        return 0;
+}
+
+/* The standby refused us as the active orchestrator is up, we only
+ * lost our connection to it */
+static void node_fail_back(Node *node) {
+        const char *address = node->orchestrator_address;
+        int port = node->orchestrator_port;
+
+        printf("Going back to orchestrator %s:%d\n", node->standby_address, node->standby_port);
+
+        if (node->standby_bus != NULL) {
+                node_lost_orchestrator(node);
+                return;
+        }
+
+        /* Under way to the orchestrator we are going back to */
+        if (node->standby_connect != NULL) {
+                node->standby_connect = tcp_connect_free(node->standby_connect);
+                node_schedule_standby(node, NODE_RECONNECT_INTERVAL);
+        }
+
+        node->orchestrator_address = node->standby_address;
+        node->orchestrator_port = node->standby_port;
+        node->standby_address = address;
+        node->standby_port = port;
+
+        node_schedule_reconnect(node);
+}
+
+static void node_standby_connected(Node *node, int fd) {
+        _cleanup_sd_bus_ sd_bus *orch = NULL;
+        int r = fd;
+
+        node->standby_connect = tcp_connect_free(node->standby_connect);
+
+        if (r >= 0)
+                r = node_new_orchestrator_bus(node, fd, &orch); /* The bus closes fd from here on */
+        if (r >= 0)
+                r = sd_bus_match_signal_async(
+                                orch,
+                                &node->standby_slot,
+                                "org.freedesktop.DBus.Local",
+                                "/org/freedesktop/DBus/Local",
+                                "org.freedesktop.DBus.Local",
+                                "Disconnected",
+                                standby_disconnected, NULL, node);
         if (r < 0) {
-                fprintf(stderr, "Failed to trust orchestrator: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+                node_schedule_standby(node, NODE_RECONNECT_INTERVAL);
+                return;
+        }
+
+        printf("Connected to standby orchestrator %s:%d\n", node->standby_address, node->standby_port);
+        node->standby_bus = steal_pointer(&orch);
+
+        /* Lost the active one meanwhile, and waiting to retry it */
+        if (node->reconnect_timer != NULL)
+                node_lost_orchestrator(node);
+        else
+                node_schedule_standby(node, HA_HEARTBEAT_INTERVAL);
+}
+
+/* Pings the standby, and so notices when it is gone before we need it */
+static int node_standby_check(sd_event_source *s, uint64_t usec, void *userdata) {
+        Node *node = userdata;
+        _cleanup_sd_bus_message_ sd_bus_message *m = NULL;
+        int r;
+
+        if (node->standby_bus == NULL) {
+                r = tcp_connect_new(node, node->standby_address, node->standby_port,
+                                    node_standby_connected, &node->standby_connect);
+                if (r < 0)
+                        node_schedule_standby(node, NODE_RECONNECT_INTERVAL);
+                return 0;
         }
 
-        r = asprintf(&dbus_addr, "tcp:host=%s,port=%d", orchestrator_address, orchestrator_port);
+        r = sd_bus_message_new_method_call(node->standby_bus, &m, NULL, ORCHESTRATOR_OBJECT_PATH,
+                                           "org.freedesktop.DBus.Peer", "Ping");
+        if (r >= 0)
+                r = sd_bus_call_async(node->standby_bus, NULL, m, standby_ping_cb, node, HA_HEARTBEAT_INTERVAL);
         if (r < 0) {
-                fprintf(stderr, "Out of memory\n");
-                return EXIT_FAILURE;
+                fprintf(stderr, "Failed to ping standby orchestrator: %s\n", strerror(-r));
+                node_drop_standby(node);
+                return 0;
+        }
+
+        node_schedule_standby(node, HA_HEARTBEAT_INTERVAL);
+        return 0;
+}
+
+static int node_start_standby(Node *node) {
+        int r;
+
+        r = sd_event_add_time_relative(node->manager.event, &node->standby_timer, CLOCK_MONOTONIC,
+                                       0, 0, node_standby_check, node);
+        if (r < 0)
+                return r;
+
+        return sd_event_source_set_enabled(node->standby_timer, SD_EVENT_ONESHOT);
+}
+
+/* Trackers whose jobs systemd lost, waiting on the state of their units */
+typedef struct {
+        Node *node;
+        LIST_HEAD(JobTracker, trackers);
+} VanishedJobs;
+
+static void vanished_jobs_fail(VanishedJobs *vanished, sd_bus_message *m) {
+        JobTracker *tracker;
+
+        while ((tracker = vanished->trackers) != NULL) {
+                fprintf(stderr, "Job %s vanished while systemd was away, can't tell how %s is\n",
+                        tracker->object_path, tracker->unit);
+                LIST_REMOVE(trackers, vanished->trackers, tracker);
+                tracker->callback(m, "failed", tracker->userdata);
+        }
+
+        free(vanished);
+}
+
+/* As for a resumed job, the unit being up with nothing queued on it is
+ * as good as the job having succeeded */
+static int node_vanished_units_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        VanishedJobs *vanished = userdata;
+        JobTracker *tracker, *next_tracker;
+        const char *name, *active_state;
+        uint32_t job_id;
+        int r;
+
+        r = sd_bus_message_is_method_error(m, NULL) ? -EIO :
+                sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(ssssssouso)");
+        while (r >= 0 &&
+               (r = sd_bus_message_read(m, "(ssssssouso)", &name, NULL, NULL, &active_state,
+                                        NULL, NULL, NULL, &job_id, NULL, NULL)) > 0) {
+                const char *result = strcmp(active_state, "active") == 0 && job_id == 0 ? "done" : "failed";
+
+                LIST_FOREACH_SAFE(trackers, tracker, next_tracker, vanished->trackers) {
+                        if (strcmp(tracker->unit, name) != 0)
+                                continue;
+
+                        printf("Job %s vanished while systemd was away, %s is %s\n",
+                               tracker->object_path, name, active_state);
+                        LIST_REMOVE(trackers, vanished->trackers, tracker);
+                        tracker->callback(m, result, tracker->userdata);
+                }
+        }
+
+        vanished_jobs_fail(vanished, m);
+        return 0;
+}
+
+/* JobRemoved signals sent while we were away are lost, so the jobs we
+ * tracked that systemd no longer has will never get one */
+static int node_reconcile_jobs_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+        JobTracker *tracker, *next_tracker;
+        VanishedJobs *vanished;
+        char **jobs = NULL, **units = NULL;
+        const char *path;
+        uint32_t n_vanished = 0;
+        uint64_t now;
+        int r;
+
+        if (sd_bus_message_is_method_error(m, NULL)) {
+                fprintf(stderr, "Failed to list systemd jobs: %s\n", sd_bus_message_get_error(m)->message);
+                return 0;
+        }
+
+        r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(usssoo)");
+        while (r >= 0 &&
+               (r = sd_bus_message_read(m, "(usssoo)", NULL, NULL, NULL, NULL, &path, NULL)) > 0)
+                r = strv_append(&jobs, path);
+
+        /* Rather keep waiting than fail a job that may be running */
+        vanished = r < 0 ? NULL : malloc0(sizeof(VanishedJobs));
+        if (vanished == NULL) {
+                fprintf(stderr, "Failed to read systemd jobs: %s\n", strerror(r < 0 ? -r : ENOMEM));
+                strv_free(jobs);
+                node->systemd_lost_usec = 0;
+                return 0;
+        }
+        vanished->node = node;
+
+        LIST_FOREACH_SAFE(trackers, tracker, next_tracker, node->trackers) {
+                if (strv_contains(jobs, tracker->object_path))
+                        continue;
+
+                LIST_REMOVE(trackers, node->trackers, tracker);
+                LIST_PREPEND(trackers, vanished->trackers, tracker);
+                if (r >= 0 && !strv_contains(units, tracker->unit))
+                        r = strv_append(&units, tracker->unit);
+                n_vanished++;
+        }
+        strv_free(jobs);
+
+        (void) sd_event_now(node->manager.event, CLOCK_MONOTONIC, &now);
+        printf("Back with systemd after %.1f ms, %u tracked jobs vanished\n",
+               (now - node->systemd_lost_usec) / 1000.0, n_vanished);
+        node->systemd_lost_usec = 0;
+
+        if (n_vanished == 0) {
+                free(vanished);
+                return 0;
         }
 
-        r = sd_bus_set_address(orch, dbus_addr);
+        if (r >= 0)
+                r = node_call_systemd(node, SYSTEMD_OBJECT_PATH, SYSTEMD_MANAGER_IFACE, "ListUnitsByNames",
+                                      "as", steal_pointer(&units), node_vanished_units_cb, vanished);
+        else
+                strv_free(units);
         if (r < 0) {
-                fprintf(stderr, "Failed to set address: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+                fprintf(stderr, "Failed to check on vanished jobs: %s\n", strerror(-r));
+                vanished_jobs_fail(vanished, m);
         }
 
-        /* Connect to the orchastrator */
-        r = sd_bus_start(orch);
+        return 0;
+}
+
+/* The job list is asked for right behind Subscribe, so it is from
+ * after the subscription and no JobRemoved falls in between */
+static int node_subscribe(Node *node, sd_bus *bus) {
+        int r;
+
+        r = sd_bus_call_method_async(bus,
+                                     NULL,
+                                     SYSTEMD_BUS_NAME,
+                                     SYSTEMD_OBJECT_PATH,
+                                     SYSTEMD_MANAGER_IFACE,
+                                     "Subscribe",
+                                     node_subscribe_cb,
+                                     node,
+                                     "");
+        if (r < 0 || node->systemd_lost_usec == 0)
+                return r;
+
+        return sd_bus_call_method_async(bus,
+                                        NULL,
+                                        SYSTEMD_BUS_NAME,
+                                        SYSTEMD_OBJECT_PATH,
+                                        SYSTEMD_MANAGER_IFACE,
+                                        "ListJobs",
+                                        node_reconcile_jobs_cb,
+                                        node,
+                                        "");
+}
+
+static void node_lost_systemd(Node *node) {
+        node->systemd_subscribed = false;
+        if (node->systemd_lost_usec == 0)
+                (void) sd_event_now(node->manager.event, CLOCK_MONOTONIC, &node->systemd_lost_usec);
+
+        /* Whatever systemd queued meanwhile goes unseen */
+        node_set_isolated_target(node, NULL);
+}
+
+/* On the system bus a reexec of systemd shows as it leaving the bus
+ * and coming back, our connection stays */
+static int systemd_name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+        const char *name, *old_owner, *new_owner;
+        int r;
+
+        r = sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner);
         if (r < 0) {
-                fprintf(stderr, "Failed to connect to orchestrator: %s\n", strerror(-r));
+                fprintf(stderr, "Can't parse NameOwnerChanged\n");
+                return 0;
+        }
+
+        if (*new_owner == '\0') {
+                printf("systemd left the bus\n");
+                node_lost_systemd(node);
+                return 0;
+        }
+
+        printf("systemd is back on the bus\n");
+        node_lost_systemd(node);
+        r = node_subscribe(node, node->local_bus);
+        if (r < 0)
+                fprintf(stderr, "Failed to subscribe again: %s\n", strerror(-r));
+
+        return 0;
+}
+
+static int node_connect_systemd(Node *node);
+
+static int node_systemd_reconnect(sd_event_source *s, uint64_t usec, void *userdata);
+
+static void node_schedule_systemd_reconnect(Node *node, uint64_t usec) {
+        int r;
+
+        if (node->systemd_reconnect_timer != NULL)
+                return;
+
+        r = sd_event_add_time_relative(node->manager.event, &node->systemd_reconnect_timer, CLOCK_MONOTONIC,
+                                       usec, 0, node_systemd_reconnect, node);
+        if (r < 0) {
+                fprintf(stderr, "Failed to add systemd reconnect timer: %s\n", strerror(-r));
+                sd_event_exit(node->manager.event, EXIT_FAILURE);
+        }
+}
+
+static int node_systemd_reconnect(sd_event_source *s, uint64_t usec, void *userdata) {
+        Node *node = userdata;
+        int r;
+
+        node->systemd_reconnect_timer = sd_event_source_disable_unref(node->systemd_reconnect_timer);
+
+        r = node_connect_systemd(node);
+        if (r < 0)
+                node_schedule_systemd_reconnect(node, SYSTEMD_RECONNECT_INTERVAL);
+
+        return 0;
+}
+
+/* Calls to systemd wait, and go out on the new connection */
+static int system_bus_disconnected(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+
+        printf("Lost connection to systemd, reconnecting\n");
+        node_lost_systemd(node);
+        node_schedule_systemd_reconnect(node, 0);
+        return 0;
+}
+
+static int node_connect_systemd(Node *node) {
+        _cleanup_(sd_bus_close_unrefp) sd_bus *bus = NULL;
+        bool direct;
+        int r;
+
+        r = connect_system_systemd(&bus);
+        if (r < 0)
+                return r;
+        direct = r > 0;
+
+        r = sd_bus_match_signal_async(
+                        bus,
+                        NULL,
+                        "org.freedesktop.DBus.Local",
+                        "/org/freedesktop/DBus/Local",
+                        "org.freedesktop.DBus.Local",
+                        "Disconnected",
+                        system_bus_disconnected, NULL, node);
+        if (r < 0) {
+                fprintf(stderr, "Failed to request match for Disconnected message: %s\n", strerror(-r));
+                return r;
+        }
+
+        r = sd_bus_attach_event(bus, node->manager.event, SD_EVENT_PRIORITY_NORMAL);
+        if (r < 0) {
+                fprintf(stderr, "Failed to attach new connection bus to event loop: %s\n", strerror(-r));
+                return r;
+        }
+
+        if (!direct) {
+                r = sd_bus_add_match_async(
+                                bus,
+                                NULL,
+                                "type='signal',"
+                                "sender='org.freedesktop.DBus',"
+                                "path='/org/freedesktop/DBus',"
+                                "interface='org.freedesktop.DBus',"
+                                "member='NameOwnerChanged',"
+                                "arg0='" SYSTEMD_BUS_NAME "'",
+                                systemd_name_owner_changed, NULL, node);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to request match for systemd name owner: %s\n", strerror(-r));
+                        return r;
+                }
+        }
+
+        /* The matches go out first so no signal is missed once subscribed */
+        r = sd_bus_match_signal_async(
+                        bus,
+                        NULL,
+                        SYSTEMD_BUS_NAME,
+                        SYSTEMD_OBJECT_PATH,
+                        SYSTEMD_MANAGER_IFACE,
+                        "JobRemoved",
+                        node_match_job_removed, NULL, node);
+        if (r < 0) {
+                fprintf(stderr, "Failed to job-removed peer bus match: %s\n", strerror(-r));
+                return r;
+        }
+
+        r = sd_bus_match_signal_async(
+                        bus,
+                        NULL,
+                        SYSTEMD_BUS_NAME,
+                        SYSTEMD_OBJECT_PATH,
+                        SYSTEMD_MANAGER_IFACE,
+                        "JobNew",
+                        node_match_job_new, NULL, node);
+        if (r < 0) {
+                fprintf(stderr, "Failed to job-new peer bus match: %s\n", strerror(-r));
+                return r;
+        }
+
+        /* Completes in the event loop, while we connect to the orchestrator */
+        r = node_subscribe(node, bus);
+        if (r < 0) {
+                fprintf(stderr, "Failed to subscribe call: %s\n", strerror(-r));
+                return r;
+        }
+
+        if (node->local_bus != NULL) {
+                printf("Connected to systemd again\n");
+                sd_bus_close_unref(node->local_bus);
+        }
+        node->local_bus = steal_pointer(&bus);
+
+        if (node->systemd_calls != NULL)
+                node_arm_systemd_call_timer(node, 0);
+
+        return 0;
+}
+
+
+enum {
+        ARG_PSI_CPU = 0x100,
+        ARG_PSI_MEMORY,
+        ARG_PSI_IO,
+        ARG_PSI_DIR,
+        ARG_PSI_MAX_HOLD,
+        ARG_SYSTEMD_RATE,
+        ARG_SYSTEMD_BURST,
+        ARG_SYSTEMD_MAX_IN_FLIGHT,
+        ARG_LABEL,
+        ARG_MAX_OPERATIONS,
+        ARG_EVENT_LOG,
+        ARG_STANDBY,
+};
+
+static const struct option options[] = {
+        { "psi-cpu", required_argument, NULL, ARG_PSI_CPU },
+        { "psi-memory", required_argument, NULL, ARG_PSI_MEMORY },
+        { "psi-io", required_argument, NULL, ARG_PSI_IO },
+        { "psi-dir", required_argument, NULL, ARG_PSI_DIR },
+        { "psi-max-hold", required_argument, NULL, ARG_PSI_MAX_HOLD },
+        { "systemd-rate", required_argument, NULL, ARG_SYSTEMD_RATE },
+        { "systemd-burst", required_argument, NULL, ARG_SYSTEMD_BURST },
+        { "systemd-max-in-flight", required_argument, NULL, ARG_SYSTEMD_MAX_IN_FLIGHT },
+        { "label", required_argument, NULL, ARG_LABEL },
+        { "max-operations", required_argument, NULL, ARG_MAX_OPERATIONS },
+        { "event-log", required_argument, NULL, ARG_EVENT_LOG },
+        { "standby", required_argument, NULL, ARG_STANDBY },
+        { "help", no_argument, NULL, 'h' },
+        {}
+};
+
+static void usage(const char *argv0) {
+        printf("Usage: %s [OPTIONS] ORCHESTRATOR-ADDRESS[:PORT] NODE-NAME\n"
+               "      --psi-cpu=PCT        Hold jobs while CPU pressure (some avg10) is above PCT\n"
+               "      --psi-memory=PCT     Hold jobs while memory pressure is above PCT\n"
+               "      --psi-io=PCT         Hold jobs while IO pressure is above PCT\n"
+               "      --psi-dir=DIR        Where to read pressure from (default %s)\n"
+               "      --psi-max-hold=S     Start a held job anyway after S seconds (default %d, 0 waits forever)\n"
+               "      --systemd-rate=N     Calls per second to systemd (default %d, 0 for no limit)\n"
+               "      --systemd-burst=N    Calls to systemd that may go out at once (default %d)\n"
+               "      --systemd-max-in-flight=N\n"
+               "                           Calls to systemd awaiting a reply (default %d, 0 for no limit)\n"
+               "      --label=KEY=VALUE    Label to register the node with, may be repeated\n"
+               "      --max-operations=N   Operations the orchestrator may have queued here (default %d)\n"
+               "      --event-log=PATH     Keep unacknowledged job results and the running job in PATH,\n"
+               "                           to resume after a restart\n"
+               "      --standby=ADDRESS[:PORT]\n"
+               "                           Standby orchestrator to fail over to (default port %d)\n"
+               "  -h, --help               Show this help\n",
+               argv0, DEFAULT_PSI_DIR, (int)(DEFAULT_PSI_MAX_HOLD / USEC_PER_SEC),
+               DEFAULT_SYSTEMD_CALL_RATE, DEFAULT_SYSTEMD_CALL_BURST, DEFAULT_SYSTEMD_MAX_IN_FLIGHT,
+               DEFAULT_NODE_OPERATION_CREDITS, DEFAULT_ORCHESTRATOR_PORT);
+}
+
+/* HOST or HOST:PORT, an address with more than one colon is IPv6 */
+static int parse_address(const char *s, char **ret_host, int *ret_port) {
+        const char *colon = strchr(s, ':');
+        char *end;
+        long port = DEFAULT_ORCHESTRATOR_PORT;
+
+        if (colon != NULL && strchr(colon + 1, ':') == NULL) {
+                errno = 0;
+                port = strtol(colon + 1, &end, 10);
+                if (errno != 0 || end == colon + 1 || *end != '\0' || port <= 0 || port > 65535)
+                        return -EINVAL;
+        } else
+                colon = NULL;
+
+        *ret_host = colon ? strndup(s, colon - s) : strdup(s);
+        if (*ret_host == NULL)
+                return -ENOMEM;
+
+        *ret_port = port;
+        return 0;
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_sd_event_ sd_event *event = NULL;
+        int r;
+        int orchestrator_port;
+        _cleanup_free_ char *orchestrator_address = NULL;
+        _cleanup_free_ char *standby_address = NULL;
+        const char *node_name;
+        uint64_t u;
+        double d;
+        int c;
+        Node node = {
+                .psi_dir = DEFAULT_PSI_DIR,
+                .psi_max_hold_usec = DEFAULT_PSI_MAX_HOLD,
+                .systemd_call_rate = DEFAULT_SYSTEMD_CALL_RATE,
+                .systemd_call_burst = DEFAULT_SYSTEMD_CALL_BURST,
+                .systemd_max_in_flight = DEFAULT_SYSTEMD_MAX_IN_FLIGHT,
+                .op_credits = DEFAULT_NODE_OPERATION_CREDITS,
+        };
+
+        while ((c = getopt_long(argc, argv, "h", options, NULL)) >= 0) {
+                r = 0;
+                switch (c) {
+                case ARG_PSI_CPU:
+                        r = parse_double(optarg, 0, 100, &d);
+                        if (r >= 0)
+                                node.psi_threshold[PRESSURE_CPU] = d;
+                        break;
+                case ARG_PSI_MEMORY:
+                        r = parse_double(optarg, 0, 100, &d);
+                        if (r >= 0)
+                                node.psi_threshold[PRESSURE_MEMORY] = d;
+                        break;
+                case ARG_PSI_IO:
+                        r = parse_double(optarg, 0, 100, &d);
+                        if (r >= 0)
+                                node.psi_threshold[PRESSURE_IO] = d;
+                        break;
+                case ARG_PSI_DIR:
+                        node.psi_dir = optarg;
+                        break;
+                case ARG_PSI_MAX_HOLD:
+                        r = parse_double(optarg, 0, UINT32_MAX, &d);
+                        if (r >= 0)
+                                node.psi_max_hold_usec = d * USEC_PER_SEC;
+                        break;
+                case ARG_SYSTEMD_RATE:
+                        r = parse_double(optarg, 0, HUGE_VAL, &d);
+                        if (r >= 0)
+                                node.systemd_call_rate = d;
+                        break;
+                case ARG_SYSTEMD_BURST:
+                        r = parse_double(optarg, 0, HUGE_VAL, &d);
+                        if (r >= 0)
+                                node.systemd_call_burst = d;
+                        break;
+                case ARG_SYSTEMD_MAX_IN_FLIGHT:
+                        r = parse_uint64(optarg, 0, UINT32_MAX, &u);
+                        if (r >= 0)
+                                node.systemd_max_in_flight = u;
+                        break;
+                case ARG_LABEL: {
+                        const char **labels;
+
+                        if (strchr(optarg, '=') == NULL || optarg[0] == '=') {
+                                fprintf(stderr, "Invalid label '%s', expected KEY=VALUE\n", optarg);
+                                return EXIT_FAILURE;
+                        }
+
+                        labels = realloc(node.labels, sizeof(char *) * (node.n_labels + 1));
+                        if (labels == NULL) {
+                                fprintf(stderr, "Out of memory\n");
+                                return EXIT_FAILURE;
+                        }
+                        labels[node.n_labels++] = optarg;
+                        node.labels = labels;
+                        break;
+                }
+                case ARG_MAX_OPERATIONS:
+                        r = parse_uint64(optarg, 1, UINT32_MAX, &u);
+                        if (r >= 0)
+                                node.op_credits = u;
+                        break;
+                case ARG_EVENT_LOG:
+                        node.event_log_path = optarg;
+                        break;
+                case ARG_STANDBY:
+                        free(standby_address);
+                        if (parse_address(optarg, &standby_address, &node.standby_port) < 0) {
+                                fprintf(stderr, "Invalid standby orchestrator address '%s'\n", optarg);
+                                return EXIT_FAILURE;
+                        }
+                        node.standby_address = standby_address;
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+
+                if (r < 0) {
+                        fprintf(stderr, "%s argument '%s'\n", r == -ERANGE ? "Out of range" : "Invalid", optarg);
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (optind >= argc) {
+                fprintf(stderr, "No orchestrator address given\n");
                 return EXIT_FAILURE;
         }
 
-        if (DEBUG_DBUS_MESSAGES)
-                sd_bus_add_filter(orch, NULL, all_messages_handler, NULL);
+        if (parse_address(argv[optind], &orchestrator_address, &orchestrator_port) < 0) {
+                fprintf(stderr, "Invalid orchestrator address '%s'\n", argv[optind]);
+                return EXIT_FAILURE;
+        }
 
-        r = sd_bus_add_object_vtable(orch,
-                                     NULL,
-                                     NODE_PEER_OBJECT_PATH,
-                                     NODE_PEER_IFACE,
-                                     node_vtable,
-                                     &node);
+        if (optind + 1 >= argc) {
+                fprintf(stderr, "No node name given\n");
+                return EXIT_FAILURE;
+        }
+
+        node_name = argv[optind + 1];
+        node.name = node_name;
+
+        r = sd_event_default(&event);
         if (r < 0) {
-                fprintf(stderr, "Failed to add peer bus vtable: %s\n", strerror(-r));
+                fprintf(stderr, "Failed to create event: %s\n", strerror(-r));
                 return EXIT_FAILURE;
         }
 
-        /* Register with orchestrator */
-        r = sd_bus_call_method(orch,
-                               ORCHESTRATOR_BUS_NAME,
-                               ORCHESTRATOR_OBJECT_PATH,
-                               ORCHESTRATOR_PEER_IFACE,
-                               "Register",
-                               &error,
-                               &m,
-                               "s",
-                               node_name);
+        node.manager.event = event;
+        (void) sd_event_now(event, CLOCK_MONOTONIC, &node.start_usec);
+
+        r = event_log_open(&node.event_log, node.event_log_path, DEFAULT_NODE_EVENT_LOG_SIZE);
         if (r < 0) {
-                fprintf(stderr, "Failed to issue method call: %s\n", error.message);
-                sd_bus_error_free(&error);
+                fprintf(stderr, "Failed to open event log: %s\n", strerror(-r));
                 return EXIT_FAILURE;
         }
+        if (r > 0 && !sd_id128_is_null(event_log_get_session(&node.event_log))) {
+                /* Resumed on connecting, new jobs must not reuse the ids of earlier ones */
+                node.session = event_log_get_session(&node.event_log);
+                node.manager.next_job_id = node.event_log.header->next_job_id;
+                printf("Resuming session with %" PRIu64 " unacknowledged job results\n",
+                       node.event_log.header->last_seq - node.event_log.header->acked_seq);
+        }
+        node.systemd_call_tokens = node.systemd_call_burst > 1 ? node.systemd_call_burst : 1;
+        if (node.systemd_call_burst < 1)
+                node.systemd_call_burst = 1;
 
-        r = sd_bus_message_read(m, "");
+        /* Connect to system bus (for talking to systemd) */
+        r = node_connect_systemd(&node);
         if (r < 0) {
-                fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+                fprintf(stderr, "Failed to connect to systemd: %s\n", strerror(-r));
                 return EXIT_FAILURE;
         }
 
-        printf("Registered as '%s'\n", node_name);
+        node.manager.job_path_prefix = NODE_PEER_JOBS_OBJECT_PATH_PREFIX;
+        node.manager.manager_path = NODE_PEER_OBJECT_PATH;
+        node.manager.manager_iface = NODE_IFACE;
+        node.manager.admit_cb = node_admit_job;
+        node.manager.job_removed_cb = node_job_removed;
 
-        r = sd_bus_attach_event(orch, event, SD_EVENT_PRIORITY_NORMAL);
+        /* Connect to orchestrator, while systemd handles the Subscribe */
+        node.orchestrator_address = orchestrator_address;
+        node.orchestrator_port = orchestrator_port;
+        r = node_connect_orchestrator(&node, orchestrator_address, orchestrator_port);
         if (r < 0) {
-                fprintf(stderr, "Failed to attach bus to event: %s\n", strerror(-r));
+                fprintf(stderr, "Failed to connect to orchestrator: %s\n", strerror(-r));
                 return EXIT_FAILURE;
         }
 
+        if (node.standby_address) {
+                r = node_start_standby(&node);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set up standby orchestrator: %s\n", strerror(-r));
+                        return EXIT_FAILURE;
+                }
+        }
+
         r = sd_event_loop(event);
+
+        tcp_connect_free(node.connect);
+        sd_event_source_unref(node.reconnect_timer);
+        sd_event_source_unref(node.systemd_reconnect_timer);
+        tcp_connect_free(node.standby_connect);
+        sd_event_source_unref(node.standby_timer);
+        sd_bus_slot_unref(node.standby_slot);
+        sd_bus_close_unref(node.standby_bus);
+        event_log_close(&node.event_log);
+        free(node.resumed_job_path);
+        sd_bus_flush_close_unref(node.local_bus);
+        sd_bus_flush_close_unref(node.manager.bus);
+        free(node.labels);
+
         if (r < 0) {
                 fprintf(stderr, "Event loop failed: %s\n", strerror(-r));
                 return EXIT_FAILURE;
         }
 
-        return EXIT_SUCCESS;
+        return r;
 }
@@ -1,37 +1,214 @@
 #include "orch.h"
 #include "types.h"
+#include "accept.h"
+#include "handoff.h"
 
 #include <time.h>
+#include <math.h>
+#include <limits.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
 #include <netinet/in.h>
+#include <sys/file.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
+#include <systemd/sd-daemon.h>
 
 #define DEBUG_DBUS_MESSAGES 0
 
 typedef struct Orchestrator Orchestrator;
 typedef struct Node Node;
+typedef struct TargetHistory TargetHistory;
+typedef struct NodeOperation NodeOperation;
+
+/* Operations we learn per-node timeouts for */
+typedef enum {
+        NODE_OP_CALL,           /* method call round trip on the peer connection */
+        NODE_OP_ISOLATE,        /* node isolate job to a new target, from reply to JobRemoved */
+        NODE_OP_PREPARE,        /* node prepare job, from reply to JobRemoved */
+        _NODE_OP_MAX,
+} NodeOp;
+
+/* As in the --min-*-timeout and --max-*-timeout options */
+static const char* const node_op_table[_NODE_OP_MAX] = {
+        [NODE_OP_CALL] = "call",
+        [NODE_OP_ISOLATE] = "isolate",
+        [NODE_OP_PREPARE] = "prepare",
+};
+
+#define N_PEER_SLOTS 9
 
 struct Node {
         int ref_count;
         Orchestrator *orch;
         sd_bus *peer;
+        sd_bus_slot *peer_slots[N_PEER_SLOTS]; /* our callbacks on peer, see node_attach_peer() */
         sd_bus_slot *bus_slot;
         char *name;
         char *object_path;
+
+        /* Inventory sent along with the registration */
+        uint32_t inventory_version;     /* 0 if the node sent none */
+        uint32_t protocol_version;      /* 0 for nodes that predate negotiation */
+        uint64_t features;              /* NODE_FEATURE_*, those both ends support */
+        char *agent_version;
+        char **capabilities;
+        char **labels;                  /* KEY=VALUE */
+
+        LatencyEstimate latency[_NODE_OP_MAX];
+        LIST_HEAD(TargetHistory, target_history); /* most recently used first */
+        int n_target_history;
+        char *target;                   /* last isolated to, NULL if not known */
+        LIST_HEAD(NodeOperation, queued_ops);    /* oldest first, sent on the next flush */
+        NodeOperation *queued_ops_tail;
+        uint32_t n_queued_ops;
+        sd_event_source *flush_source;
+
+        /* Flow control, with NODE_FEATURE_CREDITS */
+        uint32_t op_credits;            /* granted by the node, 0 for no limit */
+        uint32_t n_ops_outstanding;     /* sent, until their node job is removed */
+        char **op_jobs;                 /* node jobs of ops that got one, holding their credit */
+        uint32_t n_events_ungranted;    /* JobsRemoved handled since the last grant */
+        uint32_t n_calls_in_flight;     /* ops sent, waiting for their reply */
+        LIST_HEAD(NodeOperation, sent_ops); /* those ops, newest first */
+
+        /* With NODE_FEATURE_SESSION */
+        sd_id128_t session;             /* null until registered */
+        sd_id128_t resume_session;      /* SessionToken from the inventory */
+        sd_event_source *session_timer; /* while disconnected, until the session expires */
+        uint64_t n_events_received;     /* job results in this session, with NODE_FEATURE_REPLAY */
+        uint64_t n_events_acked;        /* the count last sent in EventsAcked */
+
+        /* Upgrade, with NODE_FEATURE_HANDOFF */
+        bool handoff_requested;
+        sd_bus_message *handoff_ready;  /* HandoffReady call, answered once the new instance has us */
+        bool handed_off;                /* read by the new instance, until it confirms */
+
+        sd_bus_message *held_register;  /* Register sent to us as standby, see orch_become_active() */
+        sd_event_source *held_register_timer; /* refuses it after HA_REGISTER_HOLD_TIMEOUT */
         LIST_FIELDS(Node, nodes);
         LIST_HEAD(JobTracker, trackers);
 };
 
+/* Called with the node's job path, or with error set if the operation
+ * could not be queued on the node */
+typedef void (*node_operation_callback)(const char *job_path, const sd_bus_error *error, void *userdata);
+
+/* A method call to a node that starts a node job, such as Isolate. Ops
+ * are queued on the node and sent at the end of the event loop
+ * iteration, as far as the node's credits allow. Several go out as one
+ * Batch call if the node supports it. */
+struct NodeOperation {
+        const char *method;
+        char *target;
+        node_operation_callback callback; /* NULL once canceled */
+        void *userdata;
+        Node *node;                       /* NULL while queued */
+        sd_bus_slot *slot;                /* the call, once sent, on the first op of a Batch */
+        NodeOperation *batch_next;        /* the op after this one in its Batch */
+        LIST_FIELDS(NodeOperation, ops);  /* on queued_ops, or on sent_ops once sent */
+};
+
+/* How long isolating a node to a target usually takes */
+struct TargetHistory {
+        char *target;
+        LatencyEstimate duration;
+        LIST_FIELDS(TargetHistory, target_history);
+};
+
 struct Orchestrator {
         Manager manager;
         LIST_HEAD(Node, nodes);
+
+        double straggler_factor;
+        int dispatch_window;
+        uint64_t min_timeout[_NODE_OP_MAX];
+        uint64_t max_timeout[_NODE_OP_MAX];
+        Acceptor acceptor;
+
+        /* Upgrade in place, see HANDOFF_TIMEOUT */
+        char **argv;                     /* to exec the new instance with */
+        sd_bus_message *upgrade_message; /* the Upgrade call, NULL unless upgrading */
+        sd_event_source *upgrade_timer;
+        uint64_t handoff_deadline;       /* 0 until nodes are told */
+        pid_t upgrade_pid;               /* the new instance, until it confirms */
+        sd_event_source *upgrade_status; /* its end of the pipe it confirms on */
+        uint32_t upgrade_n_nodes;        /* handed off to it */
+        int upgrade_status_fd;           /* in the new instance, -1 once confirmed */
+
+        /* Active/standby pair, see HA_LOCK_POLL_INTERVAL */
+        char *ha_lock_path;              /* NULL without --ha-lock */
+        char *ha_state_path;
+        int ha_lock_fd;                  /* -1 unless we hold the lock */
+        bool standby;
+        sd_event_source *ha_timer;       /* polls the lock as standby, replicates when active */
+        sd_bus_message **held_replies;   /* to submits, sent once the state is written */
+        size_t n_held_replies;
 };
 
+static void orch_state_changed(Orchestrator *orch);
+static int orch_reply_replicated(Orchestrator *orch, sd_bus_message *m, const char *job_path);
+
+/* Log-linear histogram of durations in ms, with four buckets per power
+ * of two. Adding a sample is O(1) and quantiles walk a fixed number of
+ * buckets, with an error of at most 25%. */
+#define HISTOGRAM_SUB_BUCKETS 4
+#define HISTOGRAM_BUCKETS (32 * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+        uint32_t count;
+        uint32_t buckets[HISTOGRAM_BUCKETS];
+} DurationHistogram;
+
+static unsigned histogram_bucket(uint32_t msec) {
+        unsigned e;
+
+        if (msec < HISTOGRAM_SUB_BUCKETS)
+                return msec;
+
+        e = 31 - __builtin_clz(msec);
+        return e * HISTOGRAM_SUB_BUCKETS + ((msec >> (e - 2)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* Largest value that falls into the bucket */
+static uint32_t histogram_bucket_limit(unsigned bucket) {
+        unsigned e = bucket / HISTOGRAM_SUB_BUCKETS;
+        unsigned sub = bucket % HISTOGRAM_SUB_BUCKETS;
+
+        if (bucket < HISTOGRAM_SUB_BUCKETS)
+                return bucket;
+
+        return (((uint64_t)HISTOGRAM_SUB_BUCKETS + sub + 1) << (e - 2)) - 1;
+}
+
+static void histogram_add(DurationHistogram *h, uint32_t msec) {
+        h->buckets[histogram_bucket(msec)]++;
+        h->count++;
+}
+
+static uint32_t histogram_quantile(DurationHistogram *h, double q) {
+        uint32_t rank = q * h->count;
+        uint32_t seen = 0;
+        unsigned i;
+
+        for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                seen += h->buckets[i];
+                if (seen > rank)
+                        return histogram_bucket_limit(i);
+        }
+
+        return 0;
+}
+
 static void node_add_job_tracker(Node *node, JobTracker *tracker,
                                  const char *object_path, job_tracker_callback callback,
-                                 void *userdata) {
+                                 job_hold_callback hold_callback, void *userdata) {
         tracker->object_path = object_path;
         tracker->callback = callback;
+        tracker->hold_callback = hold_callback;
         tracker->userdata = userdata;
         LIST_PREPEND(trackers, node->trackers, tracker);
 }
@@ -51,23 +228,451 @@ static Node *node_ref(Node *node) {
         return node;
 }
 
+static void node_detach_peer(Node *node) {
+        size_t i;
+
+        for (i = 0; i < ELEMENTSOF(node->peer_slots); i++)
+                node->peer_slots[i] = sd_bus_slot_unref(node->peer_slots[i]);
+}
+
+/* A node's name is shared with the results of the jobs that ran on
+ * it, which outlive the node */
+typedef struct {
+        int ref_count;
+        char name[];
+} NodeName;
+
+static char *node_name_new(const char *name) {
+        NodeName *n = malloc(offsetof(NodeName, name) + strlen(name) + 1);
+        if (n == NULL)
+                return NULL;
+
+        n->ref_count = 1;
+        strcpy(n->name, name);
+        return n->name;
+}
+
+static char *node_name_ref(char *name) {
+        if (name != NULL)
+                ((NodeName *)(name - offsetof(NodeName, name)))->ref_count++;
+        return name;
+}
+
+static void node_name_unref(char *name) {
+        NodeName *n;
+
+        if (name == NULL)
+                return;
+
+        n = (NodeName *)(name - offsetof(NodeName, name));
+        if (--n->ref_count == 0)
+                free(n);
+}
+
+/* Returns true if s was in l */
+static bool strv_remove(char **l, const char *s) {
+        size_t i, n = strv_length(l);
+
+        for (i = 0; i < n; i++) {
+                if (strcmp(l[i], s) == 0) {
+                        free(l[i]);
+                        memmove(l + i, l + i + 1, sizeof(char *) * (n - i));
+                        return true;
+                }
+        }
+
+        return false;
+}
+
 static void node_unref(Node *node) {
         node->ref_count--;
 
         if (node->ref_count == 0) {
+                node_detach_peer(node);
                 if (node->peer)
                         sd_bus_close_unref(node->peer);
                 if (node->bus_slot)
                         sd_bus_slot_unref(node->bus_slot);
-                if (node->name)
-                        free(node->name);
+                node_name_unref(node->name);
                 if (node->object_path)
                         free(node->object_path);
+                free(node->agent_version);
+                strv_free(node->capabilities);
+                strv_free(node->labels);
+                strv_free(node->op_jobs);
+                sd_bus_message_unref(node->handoff_ready);
+                sd_bus_message_unref(node->held_register);
+                sd_event_source_disable_unref(node->held_register_timer);
+                while (node->queued_ops) {
+                        NodeOperation *op = node->queued_ops;
+                        LIST_REMOVE(ops, node->queued_ops, op);
+                        free(op->target);
+                        free(op);
+                }
+                sd_event_source_disable_unref(node->flush_source);
+                sd_event_source_disable_unref(node->session_timer);
+                while (node->target_history) {
+                        TargetHistory *h = node->target_history;
+                        LIST_REMOVE(target_history, node->target_history, h);
+                        free(h->target);
+                        free(h);
+                }
+                free(node->target);
                 free(node);
         }
 }
 _SD_DEFINE_POINTER_CLEANUP_FUNC(Node, node_unref);
 
+static uint64_t node_get_timeout(Node *node, NodeOp op) {
+        Orchestrator *orch = node->orch;
+
+        return latency_estimate_timeout(&node->latency[op], orch->min_timeout[op], orch->max_timeout[op]);
+}
+
+static void node_timed_out(Node *node, NodeOp op) {
+        latency_estimate_backoff(&node->latency[op], node->orch->max_timeout[op]);
+}
+
+static void node_set_target(Node *node, const char *target) {
+        char *t = NULL;
+
+        if (target != NULL && node->target != NULL && strcmp(target, node->target) == 0)
+                return;
+
+        if (target != NULL)
+                t = strdup(target); /* NULL just forgets, which is safe */
+        free(node->target);
+        node->target = t;
+}
+
+static TargetHistory *node_find_target_history(Node *node, const char *target) {
+        TargetHistory *h;
+
+        LIST_FOREACH(target_history, h, node->target_history) {
+                if (strcmp(h->target, target) == 0)
+                        return h;
+        }
+
+        return NULL;
+}
+
+/* Returns 0 if we have never isolated the node to target */
+static uint64_t node_expected_duration(Node *node, const char *target) {
+        TargetHistory *h = node_find_target_history(node, target);
+
+        return h ? h->duration.srtt_usec : 0;
+}
+
+static void node_record_duration(Node *node, const char *target, uint64_t usec) {
+        TargetHistory *h = node_find_target_history(node, target);
+
+        if (h != NULL) {
+                LIST_REMOVE(target_history, node->target_history, h);
+        } else if (node->n_target_history >= MAX_TARGET_HISTORY) {
+                /* Reuse the least recently used entry */
+                LIST_FIND_TAIL(target_history, node->target_history, h);
+                LIST_REMOVE(target_history, node->target_history, h);
+                free(h->target);
+                h->target = NULL;
+                memset(&h->duration, 0, sizeof(h->duration));
+        } else {
+                h = malloc0(sizeof(TargetHistory));
+                if (h == NULL)
+                        return;
+                node->n_target_history++;
+        }
+
+        if (h->target == NULL) {
+                h->target = strdup(target);
+                if (h->target == NULL) {
+                        node->n_target_history--;
+                        free(h);
+                        return;
+                }
+        }
+
+        latency_estimate_add(&h->duration, usec);
+        LIST_PREPEND(target_history, node->target_history, h);
+}
+
+/* Isolating a node to the target it is already in is a no-op on the
+ * node, so only isolates to a new target are learned from. The timeout
+ * is per target once we have isolated the node to it, else node-wide. */
+static uint64_t node_get_isolate_timeout(Node *node, const char *target) {
+        Orchestrator *orch = node->orch;
+        TargetHistory *h = node_find_target_history(node, target);
+
+        return latency_estimate_timeout(h ? &h->duration : &node->latency[NODE_OP_ISOLATE],
+                                        orch->min_timeout[NODE_OP_ISOLATE], orch->max_timeout[NODE_OP_ISOLATE]);
+}
+
+static void node_isolate_timed_out(Node *node, const char *target) {
+        TargetHistory *h = node_find_target_history(node, target);
+
+        node_timed_out(node, NODE_OP_ISOLATE);
+        if (h != NULL)
+                latency_estimate_backoff(&h->duration, node->orch->max_timeout[NODE_OP_ISOLATE]);
+}
+
+static int node_flush_operations(sd_event_source *s, void *userdata);
+
+static int node_schedule_flush(Node *node) {
+        if (node->flush_source != NULL)
+                return 0;
+
+        return sd_event_add_defer(node->orch->manager.event, &node->flush_source, node_flush_operations, node);
+}
+
+static uint32_t node_op_credits_available(Node *node) {
+        if (node->op_credits == 0)
+                return UINT32_MAX;
+        return node->op_credits > node->n_ops_outstanding ? node->op_credits - node->n_ops_outstanding : 0;
+}
+
+/* Ops that failed, or whose node job is gone */
+static void node_return_op_credits(Node *node, uint32_t n) {
+        node->n_ops_outstanding = n < node->n_ops_outstanding ? node->n_ops_outstanding - n : 0;
+
+        if (node->queued_ops && node_op_credits_available(node) > 0)
+                (void) node_schedule_flush(node);
+}
+
+static void node_operation_free(NodeOperation *op) {
+        sd_bus_slot_unref(op->slot);
+        if (op->node)
+                node_unref(op->node);
+        free(op->target);
+        free(op);
+}
+
+static void node_operation_fail(NodeOperation *op, const sd_bus_error *error) {
+        if (op->callback)
+                op->callback(NULL, error, op->userdata);
+}
+
+static void node_requeue_operations(Node *node);
+
+/* While the session can be resumed, ops wait for the node to reconnect */
+static bool node_is_waiting_for_session(Node *node) {
+        return !sd_id128_is_null(node->session) && (node->peer == NULL || !sd_bus_is_open(node->peer));
+}
+
+/* The reply to a call of one op, or to a Batch of the ops linked from
+ * the first by batch_next. The node queued all of a Batch or none. */
+static int node_operation_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        NodeOperation *op = userdata, *next;
+        _cleanup_(node_unrefp) Node *node = node_ref(op->node);
+        const sd_bus_error *error = sd_bus_message_get_error(m);
+        int r = 0;
+
+        op->slot = sd_bus_slot_unref(op->slot);
+
+        /* Lost with the connection, not failed. Everything else sent
+         * is, too. */
+        if (error && node_is_waiting_for_session(node)) {
+                node_requeue_operations(node);
+                return 0;
+        }
+
+        if (!error && op->batch_next)
+                r = sd_bus_message_enter_container(m, 'a', "o");
+
+        for (; op; op = next) {
+                const char *job_path;
+
+                next = steal_pointer(&op->batch_next);
+                LIST_REMOVE(ops, node->sent_ops, op);
+                node->n_calls_in_flight--;
+
+                if (error) {
+                        node_return_op_credits(node, 1);
+                        node_operation_fail(op, error);
+                        node_operation_free(op);
+                        continue;
+                }
+
+                if (r >= 0)
+                        r = sd_bus_message_read(m, "o", &job_path);
+                /* The credit of an op that got a node job comes back with its
+                 * JobRemoved, if we can't keep track of that it does now */
+                if (r > 0 && strv_append(&node->op_jobs, job_path) < 0)
+                        node_return_op_credits(node, 1);
+                if (r > 0 && op->callback)
+                        op->callback(job_path, NULL, op->userdata);
+                if (r <= 0) {
+                        sd_bus_error parse_error = { SD_BUS_ERROR_INVALID_ARGS, "Failed to parse node reply" };
+
+                        fprintf(stderr, "Failed to parse reply from node '%s': %s\n", node->name, strerror(r < 0 ? -r : EBADMSG));
+                        node_return_op_credits(node, 1);
+                        node_operation_fail(op, &parse_error);
+                }
+
+                node_operation_free(op);
+        }
+
+        return 0;
+}
+
+/* Sends op and the ops linked from it, on their own or as a Batch */
+static int node_send_operations(Node *node, NodeOperation *op) {
+        _cleanup_sd_bus_message_ sd_bus_message *m = NULL;
+        NodeOperation *o;
+        int r;
+
+        if (op->batch_next == NULL) {
+                r = sd_bus_message_new_method_call(node->peer, &m, NODE_BUS_NAME, NODE_PEER_OBJECT_PATH, NODE_PEER_IFACE,
+                                                   op->method);
+                if (r >= 0)
+                        r = sd_bus_message_append(m, "s", op->target);
+        } else {
+                r = sd_bus_message_new_method_call(node->peer, &m, NODE_BUS_NAME, NODE_PEER_OBJECT_PATH, NODE_PEER_IFACE,
+                                                   "Batch");
+                if (r >= 0)
+                        r = sd_bus_message_open_container(m, 'a', "(ss)");
+                for (o = op; r >= 0 && o; o = o->batch_next)
+                        r = sd_bus_message_append(m, "(ss)", o->method, o->target);
+                if (r >= 0)
+                        r = sd_bus_message_close_container(m);
+        }
+        if (r < 0)
+                return r;
+
+        return sd_bus_call_async(node->peer, &op->slot, m, node_operation_reply, op,
+                                 node_get_timeout(node, NODE_OP_CALL));
+}
+
+/* Sends everything queued for the node, as far as its credits allow,
+ * in Batches if it takes them */
+static int node_flush_operations(sd_event_source *s, void *userdata) {
+        _cleanup_(node_unrefp) Node *node = node_ref(userdata);
+        uint32_t max_ops = (node->features & NODE_FEATURE_BATCH) ? MAX_NODE_BATCH : 1;
+        int r;
+
+        node->flush_source = sd_event_source_disable_unref(node->flush_source);
+
+        if (node_is_waiting_for_session(node))
+                return 0; /* Flushed again once resumed */
+
+        /* Without credits the rest stays queued until ops complete */
+        while (node->queued_ops && node_op_credits_available(node) > 0) {
+                NodeOperation *first = node->queued_ops, *last = NULL, *op;
+                uint32_t i, n_ops = node_op_credits_available(node);
+
+                if (n_ops > max_ops)
+                        n_ops = max_ops;
+                for (i = 0; i < n_ops && node->queued_ops; i++) {
+                        op = node->queued_ops;
+                        if (node->queued_ops_tail == op)
+                                node->queued_ops_tail = NULL;
+                        LIST_REMOVE(ops, node->queued_ops, op);
+                        node->n_queued_ops--;
+                        if (last)
+                                last->batch_next = op;
+                        last = op;
+                }
+
+                r = node->peer ? node_send_operations(node, first) : -ENOTCONN;
+                if (r < 0) {
+                        sd_bus_error error = { SD_BUS_ERROR_FAILED, strerror(-r) };
+
+                        fprintf(stderr, "Failed to send operations to node '%s': %s\n", node->name, strerror(-r));
+                        while (first) {
+                                op = first;
+                                first = steal_pointer(&op->batch_next);
+                                node_operation_fail(op, &error);
+                                node_operation_free(op);
+                        }
+                        continue;
+                }
+
+                for (op = first; op; op = op->batch_next) {
+                        op->node = node_ref(node);
+                        LIST_PREPEND(ops, node->sent_ops, op);
+                        node->n_calls_in_flight++;
+                        node->n_ops_outstanding++;
+                }
+        }
+
+        return 0;
+}
+
+/* Queues method(target) to be sent at the end of this event loop
+ * iteration, together with whatever else is queued for the node */
+static NodeOperation *node_queue_operation(Node *node, const char *method, const char *target,
+                                           node_operation_callback callback, void *userdata) {
+        NodeOperation *op;
+
+        if (node_schedule_flush(node) < 0)
+                return NULL;
+
+        op = malloc0(sizeof(NodeOperation));
+        if (op == NULL)
+                return NULL;
+
+        op->target = strdup(target);
+        if (op->target == NULL) {
+                free(op);
+                return NULL;
+        }
+        op->method = method;
+        op->callback = callback;
+        op->userdata = userdata;
+        LIST_INSERT_AFTER(ops, node->queued_ops, node->queued_ops_tail, op);
+        node->queued_ops_tail = op;
+        node->n_queued_ops++;
+
+        return op;
+}
+
+/* The callback won't be called any more */
+static void node_cancel_operation(Node *node, NodeOperation *op) {
+        if (op->node != NULL) {
+                op->callback = NULL; /* freed with the reply */
+                return;
+        }
+
+        if (node->queued_ops_tail == op)
+                node->queued_ops_tail = op->ops_prev;
+        LIST_REMOVE(ops, node->queued_ops, op);
+        node->n_queued_ops--;
+        node_operation_free(op);
+}
+
+/* Puts an op that got no reply back at the front of the queue, to be
+ * sent again. The node may have started it already, ops are all safe
+ * to repeat. */
+static void node_requeue_operation(Node *node, NodeOperation *op) {
+        node_return_op_credits(node, 1);
+
+        if (op->callback == NULL) {
+                node_operation_free(op);
+                return;
+        }
+
+        op->slot = sd_bus_slot_unref(op->slot);
+        op->batch_next = NULL;
+        node_unref(steal_pointer(&op->node));
+        LIST_PREPEND(ops, node->queued_ops, op);
+        if (node->queued_ops_tail == NULL)
+                node->queued_ops_tail = op;
+        node->n_queued_ops++;
+}
+
+/* All ops still waiting for their reply, newest first so the oldest
+ * ends up in front */
+static void node_requeue_operations(Node *node) {
+        while (node->sent_ops) {
+                NodeOperation *op = node->sent_ops;
+
+                LIST_REMOVE(ops, node->sent_ops, op);
+                node->n_calls_in_flight--;
+                node_requeue_operation(node, op);
+        }
+
+        if (node->queued_ops)
+                (void) node_schedule_flush(node);
+}
+
 static int orch_get_n_nodes(Orchestrator *orch) {
         Node *node;
         int n_nodes = 0;
@@ -83,6 +688,9 @@ static void orch_add_node(Orchestrator *orch, Node *node) {
 }
 
 static void orch_remove_node(Orchestrator *orch, Node *node) {
+        if (node->name != NULL)
+                orch_state_changed(orch);
+
         LIST_REMOVE(nodes, orch->nodes, node);
         node_unref(node);
 }
@@ -98,164 +706,624 @@ static Node *orch_find_node(Orchestrator *orch, const char *name) {
         return NULL;
 }
 
+static int node_property_get_capabilities(sd_bus *bus, const char *path, const char *interface,
+                                          const char *property, sd_bus_message *reply,
+                                          void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+
+        return sd_bus_message_append_strv(reply, node->capabilities);
+}
+
+static int node_property_get_labels(sd_bus *bus, const char *path, const char *interface,
+                                    const char *property, sd_bus_message *reply,
+                                    void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+        char **l;
+        int r;
+
+        r = sd_bus_message_open_container(reply, 'a', "{ss}");
+        if (r < 0)
+                return r;
+
+        for (l = node->labels; l && *l; l++) {
+                const char *eq = strchr(*l, '=');
+                _cleanup_free_ char *key = strndup(*l, eq - *l);
+
+                if (key == NULL)
+                        return -ENOMEM;
+
+                r = sd_bus_message_append(reply, "{ss}", key, eq + 1);
+                if (r < 0)
+                        return r;
+        }
+
+        return sd_bus_message_close_container(reply);
+}
+
 static const sd_bus_vtable node_vtable[] = {
         SD_BUS_VTABLE_START(0),
+        SD_BUS_PROPERTY("Name", "s", NULL, offsetof(Node, name), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("InventoryVersion", "u", NULL, offsetof(Node, inventory_version), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("AgentVersion", "s", NULL, offsetof(Node, agent_version), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("ProtocolVersion", "u", NULL, offsetof(Node, protocol_version), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("Features", "t", NULL, offsetof(Node, features), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("Capabilities", "as", node_property_get_capabilities, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("Labels", "a{ss}", node_property_get_labels, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("OperationCredits", "u", NULL, offsetof(Node, op_credits), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("OperationsOutstanding", "u", NULL, offsetof(Node, n_ops_outstanding), 0),
+        SD_BUS_PROPERTY("OperationsQueued", "u", NULL, offsetof(Node, n_queued_ops), 0),
         SD_BUS_VTABLE_END
 };
 
+typedef struct IsolateAllJob IsolateAllJob;
+typedef struct IsolateRequest IsolateRequest;
+
+/* Per-node outcome, kept for the lifetime of the job. Times are in
+ * milliseconds since the job started. */
 typedef struct {
-        Job *job;
+        uint32_t dispatch_msec;
+        uint32_t reply_msec;
+        uint32_t done_msec;
+        int8_t result;          /* JobResult, _JOB_RESULT_INVALID while pending */
+        bool straggler;
+} IsolateNodeResult;
+
+/* All per-node outcomes of an IsolateAll job. This is the job's
+ * JobDetails, so it stays queryable for a while after the job is gone. */
+typedef struct {
+        JobDetails details;
+        int n_nodes;
+        IsolateNodeResult *results;
+        char **node_names;      /* references, see node_name_ref() */
+        char **errors;          /* NULL until the first node fails */
+} IsolateAllDetails;
+
+/* Per-node state that is only needed while the request is in flight */
+struct IsolateRequest {
+        IsolateAllJob *isolate_all;
         Node *node;
-        sd_bus_message *request;
-        sd_bus_slot *request_slot;
-        sd_bus_message *reply;
-        const char *job_object_path;
-        JobResult result;
+        uint32_t index;
+        NodeOperation *op;         /* until the reply arrives */
+        uint64_t dispatch_usec;
+        uint64_t reply_usec;
+        uint64_t expected_usec;
+        uint64_t held_since_usec;  /* node is holding its job back, 0 if not */
+        uint64_t held_usec;        /* total time held */
+        bool repeat;               /* node was isolated to the target already */
+        char *job_object_path;
+        bool tracking;
+        sd_event_source *deadline_source;
         JobTracker tracker;
-}  IsolateRequest;
-
-static void isolate_request_destroy(IsolateRequest *request) {
-        if (request->node)
-                node_unref(request->node);
-        if (request->request)
-                sd_bus_message_unref(request->request);
-        if (request->request_slot)
-                sd_bus_slot_unref(request->request_slot);
-        if (request->reply)
-                sd_bus_message_unref(request->reply);
-}
+        LIST_FIELDS(IsolateRequest, requests);
+};
 
+/* A node that has not been sent its request yet */
 typedef struct {
+        Node *node;
+        uint32_t index;
+        uint64_t expected_usec;
+} IsolatePending;
+
+/* Runs one node operation on target across all nodes: Isolate for
+ * IsolateAll jobs, Prepare for PrepareAll jobs */
+struct IsolateAllJob {
         Job job;
 
-        const char *target; /* owned by source_message */
+        char *target;
+        const char *node_method;
+        uint64_t start_usec;
         int n_outstanding_requests;
+        int n_failed;
         int n_requests;
-        IsolateRequest *requests;
-}  IsolateAllJob;
+        IsolateAllDetails *details; /* same as job.details until the job finishes, then NULL */
+
+        /* Longest expected first, dispatched while fewer than the
+         * dispatch window are in flight */
+        IsolatePending *pending;
+        int n_pending;
+        int next_pending;
+        uint64_t pending_expected_usec;
+
+        int n_in_flight;
+        int peak_in_flight;
+        int n_held;               /* nodes that held their job back at some point */
+        LIST_HEAD(IsolateRequest, requests); /* in dispatch order */
+        IsolateRequest *requests_tail;
+
+        DurationHistogram completion_times;
+        sd_event_source *straggler_source;
+};
+
+static void isolate_all_details_free(JobDetails *details) {
+        IsolateAllDetails *d = (IsolateAllDetails *)details;
+        int i;
+
+        for (i = 0; i < d->n_nodes; i++) {
+                node_name_unref(d->node_names[i]);
+                if (d->errors)
+                        free(d->errors[i]);
+        }
+        free(d->node_names);
+        free(d->errors);
+        free(d->results);
+        free(d);
+}
+
+static int isolate_all_details_append(JobDetails *details, sd_bus_message *reply) {
+        IsolateAllDetails *d = (IsolateAllDetails *)details;
+        int r, i;
+
+        r = sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "(sssuuu)");
+        if (r < 0)
+                return r;
+
+        for (i = 0; i < d->n_nodes; i++) {
+                IsolateNodeResult *node_result = &d->results[i];
+                const char *error = d->errors && d->errors[i] ? d->errors[i] : "";
+
+                r = sd_bus_message_append(reply, "(sssuuu)",
+                                          d->node_names[i] ?: "",
+                                          job_result_to_string(node_result->result) ?: "pending",
+                                          error,
+                                          node_result->dispatch_msec,
+                                          node_result->reply_msec,
+                                          node_result->done_msec);
+                if (r < 0)
+                        return r;
+        }
+
+        return sd_bus_message_close_container(reply);
+}
+
+static IsolateAllDetails *isolate_all_details_new(int n_nodes) {
+        IsolateAllDetails *d = malloc0(sizeof(IsolateAllDetails));
+        if (d == NULL)
+                return NULL;
+
+        d->details.append = isolate_all_details_append;
+        d->details.free = isolate_all_details_free;
+        d->n_nodes = n_nodes;
+        d->results = calloc(n_nodes, sizeof(IsolateNodeResult));
+        d->node_names = calloc(n_nodes, sizeof(char *));
+        if (d->results == NULL || d->node_names == NULL) {
+                isolate_all_details_free(&d->details);
+                return NULL;
+        }
+
+        return d;
+}
+
+static uint32_t isolate_all_elapsed_msec(IsolateAllJob *isolate_all) {
+        uint64_t now;
+
+        (void) sd_event_now(isolate_all->job.manager->event, CLOCK_MONOTONIC, &now);
+        return (now - isolate_all->start_usec) / 1000;
+}
+
+static IsolateRequest *isolate_request_new(IsolateAllJob *isolate_all, Node *node, uint32_t index) {
+        IsolateRequest *request = malloc0(sizeof(IsolateRequest));
+        if (request == NULL)
+                return NULL;
+
+        request->isolate_all = isolate_all;
+        request->node = node_ref(node);
+        request->index = index;
+        LIST_INSERT_AFTER(requests, isolate_all->requests, isolate_all->requests_tail, request);
+        isolate_all->requests_tail = request;
+
+        if (++isolate_all->n_in_flight > isolate_all->peak_in_flight)
+                isolate_all->peak_in_flight = isolate_all->n_in_flight;
+
+        return request;
+}
+
+static void isolate_request_free(IsolateRequest *request) {
+        IsolateAllJob *isolate_all = request->isolate_all;
+
+        if (request->tracking)
+                LIST_REMOVE(trackers, request->node->trackers, &request->tracker);
+        if (request->op)
+                node_cancel_operation(request->node, request->op);
+        sd_event_source_disable_unref(request->deadline_source);
+        node_unref(request->node);
+        free(request->job_object_path);
+
+        if (isolate_all->requests_tail == request)
+                isolate_all->requests_tail = request->requests_prev;
+        LIST_REMOVE(requests, isolate_all->requests, request);
+        isolate_all->n_in_flight--;
+        free(request);
+}
 
 static void job_isolate_all_destroy(Job *job) {
         IsolateAllJob *isolate_all = (IsolateAllJob *)job;
         int i;
 
-        if (isolate_all->requests) {
-                for (i = 0; i < isolate_all->n_requests; i++)
-                        isolate_request_destroy(&isolate_all->requests[i]);
-                free(isolate_all->requests);
-        }
+        while (isolate_all->requests)
+                isolate_request_free(isolate_all->requests);
+        for (i = isolate_all->next_pending; i < isolate_all->n_pending; i++)
+                node_unref(isolate_all->pending[i].node);
+        free(isolate_all->pending);
+        sd_event_source_unref(isolate_all->straggler_source);
+        free(isolate_all->target);
 }
 
 static void job_isolate_all_try_finish(Job *job) {
         IsolateAllJob *isolate_all = (IsolateAllJob *)job;
         Manager *manager = job->manager;
-        int i;
-        bool one_failed = false;
 
         if (isolate_all->n_outstanding_requests > 0)
                 return; /* All not done */
 
-        /* All requests done */
-        for (i = 0; i < isolate_all->n_requests; i++) {
-                if (isolate_all->requests[i].result == JOB_FAILED) {
-                        one_failed = true;
-                        break;
-                }
-        }
-        job->result = one_failed ? JOB_FAILED : JOB_DONE;
+        isolate_all->straggler_source = sd_event_source_disable_unref(isolate_all->straggler_source);
+
+        printf("Job %d: %d nodes, %d held back by node pressure, at most %d requests in flight, %zu bytes of node results\n",
+               job->id, isolate_all->n_requests, isolate_all->n_held, isolate_all->peak_in_flight,
+               isolate_all->n_requests * sizeof(IsolateNodeResult));
+
+        job->result = isolate_all->n_failed > 0 ? JOB_FAILED : JOB_DONE;
+        isolate_all->details = NULL; /* job.details, handed to the job history */
         manager_finish_job(manager, job);
 }
 
-static void  job_isolate_all_request_job_done(sd_bus_message *m, const char *result, void *userdata) {
-        IsolateRequest *request = userdata;
-        Node *node = request->node;
-        Job *job = request->job;
-        IsolateAllJob *isolate_all = (IsolateAllJob *)job;
-        JobResult res = JOB_DONE;
+static void isolate_all_node_done(IsolateAllJob *isolate_all, uint32_t index, JobResult result, const char *error) {
+        IsolateAllDetails *d = isolate_all->details;
+        IsolateNodeResult *node_result = &d->results[index];
 
-        if (strcmp(result, "done") != 0) {
-                fprintf(stderr, "Node '%s' isolate request failed with '%s'\n", node->name, result);
-                res = JOB_FAILED;
+        node_result->result = result;
+        node_result->done_msec = isolate_all_elapsed_msec(isolate_all);
+
+        if (result == JOB_FAILED) {
+                fprintf(stderr, "Node '%s' isolate request failed: %s\n", d->node_names[index] ?: "", error);
+                isolate_all->n_failed++;
+
+                if (d->errors == NULL)
+                        d->errors = calloc(d->n_nodes, sizeof(char *));
+                if (d->errors != NULL)
+                        d->errors[index] = strdup(error);
         }
 
-        request->result = res;
         isolate_all->n_outstanding_requests--;
-
-        job_isolate_all_try_finish(job);
 }
 
-static int job_isolate_all_request_cb (sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-        IsolateRequest *request = userdata;
-        Node *node = request->node;
-        Job *job = request->job;
-        IsolateAllJob *isolate_all = (IsolateAllJob *)job;
-        int r;
+/* Records the node's outcome and drops everything else kept for it */
+static void isolate_all_dispatch(IsolateAllJob *isolate_all);
 
-        if (sd_bus_message_is_method_error(m, NULL)) {
-                fprintf(stderr, "Got failure from isolate request");
-                request->result = JOB_FAILED;
-                isolate_all->n_outstanding_requests--;
-        } else {
-                request->reply = sd_bus_message_ref(m);
+static void isolate_request_finish(IsolateRequest *request, JobResult result, const char *error) {
+        IsolateAllJob *isolate_all = request->isolate_all;
+        IsolateNodeResult *node_result = &isolate_all->details->results[request->index];
 
-                r = sd_bus_message_read(request->reply, "o", &request->job_object_path);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to parse isolate response: %s\n", strerror(-r));
-                        request->result = JOB_FAILED;
-                        isolate_all->n_outstanding_requests--;
-                } else {
-                        node_add_job_tracker(node, &request->tracker,
-                                             request->job_object_path,
-                                             job_isolate_all_request_job_done,
-                                             request);
-                }
-        }
+        isolate_all_node_done(isolate_all, request->index, result, error);
 
-        job_isolate_all_try_finish(job);
+        /* Failures and timeouts say nothing about how long a node
+         * normally takes */
+        if (result == JOB_DONE)
+                histogram_add(&isolate_all->completion_times, node_result->done_msec - node_result->dispatch_msec);
 
-        return 0;
+        isolate_request_free(request);
+
+        isolate_all_dispatch(isolate_all);
+        job_isolate_all_try_finish(&isolate_all->job);
 }
 
-static int job_isolate_all(Job *job) {
-        IsolateAllJob *isolate_all = (IsolateAllJob *)job;
-        Manager *manager = job->manager;
+static void  job_isolate_all_request_job_done(sd_bus_message *m, const char *result, void *userdata) {
+        IsolateRequest *request = userdata;
+        _cleanup_free_ char *error = NULL;
+        JobResult res = JOB_DONE;
+
+        if (strcmp(result, "done") != 0) {
+                if (asprintf(&error, "Node job %s", result) < 0)
+                        error = NULL;
+                res = JOB_FAILED;
+        }
+
+        if (request->isolate_all->job.type == JOB_PREPARE_ALL && res == JOB_DONE) {
+                uint64_t now;
+
+                (void) sd_event_now(request->isolate_all->job.manager->event, CLOCK_MONOTONIC, &now);
+                latency_estimate_add(&request->node->latency[NODE_OP_PREPARE],
+                                     now - request->reply_usec - request->held_usec);
+        } else if (request->isolate_all->job.type == JOB_ISOLATE_ALL && res == JOB_DONE) {
+                uint64_t now;
+
+                (void) sd_event_now(request->isolate_all->job.manager->event, CLOCK_MONOTONIC, &now);
+                if (!request->repeat) {
+                        latency_estimate_add(&request->node->latency[NODE_OP_ISOLATE],
+                                             now - request->reply_usec - request->held_usec);
+                        node_record_duration(request->node, request->isolate_all->target, now - request->dispatch_usec);
+                }
+                node_set_target(request->node, request->isolate_all->target);
+        } else if (request->isolate_all->job.type == JOB_ISOLATE_ALL)
+                node_set_target(request->node, NULL);
+
+        request->tracking = false; /* Tracker already removed */
+        isolate_request_finish(request, res, error ?: result);
+}
+
+static uint64_t isolate_request_timeout(IsolateRequest *request) {
+        IsolateAllJob *isolate_all = request->isolate_all;
+
+        if (isolate_all->job.type == JOB_ISOLATE_ALL)
+                return node_get_isolate_timeout(request->node, isolate_all->target);
+        return node_get_timeout(request->node, NODE_OP_PREPARE);
+}
+
+static int isolate_request_deadline(sd_event_source *s, uint64_t usec, void *userdata) {
+        IsolateRequest *request = userdata;
+        _cleanup_free_ char *error = NULL;
+
+        if (asprintf(&error, "Timed out after %" PRIu64 " ms waiting for node job",
+                     (usec - request->reply_usec) / 1000) < 0)
+                error = NULL;
+
+        if (request->isolate_all->job.type == JOB_ISOLATE_ALL) {
+                node_isolate_timed_out(request->node, request->isolate_all->target);
+                node_set_target(request->node, NULL);
+        } else
+                node_timed_out(request->node, NODE_OP_PREPARE);
+        isolate_request_finish(request, JOB_FAILED, error ?: "Timed out");
+
+        return 0;
+}
+
+/* Time a node holds its job back under pressure doesn't count against
+ * the node: the deadline is paused and not part of latency samples */
+static void job_isolate_all_request_job_held(bool held, const char *reason, void *userdata) {
+        IsolateRequest *request = userdata;
+        IsolateAllJob *isolate_all = request->isolate_all;
+        Node *node = request->node;
+        uint64_t now;
+
+        (void) sd_event_now(isolate_all->job.manager->event, CLOCK_MONOTONIC, &now);
+
+        if (held) {
+                if (request->held_since_usec != 0)
+                        return;
+
+                printf("Job %d: node '%s' holds its job: %s\n", isolate_all->job.id, node->name, reason);
+                if (request->held_usec == 0)
+                        isolate_all->n_held++;
+                request->held_since_usec = now;
+                if (request->deadline_source)
+                        (void) sd_event_source_set_enabled(request->deadline_source, SD_EVENT_OFF);
+        } else {
+                if (request->held_since_usec == 0)
+                        return;
+
+                request->held_usec += now - request->held_since_usec;
+                request->held_since_usec = 0;
+                printf("Job %d: node '%s' admitted its job after %" PRIu64 " ms\n",
+                       isolate_all->job.id, node->name, request->held_usec / 1000);
+                if (request->deadline_source) {
+                        (void) sd_event_source_set_time_relative(request->deadline_source,
+                                                                 isolate_request_timeout(request));
+                        (void) sd_event_source_set_enabled(request->deadline_source, SD_EVENT_ONESHOT);
+                }
+        }
+}
+
+static void job_isolate_all_request_cb(const char *job_object_path, const sd_bus_error *error, void *userdata) {
+        IsolateRequest *request = userdata;
+        IsolateAllJob *isolate_all = request->isolate_all;
+        Node *node = request->node;
+        int r;
+
+        /* The reply is all we wanted from the call */
+        request->op = NULL;
+        isolate_all->details->results[request->index].reply_msec = isolate_all_elapsed_msec(isolate_all);
+        (void) sd_event_now(isolate_all->job.manager->event, CLOCK_MONOTONIC, &request->reply_usec);
+
+        if (error != NULL) {
+                if (error->name && strcmp(error->name, SD_BUS_ERROR_NO_REPLY) == 0)
+                        node_timed_out(node, NODE_OP_CALL);
+                isolate_request_finish(request, JOB_FAILED, error->message ?: error->name);
+                return;
+        }
+
+        latency_estimate_add(&node->latency[NODE_OP_CALL], request->reply_usec - request->dispatch_usec);
+
+        request->job_object_path = strdup(job_object_path);
+        if (request->job_object_path == NULL) {
+                isolate_request_finish(request, JOB_FAILED, strerror(ENOMEM));
+                return;
+        }
+
+        node_add_job_tracker(node, &request->tracker,
+                             request->job_object_path,
+                             job_isolate_all_request_job_done,
+                             job_isolate_all_request_job_held,
+                             request);
+        request->tracking = true;
+
+        r = sd_event_add_time_relative(isolate_all->job.manager->event, &request->deadline_source,
+                                       CLOCK_MONOTONIC, isolate_request_timeout(request), 0,
+                                       isolate_request_deadline, request);
+        if (r < 0)
+                fprintf(stderr, "Failed to add isolate deadline for node '%s': %s\n", node->name, strerror(-r));
+}
+
+static int isolate_all_check_stragglers(sd_event_source *s, uint64_t usec, void *userdata) {
+        IsolateAllJob *isolate_all = userdata;
+        Job *job = &isolate_all->job;
+        Manager *manager = job->manager;
+        Orchestrator *orch = (Orchestrator *)manager;
+        IsolateRequest *request;
+        uint32_t median, threshold, now;
+
+        if (isolate_all->completion_times.count >= STRAGGLER_MIN_SAMPLES) {
+                median = histogram_quantile(&isolate_all->completion_times, 0.5);
+                threshold = median * orch->straggler_factor;
+                if (threshold < STRAGGLER_CHECK_INTERVAL / 1000)
+                        threshold = STRAGGLER_CHECK_INTERVAL / 1000;
+                now = isolate_all_elapsed_msec(isolate_all);
+
+                /* Requests are in dispatch order, so everything after the
+                 * first one that is within the threshold is too */
+                LIST_FOREACH(requests, request, isolate_all->requests) {
+                        IsolateNodeResult *node_result = &isolate_all->details->results[request->index];
+                        uint32_t elapsed = now - node_result->dispatch_msec;
+
+                        if (elapsed <= threshold)
+                                break;
+                        if (node_result->straggler || request->held_since_usec != 0)
+                                continue;
+
+                        node_result->straggler = true;
+                        fprintf(stderr, "Job %d: node '%s' is straggling, %u ms vs median %u ms\n",
+                                job->id, request->node->name, elapsed, median);
+                        (void) sd_bus_emit_signal(manager->bus, manager->manager_path, manager->manager_iface,
+                                                  "NodeStraggling", "uosuu",
+                                                  job->id, job->object_path, request->node->name,
+                                                  elapsed, median);
+                }
+        }
+
+        (void) sd_event_source_set_time_relative(s, STRAGGLER_CHECK_INTERVAL);
+        (void) sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+
+        return 0;
+}
+
+static void isolate_all_send(IsolateAllJob *isolate_all, Node *node, uint32_t index, uint64_t expected_usec) {
+        Manager *manager = isolate_all->job.manager;
+        IsolateRequest *request;
+
+        isolate_all->details->results[index].dispatch_msec = isolate_all_elapsed_msec(isolate_all);
+
+        /* Preparing is only an optimization, older nodes just isolate cold */
+        if (isolate_all->job.type == JOB_PREPARE_ALL && !(node->features & NODE_FEATURE_PREPARE)) {
+                printf("Job %d: node '%s' can't prepare, skipping it\n", isolate_all->job.id, node->name);
+                isolate_all_node_done(isolate_all, index, JOB_DONE, NULL);
+                return;
+        }
+
+        request = isolate_request_new(isolate_all, node, index);
+        if (request == NULL) {
+                isolate_all_node_done(isolate_all, index, JOB_FAILED, strerror(ENOMEM));
+                return;
+        }
+
+        request->expected_usec = expected_usec;
+        request->repeat = node->target != NULL && strcmp(node->target, isolate_all->target) == 0;
+        (void) sd_event_now(manager->event, CLOCK_MONOTONIC, &request->dispatch_usec);
+
+        request->op = node_queue_operation(node, isolate_all->node_method, isolate_all->target,
+                                           job_isolate_all_request_cb, request);
+        if (request->op == NULL) {
+                isolate_all_node_done(isolate_all, index, JOB_FAILED, strerror(ENOMEM));
+                isolate_request_free(request);
+        }
+}
+
+/* Sends requests until the dispatch window is full */
+static void isolate_all_dispatch(IsolateAllJob *isolate_all) {
+        Orchestrator *orch = (Orchestrator *)isolate_all->job.manager;
+
+        while (isolate_all->next_pending < isolate_all->n_pending &&
+               (orch->dispatch_window <= 0 || isolate_all->n_in_flight < orch->dispatch_window)) {
+                IsolatePending *p = &isolate_all->pending[isolate_all->next_pending++];
+                _cleanup_(node_unrefp) Node *node = steal_pointer(&p->node);
+
+                isolate_all->pending_expected_usec -= p->expected_usec;
+                isolate_all_send(isolate_all, node, p->index, p->expected_usec);
+        }
+}
+
+static int isolate_pending_compare(const void *a, const void *b) {
+        const IsolatePending *pa = a, *pb = b;
+
+        /* Nodes without history first, as they may well be slow */
+        if (pa->expected_usec == 0 || pb->expected_usec == 0)
+                return (pa->expected_usec != 0) - (pb->expected_usec != 0);
+
+        if (pa->expected_usec != pb->expected_usec)
+                return pa->expected_usec > pb->expected_usec ? -1 : 1;
+        return pa->index < pb->index ? -1 : 1;
+}
+
+/* Estimated time left, from the per-node history of this target. With a
+ * window the pending work is assumed to spread evenly over it. */
+static uint64_t job_isolate_all_remaining(Job *job) {
+        IsolateAllJob *isolate_all = (IsolateAllJob *)job;
+        Orchestrator *orch = (Orchestrator *)job->manager;
+        IsolateRequest *request;
+        uint64_t now, in_flight_max = 0, total;
+        int window;
+
+        (void) sd_event_now(job->manager->event, CLOCK_MONOTONIC, &now);
+
+        total = isolate_all->pending_expected_usec;
+        LIST_FOREACH(requests, request, isolate_all->requests) {
+                uint64_t left = 0;
+
+                if (request->dispatch_usec + request->expected_usec > now)
+                        left = request->dispatch_usec + request->expected_usec - now;
+                if (left > in_flight_max)
+                        in_flight_max = left;
+                total += left;
+        }
+
+        window = orch->dispatch_window > 0 ? orch->dispatch_window : isolate_all->n_requests;
+        if (window > 0 && total / window > in_flight_max)
+                return total / window;
+        return in_flight_max;
+}
+
+static int job_isolate_all(Job *job) {
+        IsolateAllJob *isolate_all = (IsolateAllJob *)job;
+        Manager *manager = job->manager;
         Orchestrator *orch = (Orchestrator *)manager;
         Node *node;
         int n_requests;
         int r, i;
 
-        printf ("Running job %d IsolateAll '%s'\n", job->id, isolate_all->target);
+        printf ("Running job %d %s '%s'\n", job->id, job_type_to_string(job->type), isolate_all->target);
+
+        (void) sd_event_now(manager->event, CLOCK_MONOTONIC, &isolate_all->start_usec);
 
         n_requests = orch_get_n_nodes(orch);
         isolate_all->n_requests = n_requests;
-        isolate_all->requests = calloc(n_requests, sizeof(IsolateRequest));
-        if (isolate_all->requests == NULL) {
+        isolate_all->details = isolate_all_details_new(n_requests);
+        isolate_all->pending = calloc(n_requests, sizeof(IsolatePending));
+        if (isolate_all->details != NULL)
+                job->details = &isolate_all->details->details;
+        if (isolate_all->details == NULL || isolate_all->pending == NULL) {
+                isolate_all->details = NULL;
                 job->result = JOB_FAILED;
                 manager_finish_job(manager, job);
                 return 0;
         }
 
+        if (orch->straggler_factor > 0) {
+                r = sd_event_add_time_relative(manager->event, &isolate_all->straggler_source,
+                                               CLOCK_MONOTONIC, STRAGGLER_CHECK_INTERVAL, 0,
+                                               isolate_all_check_stragglers, isolate_all);
+                if (r < 0)
+                        fprintf(stderr, "Failed to add straggler check timer: %s\n", strerror(-r));
+        }
+
         i = 0;
         LIST_FOREACH(nodes, node, orch->nodes) {
-                IsolateRequest *request = &isolate_all->requests[i++];
-
-                request->job = job;
-                request->node = node;
-                request->result = _JOB_RESULT_INVALID;
-
-                r = sd_bus_message_new_method_call(node->peer, &request->request, NODE_BUS_NAME, NODE_PEER_OBJECT_PATH, NODE_PEER_IFACE, "Isolate");
-                if (r >= 0)
-                        r = sd_bus_message_append(request->request, "s", isolate_all->target);
-                if (r >= 0)
-                        r = sd_bus_call_async(node->peer, &request->request_slot, request->request, job_isolate_all_request_cb, request, DEFAULT_DBUS_TIMEOUT);
-                if (r < 0) {
-                        fprintf(stderr, "Failed to send isolate request: %s\n", strerror(-r));
-                        request->result = JOB_FAILED;
-                        continue;
-                }
-
-                isolate_all->n_outstanding_requests++;
+                IsolatePending *p = &isolate_all->pending[i];
+
+                isolate_all->details->node_names[i] = node_name_ref(node->name);
+                isolate_all->details->results[i].result = _JOB_RESULT_INVALID;
+
+                p->node = node_ref(node);
+                p->index = i++;
+                if (job->type == JOB_ISOLATE_ALL)
+                        p->expected_usec = node_expected_duration(node, isolate_all->target);
+                else
+                        p->expected_usec = node->latency[NODE_OP_PREPARE].srtt_usec;
+                isolate_all->pending_expected_usec += p->expected_usec;
         }
+        isolate_all->n_pending = n_requests;
+        isolate_all->n_outstanding_requests = n_requests;
+
+        /* Feeding the slowest nodes first shortens windowed jobs */
+        qsort(isolate_all->pending, n_requests, sizeof(IsolatePending), isolate_pending_compare);
 
+        isolate_all_dispatch(isolate_all);
         job_isolate_all_try_finish(job);
 
         return 0;
@@ -265,10 +1333,94 @@ static int cancel_isolate_all(Job *job) {
         return 0;
 }
 
+/* If the submission carries an idempotency key that was already used,
+ * reply with the existing job instead of queuing a new one. Returns 1 if
+ * a reply was sent. */
+static int reply_existing_job(sd_bus_message *m, Manager *manager, const char *key, const char *request) {
+        _cleanup_free_ char *job_path = NULL;
+        uint32_t job_id;
+        int r;
+
+        r = manager_lookup_idempotency_key(manager, key, request, &job_id);
+        if (r == -ENOENT)
+                return 0;
+        if (r == -EEXIST)
+                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS,
+                                                  "Idempotency key '%s' was used for a different request", key);
+
+        r = asprintf(&job_path, "%s/%u", manager->job_path_prefix, job_id);
+        if (r < 0)
+                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_NO_MEMORY, "No memory");
+
+        printf("Idempotency key '%s' matches job %u\n", key, job_id);
+
+        r = sd_bus_reply_method_return(m, "o", job_path);
+        return r < 0 ? r : 1;
+}
+
+/* id is 0 for a new job, or the one a job passed on to us had */
+static int queue_isolate_all(Manager *manager, JobType type, sd_bus_message *m, const char *target,
+                             uint32_t id, Job **job_out) {
+        _cleanup_free_ char *target_copy = strdup(target);
+        IsolateAllJob *isolate_all;
+        Job *job;
+        int r;
+
+        if (target_copy == NULL)
+                return -ENOMEM;
+
+        if (id != 0)
+                r = manager_queue_job_with_id(manager, id, type, sizeof(IsolateAllJob),
+                                              job_isolate_all, cancel_isolate_all, job_isolate_all_destroy, &job);
+        else
+                r = manager_queue_job(manager, type, sizeof(IsolateAllJob), m,
+                                      job_isolate_all, cancel_isolate_all, job_isolate_all_destroy, &job);
+        if (r < 0)
+                return r;
+
+        isolate_all = (IsolateAllJob *)job;
+        isolate_all->target = steal_pointer(&target_copy);
+        isolate_all->node_method = type == JOB_PREPARE_ALL ? "Prepare" : "Isolate";
+        job->remaining_cb = job_isolate_all_remaining;
+
+        *job_out = job;
+        return 0;
+}
+
+static int submit_isolate_all(sd_bus_message *m, Manager *manager, JobType type, const char *target, const char *key) {
+        _cleanup_(job_unrefp) Job *job = NULL;
+        _cleanup_free_ char *request = NULL;
+        int r;
+
+        /* The new instance has the queue already, it would never see this job */
+        if (((Orchestrator *)manager)->upgrade_pid > 0)
+                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED, "Upgrade in progress");
+
+        if (key != NULL && *key != 0) {
+                r = asprintf(&request, "%s %s", job_type_to_string(type), target);
+                if (r < 0)
+                        return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_NO_MEMORY, "No memory");
+
+                r = reply_existing_job(m, manager, key, request);
+                if (r != 0)
+                        return r;
+        }
+
+        r = queue_isolate_all(manager, type, m, target, 0, &job);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to create job: %m");
+
+        if (request != NULL) {
+                r = manager_add_idempotency_key(manager, key, request, job->id);
+                if (r < 0)
+                        fprintf(stderr, "Failed to store idempotency key: %s\n", strerror(-r));
+        }
+
+        return orch_reply_replicated((Orchestrator *)manager, m, job->object_path);
+}
+
 static int method_orchestrator_isolate_all(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
         Manager *manager = userdata;
-        _cleanup_(job_unrefp) Job *job = NULL;
-        IsolateAllJob *isolate_all;
         const char *target;
         int r;
 
@@ -276,25 +1428,557 @@ static int method_orchestrator_isolate_all(sd_bus_message *m, void *userdata, sd
         if (r < 0)
                 return sd_bus_reply_method_errnof(m, -r, "Failed to create job: %m");
 
-        r = manager_queue_job(manager, JOB_ISOLATE_ALL, sizeof(IsolateAllJob), m,
-                              job_isolate_all, cancel_isolate_all, job_isolate_all_destroy, &job);
+        return submit_isolate_all(m, manager, JOB_ISOLATE_ALL, target, NULL);
+}
+
+static int method_orchestrator_isolate_all_with_key(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Manager *manager = userdata;
+        const char *target;
+        const char *key;
+        int r;
+
+        r = sd_bus_message_read(m, "ss", &target, &key);
         if (r < 0)
                 return sd_bus_reply_method_errnof(m, -r, "Failed to create job: %m");
 
-        isolate_all = (IsolateAllJob *)job;
-        isolate_all->target = target;
+        return submit_isolate_all(m, manager, JOB_ISOLATE_ALL, target, key);
+}
+
+/* Starts what can be started of target on all nodes ahead of an IsolateAll */
+static int method_orchestrator_prepare_all(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Manager *manager = userdata;
+        const char *target;
+        int r;
+
+        r = sd_bus_message_read(m, "s", &target);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to create job: %m");
+
+        return submit_isolate_all(m, manager, JOB_PREPARE_ALL, target, NULL);
+}
+
+static int method_orchestrator_prepare_all_with_key(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Manager *manager = userdata;
+        const char *target;
+        const char *key;
+        int r;
+
+        r = sd_bus_message_read(m, "ss", &target, &key);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to create job: %m");
+
+        return submit_isolate_all(m, manager, JOB_PREPARE_ALL, target, key);
+}
+
+static int method_orchestrator_get_job_result(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Manager *manager = userdata;
+        const JobHistoryEntry *entry;
+        uint32_t id;
+        int r;
+
+        r = sd_bus_message_read(m, "u", &id);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to parse parameters: %m");
+
+        if (manager_find_job(manager, id) != NULL)
+                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED, "Job %u has not finished yet", id);
+
+        entry = manager_lookup_job_history(manager, id);
+        if (entry == NULL)
+                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_UNKNOWN_OBJECT, "No result known for job %u", id);
+
+        return sd_bus_reply_method_return(m, "sst",
+                                          job_type_to_string(entry->type),
+                                          job_result_to_string(entry->result),
+                                          entry->finished_usec);
+}
+
+static int method_orchestrator_get_job_node_results(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Manager *manager = userdata;
+        _cleanup_sd_bus_message_ sd_bus_message *reply = NULL;
+        const JobHistoryEntry *entry;
+        JobDetails *details = NULL;
+        Job *job;
+        uint32_t id;
+        int r;
+
+        r = sd_bus_message_read(m, "u", &id);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to parse parameters: %m");
+
+        job = manager_find_job(manager, id);
+        if (job != NULL)
+                details = job->details;
+        else {
+                entry = manager_lookup_job_history(manager, id);
+                if (entry != NULL)
+                        details = entry->details;
+        }
+
+        if (details == NULL)
+                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_UNKNOWN_OBJECT, "No node results known for job %u", id);
+
+        r = sd_bus_message_new_method_return(m, &reply);
+        if (r >= 0)
+                r = details->append(details, reply);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to build reply: %m");
+
+        return sd_bus_send(NULL, reply, NULL);
+}
+
+#define UPGRADE_POLL_INTERVAL (USEC_PER_SEC / 10)
+
+static void orch_accept_connection(int fd, void *userdata);
+
+/* No jobs start while upgrading, the waiting ones are passed on */
+static bool orch_admit_job(Manager *manager, Job *job) {
+        Orchestrator *orch = (Orchestrator *)manager;
+
+        return orch->upgrade_message == NULL && !orch->standby;
+}
+
+static void orch_job_removed(Manager *manager, Job *job) {
+        orch_state_changed((Orchestrator *)manager);
+}
+
+static bool node_can_hand_off(Node *node) {
+        return node->name != NULL && node->peer != NULL && (node->features & NODE_FEATURE_HANDOFF);
+}
+
+/* Nothing in flight that the new instance could not pick up */
+static bool orch_is_quiet(Orchestrator *orch) {
+        Node *node;
+
+        if (orch->manager.current_job != NULL)
+                return false;
+
+        LIST_FOREACH(nodes, node, orch->nodes) {
+                if (node->queued_ops != NULL || node->n_calls_in_flight > 0)
+                        return false;
+        }
+
+        return true;
+}
+
+static int node_disconnected(sd_bus_message *message, void *userdata, sd_bus_error *error);
+
+static void orch_upgrade_abort(Orchestrator *orch, int error) {
+        Node *node, *next;
+        int r;
+
+        fprintf(stderr, "Upgrade failed: %s\n", strerror(error));
+
+        if (orch->upgrade_pid > 0) {
+                (void) kill(orch->upgrade_pid, SIGKILL);
+                (void) waitpid(orch->upgrade_pid, NULL, 0);
+                orch->upgrade_pid = 0;
+        }
+        orch->upgrade_status = sd_event_source_disable_unref(orch->upgrade_status);
+
+        /* Nodes carry on with us, they haven't sent anything since
+         * HandoffReady. Those we can't read from again are dropped. */
+        LIST_FOREACH_SAFE(nodes, node, next, orch->nodes) {
+                if (node->handed_off) {
+                        node->handed_off = false;
+                        r = sd_bus_attach_event(node->peer, orch->manager.event, SD_EVENT_PRIORITY_NORMAL);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to take back node '%s': %s\n", node->name, strerror(-r));
+                                node->handoff_requested = false;
+                                (void) node_disconnected(NULL, node, NULL);
+                                continue;
+                        }
+                }
+                if (node->handoff_ready != NULL) {
+                        (void) sd_bus_reply_method_errnof(node->handoff_ready, error, "Upgrade failed: %m");
+                        node->handoff_ready = sd_bus_message_unref(node->handoff_ready);
+                }
+                node->handoff_requested = false;
+        }
+
+        (void) sd_bus_reply_method_errnof(orch->upgrade_message, error, "Upgrade failed: %m");
+        orch->upgrade_message = sd_bus_message_unref(orch->upgrade_message);
+        orch->upgrade_timer = sd_event_source_disable_unref(orch->upgrade_timer);
+        orch->handoff_deadline = 0;
+
+        r = acceptor_start(&orch->acceptor, orch->manager.event, orch->acceptor.listen_fd,
+                           orch_accept_connection, orch);
+        if (r < 0)
+                fprintf(stderr, "Failed to accept connections again: %s\n", strerror(-r));
+
+        manager_retry_admission(&orch->manager);
+}
+
+static HandoffRecord *handoff_add(HandoffRecord ***tail, const char *type, int fd) {
+        HandoffRecord *rec = handoff_record_new(type, fd);
+
+        if (rec != NULL) {
+                **tail = rec;
+                *tail = &rec->next;
+        }
+        return rec;
+}
+
+static void node_serialize(Node *node, HandoffRecord *rec) {
+        TargetHistory *h;
+        char **s;
+        int op;
+
+        handoff_record_put(rec, "name", "%s", node->name);
+        handoff_record_put(rec, "inventory-version", "%" PRIu32, node->inventory_version);
+        handoff_record_put(rec, "protocol-version", "%" PRIu32, node->protocol_version);
+        handoff_record_put(rec, "features", "%" PRIu64, node->features);
+        if (node->agent_version)
+                handoff_record_put(rec, "agent-version", "%s", node->agent_version);
+        for (s = node->capabilities; s && *s; s++)
+                handoff_record_put(rec, "capability", "%s", *s);
+        for (s = node->labels; s && *s; s++)
+                handoff_record_put(rec, "label", "%s", *s);
+        handoff_record_put(rec, "operation-credits", "%" PRIu32, node->op_credits);
+        for (s = node->op_jobs; s && *s; s++)
+                handoff_record_put(rec, "operation-job", "%s", *s);
+        handoff_record_put(rec, "events-ungranted", "%" PRIu32, node->n_events_ungranted);
+        if (!sd_id128_is_null(node->session))
+                handoff_record_put(rec, "session", SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL(node->session));
+        handoff_record_put(rec, "events-received", "%" PRIu64, node->n_events_received);
+        for (op = 0; op < _NODE_OP_MAX; op++)
+                handoff_record_put(rec, "latency", "%d %" PRIu64 " %" PRIu64 " %" PRIu32, op,
+                                   node->latency[op].srtt_usec, node->latency[op].rttvar_usec,
+                                   node->latency[op].n_samples);
+        if (node->target)
+                handoff_record_put(rec, "isolated-to", "%s", node->target);
+        /* Most recently used first, the target name last as it is free form */
+        LIST_FOREACH(target_history, h, node->target_history)
+                handoff_record_put(rec, "target", "%" PRIu64 " %" PRIu64 " %" PRIu32 " %s",
+                                   h->duration.srtt_usec, h->duration.rttvar_usec,
+                                   h->duration.n_samples, h->target);
+}
+
+/* Everything the new instance needs, in the order it needs it. A
+ * replica is for a standby, which gets no fds and takes nodes over by
+ * their sessions. */
+static int orch_serialize(Orchestrator *orch, bool replica, HandoffRecord **records_out, uint32_t *n_nodes_out) {
+        Manager *manager = &orch->manager;
+        HandoffRecord *records = NULL, **tail = &records, *rec;
+        IsolateAllJob *isolate_all;
+        IdempotencyKey *k;
+        uint32_t i, n_nodes = 0;
+        Node *node;
+        Job *job;
+        int r = 0;
+
+        rec = handoff_add(&tail, "orchestrator", -1);
+        if (rec)
+                handoff_record_put(rec, "next-job-id", "%" PRIu32, manager->next_job_id);
+
+        if (rec && !replica)
+                rec = handoff_add(&tail, "listen", orch->acceptor.listen_fd);
+
+        /* Held on for the new instance, so the standby can't take over meanwhile */
+        if (rec && !replica && orch->ha_lock_fd >= 0)
+                rec = handoff_add(&tail, "ha-lock", orch->ha_lock_fd);
+
+        for (i = 0; rec && i < manager->history_size; i++) {
+                JobHistoryEntry *entry = &manager->history[i];
+
+                if (entry->id == 0)
+                        continue;
+                rec = handoff_add(&tail, "history", -1);
+                if (rec) {
+                        handoff_record_put(rec, "id", "%" PRIu32, entry->id);
+                        handoff_record_put(rec, "type", "%d", entry->type);
+                        handoff_record_put(rec, "result", "%d", entry->result);
+                        handoff_record_put(rec, "finished", "%" PRIu64, entry->finished_usec);
+                }
+        }
+
+        /* Oldest first, the keys start a new ttl on the other side */
+        for (k = manager->idempotency_oldest; rec && k; k = k->by_age_prev) {
+                rec = handoff_add(&tail, "idempotency-key", -1);
+                if (rec) {
+                        handoff_record_put(rec, "key", "%s", k->key);
+                        handoff_record_put(rec, "request", "%s", k->request);
+                        handoff_record_put(rec, "job", "%" PRIu32, k->job_id);
+                }
+        }
+
+        /* On upgrade all are waiting, the running one finished before we
+         * got here. A replica has it too, the standby starts it over. */
+        LIST_FOREACH(jobs, job, manager->jobs) {
+                if (rec == NULL)
+                        break;
+                isolate_all = (IsolateAllJob *)job;
+                rec = handoff_add(&tail, "job", -1);
+                if (rec) {
+                        handoff_record_put(rec, "id", "%" PRIu32, job->id);
+                        handoff_record_put(rec, "type", "%d", job->type);
+                        handoff_record_put(rec, "target", "%s", isolate_all->target);
+                }
+        }
+
+        LIST_FOREACH(nodes, node, orch->nodes) {
+                if (rec == NULL)
+                        break;
+                if (replica ? node->name == NULL || sd_id128_is_null(node->session) : node->handoff_ready == NULL)
+                        continue;
+                rec = handoff_add(&tail, "node", replica ? -1 : sd_bus_get_fd(node->peer));
+                if (rec)
+                        node_serialize(node, rec);
+                n_nodes++;
+        }
+
+        if (rec)
+                rec = handoff_add(&tail, "end", -1);
+        if (rec == NULL)
+                r = -ENOMEM;
+
+        for (rec = records; r >= 0 && rec; rec = rec->next)
+                r = handoff_record_finish(rec);
+        if (r < 0) {
+                handoff_record_free_all(records);
+                return r;
+        }
+
+        *records_out = records;
+        *n_nodes_out = n_nodes;
+        return 0;
+}
+
+/* The new instance has resumed, it takes over from here */
+static int orch_upgrade_status_cb(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        Orchestrator *orch = userdata;
+        Node *node;
+        char c;
+        ssize_t n;
+        int r;
+
+        n = read(fd, &c, 1);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                return 0;
+        if (n <= 0) {
+                /* Closed without a word, it failed */
+                orch_upgrade_abort(orch, n < 0 ? errno : EPIPE);
+                return 0;
+        }
+
+        printf("New instance %d took over %" PRIu32 " nodes\n", (int) orch->upgrade_pid, orch->upgrade_n_nodes);
+
+        /* The nodes authenticate with the new instance on this */
+        LIST_FOREACH(nodes, node, orch->nodes) {
+                if (!node->handed_off)
+                        continue;
+
+                r = sd_bus_reply_method_return(node->handoff_ready, "");
+                if (r >= 0)
+                        r = sd_bus_flush(node->peer);
+                if (r < 0)
+                        fprintf(stderr, "Failed to hand off node '%s': %s\n", node->name, strerror(-r));
+        }
+
+        (void) sd_bus_reply_method_return(orch->upgrade_message, "u", orch->upgrade_n_nodes);
+        (void) sd_bus_release_name(orch->manager.bus, ORCHESTRATOR_BUS_NAME);
+        (void) sd_bus_flush(orch->manager.bus);
+        (void) sd_notifyf(false, "MAINPID=%d", (int) orch->upgrade_pid);
+
+        orch->upgrade_status = sd_event_source_disable_unref(orch->upgrade_status);
+        return sd_event_exit(orch->manager.event, 0);
+}
+
+/* Starts the new instance with everything handed to it. We stay until it
+ * confirms that it has resumed, and take over again if it doesn't. */
+static void orch_upgrade_spawn(Orchestrator *orch) {
+        HandoffRecord *records = NULL;
+        _cleanup_free_ char *fd_arg = NULL;
+        _cleanup_free_ char **argv = NULL;
+        uint32_t n_nodes = 0;
+        int status[2] = { -1, -1 };
+        size_t argc;
+        Node *node;
+        pid_t pid;
+        int sock, r;
+
+        r = orch_serialize(orch, false, &records, &n_nodes);
+        if (r < 0) {
+                orch_upgrade_abort(orch, -r);
+                return;
+        }
+
+        argc = strv_length(orch->argv);
+        argv = calloc(argc + 2, sizeof(char *));
+        if (argv == NULL || pipe2(status, O_CLOEXEC) < 0) {
+                r = argv == NULL ? ENOMEM : errno;
+                handoff_record_free_all(records);
+                orch_upgrade_abort(orch, r);
+                return;
+        }
+
+        /* The orchestrator record carries the pipe the new instance confirms on */
+        records->fd = status[1];
+
+        /* Whatever the nodes send next is for the new instance. They wait
+         * for the reply to HandoffReady, see orch_upgrade_status_cb(). */
+        LIST_FOREACH(nodes, node, orch->nodes) {
+                if (node->handoff_ready == NULL)
+                        continue;
+
+                (void) sd_bus_detach_event(node->peer);
+                node->handed_off = true;
+        }
+
+        sock = handoff_start_sender(records);
+        handoff_record_free_all(records);
+        close(status[1]);
+        if (sock < 0) {
+                r = -sock;
+                goto fail;
+        }
+
+        if (asprintf(&fd_arg, "--handoff-fd=%d", sock) < 0) {
+                r = ENOMEM;
+                close(sock);
+                goto fail;
+        }
+        memcpy(argv, orch->argv, argc * sizeof(char *));
+        argv[argc] = fd_arg;
+
+        printf("Handing off %" PRIu32 " nodes to a new %s\n", n_nodes, argv[0]);
+        fflush(stdout);
+
+        pid = fork();
+        if (pid < 0) {
+                r = errno;
+                close(sock);
+                goto fail;
+        }
+        if (pid == 0) {
+                if (fcntl(sock, F_SETFD, 0) < 0)
+                        _exit(EXIT_FAILURE);
+                execvp(argv[0], argv);
+                fprintf(stderr, "Failed to execute %s: %m\n", argv[0]);
+                _exit(EXIT_FAILURE);
+        }
+        close(sock);
+
+        orch->upgrade_pid = pid;
+        orch->upgrade_n_nodes = n_nodes;
+
+        r = sd_event_add_io(orch->manager.event, &orch->upgrade_status, status[0], EPOLLIN,
+                            orch_upgrade_status_cb, orch);
+        if (r < 0) {
+                r = -r;
+                goto fail;
+        }
+        (void) sd_event_source_set_io_fd_own(orch->upgrade_status, true);
+        status[0] = -1;
+
+        /* See orch_upgrade_step() */
+        (void) sd_event_source_set_time_relative(orch->upgrade_timer, HANDOFF_TIMEOUT);
+        (void) sd_event_source_set_enabled(orch->upgrade_timer, SD_EVENT_ONESHOT);
+        return;
+
+fail:
+        if (status[0] >= 0)
+                close(status[0]);
+        orch_upgrade_abort(orch, r);
+}
+
+static int orch_upgrade_step(sd_event_source *s, uint64_t usec, void *userdata) {
+        Orchestrator *orch = userdata;
+        bool ready = true;
+        Node *node;
+        int r;
+
+        /* The new instance didn't confirm in time */
+        if (orch->upgrade_pid > 0) {
+                orch_upgrade_abort(orch, ETIMEDOUT);
+                return 0;
+        }
+
+        if (orch->handoff_deadline == 0) {
+                if (!orch_is_quiet(orch))
+                        goto wait;
+
+                printf("Orchestrator idle, handing off node connections\n");
+                orch->handoff_deadline = usec + HANDOFF_TIMEOUT;
+        }
+
+        /* Also covers nodes that registered while we waited */
+        LIST_FOREACH(nodes, node, orch->nodes) {
+                if (!node_can_hand_off(node) || node->handoff_ready != NULL)
+                        continue;
+
+                ready = false;
+                if (node->handoff_requested)
+                        continue;
+
+                r = sd_bus_emit_signal(node->peer, ORCHESTRATOR_OBJECT_PATH, ORCHESTRATOR_PEER_IFACE, "Handoff", "");
+                if (r < 0)
+                        fprintf(stderr, "Failed to send Handoff to node '%s': %s\n", node->name, strerror(-r));
+                node->handoff_requested = true;
+        }
+
+        /* Nodes that don't answer in time reconnect on their own */
+        if (ready || usec >= orch->handoff_deadline) {
+                orch_upgrade_spawn(orch);
+                return 0;
+        }
+
+wait:
+        (void) sd_event_source_set_time_relative(s, UPGRADE_POLL_INTERVAL);
+        (void) sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+        return 0;
+}
+
+/* Replaces the running orchestrator with a new instance of its binary,
+ * passing on nodes, waiting jobs and job history */
+static int method_orchestrator_upgrade(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Orchestrator *orch = userdata;
+        int r;
+
+        if (orch->upgrade_message != NULL)
+                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED, "Upgrade already in progress");
+
+        if (strchr(orch->argv[0], '/') != NULL && access(orch->argv[0], X_OK) < 0)
+                return sd_bus_reply_method_errnof(m, errno, "Can't execute %s: %m", orch->argv[0]);
+
+        r = sd_event_add_time_relative(orch->manager.event, &orch->upgrade_timer, CLOCK_MONOTONIC,
+                                       0, 0, orch_upgrade_step, orch);
+        if (r < 0)
+                return sd_bus_reply_method_errnof(m, -r, "Failed to start upgrade: %m");
+
+        /* New nodes wait in the listen backlog for the new instance */
+        acceptor_stop(&orch->acceptor);
 
-        return sd_bus_reply_method_return(m, "o", job->object_path);
+        orch->upgrade_message = sd_bus_message_ref(m);
+        printf("Upgrade requested, waiting for the running job to finish\n");
+        return 1;
 }
 
 static const sd_bus_vtable orchestrator_vtable[] = {
         SD_BUS_VTABLE_START(0),
+        SD_BUS_PROPERTY("AcceptWakeups", "t", NULL, offsetof(Orchestrator, acceptor.n_wakeups), 0),
+        SD_BUS_PROPERTY("AcceptSyscalls", "t", NULL, offsetof(Orchestrator, acceptor.n_syscalls), 0),
+        SD_BUS_PROPERTY("AcceptedConnections", "t", NULL, offsetof(Orchestrator, acceptor.n_accepted), 0),
         SD_BUS_METHOD("IsolateAll", "s", "o", method_orchestrator_isolate_all, 0),
+        SD_BUS_METHOD("IsolateAllWithKey", "ss", "o", method_orchestrator_isolate_all_with_key, 0),
+        SD_BUS_METHOD("PrepareAll", "s", "o", method_orchestrator_prepare_all, 0),
+        SD_BUS_METHOD("PrepareAllWithKey", "ss", "o", method_orchestrator_prepare_all_with_key, 0),
+        SD_BUS_METHOD("GetJobResult", "u", "sst", method_orchestrator_get_job_result, 0),
+        SD_BUS_METHOD("GetJobNodeResults", "u", "a(sssuuu)", method_orchestrator_get_job_node_results, 0),
+        SD_BUS_METHOD("Upgrade", "", "u", method_orchestrator_upgrade, 0),
         SD_BUS_SIGNAL_WITH_NAMES("JobNew",
                                  "uo",
                                  SD_BUS_PARAM(id)
                                  SD_BUS_PARAM(job),
                                  0),
+        SD_BUS_SIGNAL_WITH_NAMES("NodeStraggling",
+                                 "uosuu",
+                                 SD_BUS_PARAM(id)
+                                 SD_BUS_PARAM(job)
+                                 SD_BUS_PARAM(node)
+                                 SD_BUS_PARAM(elapsed_msec)
+                                 SD_BUS_PARAM(median_msec),
+                                 0),
         SD_BUS_SIGNAL_WITH_NAMES("JobRemoved",
                                  "uos",
                                  SD_BUS_PARAM(id)
@@ -342,54 +2026,235 @@ int create_master_socket(int port)
         return fd;
 }
 
+static int node_session_expired(sd_event_source *s, uint64_t usec, void *userdata) {
+        Node *node = userdata;
+
+        printf("Session of node '%s' expired\n", node->name);
+
+        node->session_timer = sd_event_source_disable_unref(node->session_timer);
+        node->session = SD_ID128_NULL;
+
+        /* What waited for the node fails now */
+        if (node->queued_ops)
+                (void) node_schedule_flush(node);
+        orch_remove_node(node->orch, node);
+        return 0;
+}
+
+/* Until it expires, the node can take the session over on a new connection */
+static int node_keep_session(Node *node) {
+        int r;
+
+        r = sd_event_add_time_relative(node->orch->manager.event, &node->session_timer, CLOCK_MONOTONIC,
+                                       NODE_SESSION_TIMEOUT, 0, node_session_expired, node);
+        if (r < 0)
+                return r;
+
+        printf("Keeping session of node '%s' for %d s\n", node->name,
+               (int)(NODE_SESSION_TIMEOUT / USEC_PER_SEC));
+        return 0;
+}
+
 static int node_disconnected(sd_bus_message *message, void *userdata, sd_bus_error *error) {
         Node *node = userdata;
+        int r;
 
         if (node->name)
                 printf("Node '%s' disconnected\n", node->name);
         else
                 printf("Unregistered node disconnected\n");
 
+        node_detach_peer(node);
         if (node->peer) {
                 sd_bus_close_unref(node->peer);
                 node->peer = NULL;
         }
 
+        /* Jobs on the node go on, it may be back with their results */
+        if (!sd_id128_is_null(node->session)) {
+                r = node_keep_session(node);
+                if (r >= 0)
+                        return 0;
+                fprintf(stderr, "Failed to add session timer: %s\n", strerror(-r));
+                node->session = SD_ID128_NULL;
+        }
+
         orch_remove_node(node->orch, node);
 
         return 0;
 }
 
-static int method_peer_orchestrator_register(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-        Node *node = userdata;
-        Orchestrator *orch = node->orch;
-        Manager *manager = (Manager *)orch;
-        Node *existing;
+/* Reads the labels, "a{ss}", as KEY=VALUE strings */
+static int read_labels(sd_bus_message *m, char ***labels_out) {
+        char **labels = NULL;
+        size_t n = 0;
+        const char *key, *value;
         int r;
-        char *name;
-        char description[100];
 
-        /* Read the parameters */
-        r = sd_bus_message_read(m, "s", &name);
+        r = sd_bus_message_enter_container(m, 'a', "{ss}");
+        if (r < 0)
+                return r;
+
+        while ((r = sd_bus_message_read(m, "{ss}", &key, &value)) > 0) {
+                char **l;
+
+                if (*key == '\0' || strchr(key, '=') != NULL) {
+                        r = -EINVAL;
+                        break;
+                }
+
+                l = realloc(labels, sizeof(char *) * (n + 2));
+                if (l == NULL) {
+                        r = -ENOMEM;
+                        break;
+                }
+                labels = l;
+
+                if (asprintf(&labels[n], "%s=%s", key, value) < 0) {
+                        labels[n] = NULL;
+                        r = -ENOMEM;
+                        break;
+                }
+                labels[++n] = NULL;
+        }
         if (r < 0) {
-                fprintf(stderr, "Failed to parse parameters: %s\n", strerror(-r));
+                strv_free(labels);
                 return r;
         }
 
-        if (node->name != NULL)
-                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_ADDRESS_IN_USE, "Can't register twice");
+        r = sd_bus_message_exit_container(m);
+        if (r < 0) {
+                strv_free(labels);
+                return r;
+        }
 
-        existing = orch_find_node(node->orch, name);
-        if (existing != NULL)
-                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_ADDRESS_IN_USE, "Node name already registered");
+        *labels_out = labels;
+        return 0;
+}
+
+/* Reads the "ua{sv}" inventory of RegisterWithInventory into the node */
+static int node_read_inventory(Node *node, sd_bus_message *m) {
+        uint32_t version;
+        const char *key;
+        int r;
+
+        r = sd_bus_message_read(m, "u", &version);
+        if (r < 0)
+                return r;
+        if (version == 0)
+                return -EINVAL;
+
+        r = sd_bus_message_enter_container(m, 'a', "{sv}");
+        if (r < 0)
+                return r;
+
+        while ((r = sd_bus_message_enter_container(m, 'e', "sv")) > 0) {
+                r = sd_bus_message_read(m, "s", &key);
+                if (r < 0)
+                        return r;
+
+                if (strcmp(key, "AgentVersion") == 0) {
+                        const char *agent_version;
+
+                        r = sd_bus_message_read(m, "v", "s", &agent_version);
+                        if (r < 0)
+                                return r;
+
+                        free(node->agent_version);
+                        node->agent_version = strdup(agent_version);
+                        if (node->agent_version == NULL)
+                                return -ENOMEM;
+                } else if (strcmp(key, "ProtocolVersion") == 0) {
+                        r = sd_bus_message_read(m, "v", "u", &node->protocol_version);
+                        if (r < 0)
+                                return r;
+                } else if (strcmp(key, "Features") == 0) {
+                        uint64_t features;
+
+                        r = sd_bus_message_read(m, "v", "t", &features);
+                        if (r < 0)
+                                return r;
+                        node->features = features & NODE_FEATURES_SUPPORTED;
+                } else if (strcmp(key, "SessionToken") == 0) {
+                        const char *token;
+
+                        r = sd_bus_message_read(m, "v", "s", &token);
+                        if (r < 0)
+                                return r;
+                        r = sd_id128_from_string(token, &node->resume_session);
+                        if (r < 0)
+                                return r;
+                } else if (strcmp(key, "OperationCredits") == 0) {
+                        r = sd_bus_message_read(m, "v", "u", &node->op_credits);
+                        if (r < 0)
+                                return r;
+                } else if (strcmp(key, "Capabilities") == 0) {
+                        char **capabilities = NULL;
+
+                        r = sd_bus_message_enter_container(m, 'v', "as");
+                        if (r < 0)
+                                return r;
+                        r = sd_bus_message_read_strv(m, &capabilities);
+                        if (r < 0)
+                                return r;
+                        strv_free(node->capabilities);
+                        node->capabilities = capabilities;
+                        r = sd_bus_message_exit_container(m);
+                        if (r < 0)
+                                return r;
+                } else if (strcmp(key, "Labels") == 0) {
+                        char **labels = NULL;
+
+                        r = sd_bus_message_enter_container(m, 'v', "a{ss}");
+                        if (r < 0)
+                                return r;
+                        r = read_labels(m, &labels);
+                        if (r < 0)
+                                return r;
+                        strv_free(node->labels);
+                        node->labels = labels;
+                        r = sd_bus_message_exit_container(m);
+                        if (r < 0)
+                                return r;
+                } else {
+                        /* From a newer node */
+                        r = sd_bus_message_skip(m, "v");
+                        if (r < 0)
+                                return r;
+                }
+
+                r = sd_bus_message_exit_container(m);
+                if (r < 0)
+                        return r;
+        }
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_exit_container(m);
+        if (r < 0)
+                return r;
 
-        node->name = strdup(name);
+        /* Nodes without flow control take whatever we send */
+        if (!(node->features & NODE_FEATURE_CREDITS))
+                node->op_credits = 0;
+
+        node->inventory_version = version;
+        return 0;
+}
+
+/* Names the node and puts it on the bus */
+static int node_export(Node *node, const char *name) {
+        Manager *manager = (Manager *)node->orch;
+        char description[100];
+        int r;
+
+        node->name = node_name_new(name);
         if (node->name == NULL)
-                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_NO_MEMORY, "No memory");
+                return -ENOMEM;
 
         r = asprintf(&node->object_path, "%s/%s", ORCHESTRATOR_NODES_OBJECT_PATH_PREFIX, name);
         if (r < 0)
-                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_NO_MEMORY, "No memory");
+                return -ENOMEM;
 
         strcpy(description, "node-");
         strncat(description, name, sizeof(description) - strlen(description) - 1);
@@ -403,17 +2268,220 @@ static int method_peer_orchestrator_register(sd_bus_message *m, void *userdata,
                                      node);
         if (r < 0) {
                 fprintf(stderr, "Failed to add peer bus vtable: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+                return r;
+        }
+
+        return 0;
+}
+
+/* Tells the node how many of its job results we have, so it can forget
+ * them, see EVENT_ACK_INTERVAL */
+static void node_ack_events(Node *node, bool force) {
+        int r;
+
+        if (!(node->features & NODE_FEATURE_REPLAY) || node->peer == NULL)
+                return;
+
+        if (!force && node->n_events_received - node->n_events_acked < EVENT_ACK_INTERVAL)
+                return;
+
+        r = sd_bus_emit_signal(node->peer, ORCHESTRATOR_OBJECT_PATH, ORCHESTRATOR_PEER_IFACE,
+                               "EventsAcked", "t", node->n_events_received);
+        if (r < 0)
+                fprintf(stderr, "Failed to acknowledge events of node '%s': %s\n", node->name, strerror(-r));
+        else
+                node->n_events_acked = node->n_events_received;
+}
+
+/* The node reconnected with the token of its session, existing takes
+ * over the connection of node. Its old one is dead or soon will be. */
+static void node_resume_session(Node *existing, Node *node) {
+        _cleanup_(sd_bus_close_unrefp) sd_bus *old = NULL;
+        char description[100];
+        size_t i;
+
+        /* Our callbacks on the new connection are handed over rather than
+         * added again. The one running Register stays until it returns,
+         * adding its vtable again would fail with EEXIST. */
+        node_detach_peer(existing);
+        for (i = 0; i < ELEMENTSOF(node->peer_slots); i++) {
+                if (node->peer_slots[i])
+                        (void) sd_bus_slot_set_userdata(node->peer_slots[i], existing);
+                existing->peer_slots[i] = steal_pointer(&node->peer_slots[i]);
+        }
+
+        existing->session_timer = sd_event_source_disable_unref(existing->session_timer);
+        node_requeue_operations(existing);
+        old = existing->peer;
+        existing->peer = steal_pointer(&node->peer);
+
+        /* Credits and handoffs start over on the new connection */
+        existing->n_events_ungranted = 0;
+        existing->handoff_requested = false;
+        existing->handoff_ready = sd_bus_message_unref(existing->handoff_ready);
+
+        strcpy(description, "node-");
+        strncat(description, existing->name, sizeof(description) - strlen(description) - 1);
+        (void) sd_bus_set_description(existing->peer, description);
+
+        orch_remove_node(node->orch, node);
+}
+
+/* The active orchestrator still holds the lock, so it is up and the
+ * node only lost its connection to it */
+static int node_refuse_held_register(sd_event_source *s, uint64_t usec, void *userdata) {
+        Node *node = userdata;
+        _cleanup_sd_bus_message_ sd_bus_message *m = steal_pointer(&node->held_register);
+
+        node->held_register_timer = sd_event_source_disable_unref(node->held_register_timer);
+
+        printf("Refusing held registration, the active orchestrator is still up\n");
+        (void) sd_bus_reply_method_errorf(m, ORCHESTRATOR_ERROR_STANDBY, "Standby orchestrator, the active one is up");
+        return 0;
+}
+
+static int node_register(Node *node, sd_bus_message *m, const char *name, bool with_inventory) {
+        Node *existing;
+        bool resumed = false;
+        char token[SD_ID128_STRING_MAX];
+        int r;
+
+        if (node->name != NULL || node->held_register != NULL)
+                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_ADDRESS_IN_USE, "Can't register twice");
+
+        /* The node lost the active orchestrator, or will soon */
+        if (node->orch->standby) {
+                r = sd_event_add_time_relative(node->orch->manager.event, &node->held_register_timer,
+                                               CLOCK_MONOTONIC, HA_REGISTER_HOLD_TIMEOUT, 0,
+                                               node_refuse_held_register, node);
+                if (r < 0)
+                        return sd_bus_reply_method_errnof(m, -r, "Failed to hold registration: %m");
+
+                printf("Holding registration of '%s' until we take over\n", name);
+                node->held_register = sd_bus_message_ref(m);
+                return 1;
+        }
+
+        if (with_inventory) {
+                r = node_read_inventory(node, m);
+                if (r == -ENOMEM)
+                        return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_NO_MEMORY, "No memory");
+                if (r < 0)
+                        return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS, "Invalid inventory: %s", strerror(-r));
+        }
+
+        existing = orch_find_node(node->orch, name);
+        if (existing != NULL) {
+                if (sd_id128_is_null(existing->session) || !sd_id128_equal(existing->session, node->resume_session))
+                        return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_ADDRESS_IN_USE, "Node name already registered");
+
+                if (existing->peer)
+                        printf("Node '%s' resumed its session on fd %d, dropping fd %d\n",
+                               name, sd_bus_get_fd(node->peer), sd_bus_get_fd(existing->peer));
+                else
+                        printf("Node '%s' resumed its session on fd %d\n", name, sd_bus_get_fd(node->peer));
+
+                node_resume_session(existing, node);
+                node = existing;
+                resumed = true;
+        } else {
+                r = node_export(node, name);
+                if (r == -ENOMEM)
+                        return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_NO_MEMORY, "No memory");
+                if (r < 0)
+                        return EXIT_FAILURE;
+
+                if (node->inventory_version > 0)
+                        printf("Registered node on fd %d as '%s' (agent %s, protocol %u, features 0x%" PRIx64 ", %zu labels)\n",
+                               sd_bus_get_fd (node->peer), name,
+                               node->agent_version ? node->agent_version : "unknown",
+                               node->protocol_version, node->features, strv_length(node->labels));
+                else
+                        printf("Registered node on fd %d as '%s'\n", sd_bus_get_fd (node->peer), name);
+
+                if (node->features & NODE_FEATURE_SESSION) {
+                        r = sd_id128_randomize(&node->session);
+                        if (r < 0)
+                                return sd_bus_reply_method_errnof(m, -r, "Failed to start session: %m");
+                }
+        }
+
+        orch_state_changed(node->orch);
+
+        if (!with_inventory)
+                return sd_bus_reply_method_return(m, "");
+
+        /* Nodes that sent an inventory learn what they may use */
+        r = sd_bus_reply_method_return(m, "ut", NODE_PROTOCOL_VERSION, node->features);
+        if (r < 0)
+                return r;
+
+        /* Sent after the reply, so the node knows it is to count them */
+        if (node->features & NODE_FEATURE_CREDITS) {
+                r = sd_bus_emit_signal(node->peer, ORCHESTRATOR_OBJECT_PATH, ORCHESTRATOR_PEER_IFACE,
+                                       "EventCredits", "u", (uint32_t) DEFAULT_EVENT_CREDITS);
+                if (r < 0)
+                        return r;
+        }
+
+        if ((node->features & NODE_FEATURE_SESSION) && !resumed)
+                r = sd_bus_emit_signal(node->peer, ORCHESTRATOR_OBJECT_PATH, ORCHESTRATOR_PEER_IFACE,
+                                       "Session", "s", sd_id128_to_string(node->session, token));
+
+        /* The node waits for this to send what we missed */
+        if (resumed)
+                node_ack_events(node, true);
+        return r;
+}
+
+static int method_peer_orchestrator_register(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+        const char *name;
+        int r;
+
+        r = sd_bus_message_read(m, "s", &name);
+        if (r < 0) {
+                fprintf(stderr, "Failed to parse parameters: %s\n", strerror(-r));
+                return r;
         }
 
-        printf("Registered node on fd %d as '%s'\n", sd_bus_get_fd (node->peer), name);
+        return node_register(node, m, name, false);
+}
+
+static int method_peer_orchestrator_register_with_inventory(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+        const char *name;
+        int r;
+
+        r = sd_bus_message_read(m, "s", &name);
+        if (r < 0) {
+                fprintf(stderr, "Failed to parse parameters: %s\n", strerror(-r));
+                return r;
+        }
+
+        return node_register(node, m, name, true);
+}
 
-        return sd_bus_reply_method_return(m, "");
+/* The node has stopped sending, answered once the new instance has
+ * its connection */
+static int method_peer_orchestrator_handoff_ready(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Node *node = userdata;
+
+        if (!node->handoff_requested || node->handoff_ready != NULL)
+                return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED, "No handoff in progress");
+
+        node->handoff_ready = sd_bus_message_ref(m);
+        return 1;
 }
 
 static const sd_bus_vtable peer_orchestrator_vtable[] = {
         SD_BUS_VTABLE_START(0),
         SD_BUS_METHOD("Register", "s", "", method_peer_orchestrator_register, 0),
+        SD_BUS_METHOD("RegisterWithInventory", "sua{sv}", "ut", method_peer_orchestrator_register_with_inventory, 0),
+        SD_BUS_METHOD("HandoffReady", "", "", method_peer_orchestrator_handoff_ready, 0),
+        SD_BUS_SIGNAL("Handoff", "", 0),
+        SD_BUS_SIGNAL("Session", "s", 0),
+        SD_BUS_SIGNAL("EventsAcked", "t", 0),
         SD_BUS_VTABLE_END
 };
 
@@ -452,9 +2520,25 @@ all_node_messages_handler (sd_bus_message *m, void *userdata, sd_bus_error *ret_
         return 0;
 }
 
+static void node_dispatch_job_removed(Node *node, sd_bus_message *m, const char *job_path, const char *result) {
+        JobTracker *tracker, *next_tracker;
+
+        /* Also for ops whose request gave up on the job, the node ran it anyway */
+        if (strv_remove(node->op_jobs, job_path))
+                node_return_op_credits(node, 1);
+        node->n_events_received++;
+
+        LIST_FOREACH_SAFE(trackers, tracker, next_tracker, node->trackers) {
+                if (strcmp(tracker->object_path, job_path) == 0) {
+                        /* Unlink first, the callback may free the tracker */
+                        LIST_REMOVE(trackers, node->trackers, tracker);
+                        tracker->callback(m, result, tracker->userdata);
+                }
+        }
+}
+
 static int node_match_job_removed(sd_bus_message *m, void *userdata, sd_bus_error *error) {
         Node *node = userdata;
-        JobTracker *tracker, *next_tracker;
         const char *job_path;
         const char *result;
         uint32_t id;
@@ -467,53 +2551,184 @@ static int node_match_job_removed(sd_bus_message *m, void *userdata, sd_bus_erro
         }
         (void)sd_bus_message_rewind(m, true);
 
+        node_dispatch_job_removed(node, m, job_path, result);
+        node_ack_events(node, false);
+
+        return 0;
+}
+
+/* A JobsRemoved signal was handled, so the node may send more.
+ * Granted in bulk to keep the grants themselves from becoming chatty. */
+static void node_events_handled(Node *node) {
+        int r;
+
+        node_ack_events(node, false);
+
+        if (!(node->features & NODE_FEATURE_CREDITS) || node->peer == NULL)
+                return;
+
+        if (++node->n_events_ungranted < DEFAULT_EVENT_CREDITS / 2)
+                return;
+
+        r = sd_bus_emit_signal(node->peer, ORCHESTRATOR_OBJECT_PATH, ORCHESTRATOR_PEER_IFACE,
+                               "EventCredits", "u", node->n_events_ungranted);
+        if (r < 0)
+                fprintf(stderr, "Failed to grant event credits to node '%s': %s\n", node->name, strerror(-r));
+        else
+                node->n_events_ungranted = 0;
+}
+
+/* Batched JobRemoved signals, from nodes with NODE_FEATURE_JOBS_REMOVED */
+static int node_match_jobs_removed(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        _cleanup_(node_unrefp) Node *node = node_ref(userdata);
+        const char *job_path;
+        const char *result;
+        uint32_t id;
+        int r;
+
+        r = sd_bus_message_enter_container(m, 'a', "(uos)");
+        while (r >= 0 && (r = sd_bus_message_read(m, "(uos)", &id, &job_path, &result)) > 0)
+                node_dispatch_job_removed(node, m, job_path, result);
+        if (r < 0)
+                fprintf(stderr, "Can't parse job results\n");
+
+        node_events_handled(node);
+        return 0;
+}
+
+static int node_match_job_held(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        Node *node = userdata;
+        JobTracker *tracker, *next_tracker;
+        const char *member = sd_bus_message_get_member(m);
+        bool held = strcmp(member, "JobHeld") == 0;
+        _cleanup_free_ char *reason = NULL;
+        const char *job_path;
+        const char *resource = NULL;
+        double pressure = 0;
+        uint32_t id;
+        int r;
+
+        if (held)
+                r = sd_bus_message_read(m, "uosd", &id, &job_path, &resource, &pressure);
+        else
+                r = sd_bus_message_read(m, "uo", &id, &job_path);
+        if (r < 0) {
+                fprintf(stderr, "Can't parse %s\n", member);
+                return 0;
+        }
+
+        if (held && asprintf(&reason, "%s pressure %.1f%%", resource, pressure) < 0)
+                reason = NULL;
+
         LIST_FOREACH_SAFE(trackers, tracker, next_tracker, node->trackers) {
-                if (strcmp(tracker->object_path, job_path) == 0) {
-                        tracker->callback(m, result, tracker->userdata);
-                        LIST_REMOVE(trackers, node->trackers, tracker);
-                }
+                if (strcmp(tracker->object_path, job_path) == 0 && tracker->hold_callback)
+                        tracker->hold_callback(held, reason ?: resource, tracker->userdata);
+        }
+
+        return 0;
+}
+
+/* Points the callbacks of the peer connection at node. They are
+ * moved to another node when a session is resumed. */
+static int node_attach_peer(Node *node, sd_bus *bus) {
+        sd_bus_slot **slot = node->peer_slots;
+        int r;
+
+        r = sd_bus_add_object_vtable(bus,
+                                     slot++,
+                                     "/org/freedesktop/DBus",
+                                     "org.freedesktop.DBus",
+                                     peer_bus_vtable,
+                                     node);
+        if (r < 0) {
+                fprintf(stderr, "Failed to add peer bus vtable: %s\n", strerror(-r));
+                return r;
+        }
+
+        r = sd_bus_match_signal(
+                        bus,
+                        slot++,
+                        NULL,
+                        NODE_PEER_OBJECT_PATH,
+                        NODE_IFACE,
+                        "JobRemoved",
+                        node_match_job_removed, node);
+        if (r >= 0)
+                r = sd_bus_match_signal(bus, slot++, NULL, NODE_PEER_OBJECT_PATH, NODE_IFACE,
+                                        "JobsRemoved", node_match_jobs_removed, node);
+        if (r < 0) {
+                fprintf(stderr, "Failed to job-removed peer bus match: %s\n", strerror(-r));
+                return r;
+        }
+
+        r = sd_bus_match_signal(bus, slot++, NULL, NODE_PEER_OBJECT_PATH, NODE_IFACE,
+                                "JobHeld", node_match_job_held, node);
+        if (r >= 0)
+                r = sd_bus_match_signal(bus, slot++, NULL, NODE_PEER_OBJECT_PATH, NODE_IFACE,
+                                        "JobAdmitted", node_match_job_held, node);
+        if (r < 0) {
+                fprintf(stderr, "Failed to add job admission peer bus match: %s\n", strerror(-r));
+                return r;
+        }
+
+        r = sd_bus_add_object_vtable(bus,
+                                     slot++,
+                                     ORCHESTRATOR_OBJECT_PATH,
+                                     ORCHESTRATOR_PEER_IFACE,
+                                     peer_orchestrator_vtable,
+                                     node);
+        if (r < 0) {
+                fprintf(stderr, "Failed to add peer bus vtable: %s\n", strerror(-r));
+                return r;
+        }
+
+        r = sd_bus_match_signal_async(
+                        bus,
+                        slot++,
+                        "org.freedesktop.DBus.Local",
+                        "/org/freedesktop/DBus/Local",
+                        "org.freedesktop.DBus.Local",
+                        "Disconnected",
+                        node_disconnected, NULL, node);
+        if (r < 0) {
+                fprintf(stderr, "Failed to request match for Disconnected message: %s\n", strerror(-r));
+                return r;
         }
 
+        if (DEBUG_DBUS_MESSAGES)
+                sd_bus_add_filter(bus, slot++, all_node_messages_handler, node);
+
+        assert(slot <= node->peer_slots + ELEMENTSOF(node->peer_slots));
         return 0;
 }
 
-static int accept_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
-        Orchestrator *orch = userdata;
+/* Sets up the peer bus for a node connection, takes fd. The node is
+ * owned by the node list. */
+static Node *orch_add_peer(Orchestrator *orch, int fd) {
         Manager *manager = (Manager *)orch;
-        _cleanup_fd_ int nfd = -1;
+        _cleanup_fd_ int nfd = fd;
         _cleanup_(sd_bus_close_unrefp) sd_bus *bus = NULL;
         _cleanup_(node_unrefp) Node *node = NULL;
         sd_id128_t id;
         int r;
 
-        nfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
-        if (nfd < 0) {
-                if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK)
-                        return 0;
-                else {
-                        int errsv = errno;
-                        fprintf(stderr, "Failed to accept: %m\n");
-                        return -errsv;
-                }
-        }
-
         r = sd_bus_new(&bus);
         if (r < 0) {
                 fprintf(stderr, "Failed to allocate new private connection bus: %m\n");
-                return 0;
+                return NULL;
         }
 
         (void) sd_bus_set_description(bus, "node");
         r = sd_bus_set_trusted (bus, true); /* we trust everything from the node, there is only one peer anyway */
         if (r < 0) {
                 fprintf(stderr, "Failed to trust node: %s\n", strerror(-r));
-                return 0;
+                return NULL;
         }
 
         r = sd_bus_set_fd(bus, nfd, nfd);
         if (r < 0) {
                 fprintf(stderr, "Failed to set fd on new connection bus: %s\n", strerror(-r));
-                return 0;
+                return NULL;
         }
 
         nfd = -1;
@@ -524,7 +2739,7 @@ static int accept_handler(sd_event_source *s, int fd, uint32_t revents, void *us
         r = sd_bus_set_server(bus, 1, id);
         if (r < 0) {
                 fprintf(stderr, "Failed to enable server support for new connection bus: %s\n", strerror(-r));
-                return 0;
+                return NULL;
         }
 
         r = sd_bus_negotiate_creds(bus, 1,
@@ -533,99 +2748,551 @@ static int accept_handler(sd_event_source *s, int fd, uint32_t revents, void *us
                                    SD_BUS_CREDS_SELINUX_CONTEXT);
         if (r < 0) {
                 fprintf(stderr, "Failed to enable credentials for new connection: %s\n", strerror(-r));
-                return 0;
+                return NULL;
         }
 
         /* TODO: We don't want anonymous here really, but do it for now */
         r = sd_bus_set_anonymous(bus, true);
         if (r < 0) {
                 fprintf(stderr, "Failed to set bus to anonymous: %s\n", strerror(-r));
-                return 0;
+                return NULL;
         }
 
         r = sd_bus_set_sender(bus, ORCHESTRATOR_BUS_NAME);
         if (r < 0) {
                 fprintf(stderr, "Failed to set direct connection sender: %s\n", strerror(-r));
-                return 0;
+                return NULL;
         }
 
         r = sd_bus_start(bus);
         if (r < 0) {
                 fprintf(stderr, "Failed to start new connection bus: %s", strerror(-r));
-                return 0;
+                return NULL;
         }
 
         r = sd_bus_attach_event(bus, manager->event, SD_EVENT_PRIORITY_NORMAL);
         if (r < 0) {
                 fprintf(stderr, "Failed to attach new connection bus to event loop: %s\n", strerror(-r));
-                return 0;
+                return NULL;
         }
 
         node = node_new(orch);
         if (node == NULL) {
                 fprintf(stderr, "Out of memory");
-                return 0;
+                return NULL;
         }
 
         node->peer = steal_pointer(&bus);
 
-        r = sd_bus_add_object_vtable(node->peer,
-                                     NULL,
-                                     "/org/freedesktop/DBus",
-                                     "org.freedesktop.DBus",
-                                     peer_bus_vtable,
-                                     node);
-        if (r < 0) {
-                fprintf(stderr, "Failed to add peer bus vtable: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+        r = node_attach_peer(node, node->peer);
+        if (r < 0)
+                return NULL;
+
+        orch_add_node(node->orch, node);
+        return node;
+}
+
+static void orch_accept_connection(int fd, void *userdata) {
+        Orchestrator *orch = userdata;
+        Node *node;
+
+        node = orch_add_peer(orch, fd);
+        if (node != NULL)
+                printf("Accepted new private connection on fd %d.\n", sd_bus_get_fd(node->peer));
+}
+
+static int node_deserialize(Node *node, char *buf, size_t size, size_t offset, char **name_out) {
+        char *key, *value;
+        int r;
+
+        while ((r = handoff_next(buf, size, &offset, &key, &value)) > 0) {
+                if (strcmp(key, "name") == 0)
+                        *name_out = value;
+                else if (strcmp(key, "inventory-version") == 0)
+                        node->inventory_version = strtoul(value, NULL, 10);
+                else if (strcmp(key, "protocol-version") == 0)
+                        node->protocol_version = strtoul(value, NULL, 10);
+                else if (strcmp(key, "features") == 0)
+                        node->features = strtoull(value, NULL, 10) & NODE_FEATURES_SUPPORTED;
+                else if (strcmp(key, "agent-version") == 0) {
+                        free(node->agent_version);
+                        node->agent_version = strdup(value);
+                        if (node->agent_version == NULL)
+                                return -ENOMEM;
+                } else if (strcmp(key, "capability") == 0) {
+                        r = strv_append(&node->capabilities, value);
+                        if (r < 0)
+                                return r;
+                } else if (strcmp(key, "label") == 0) {
+                        r = strv_append(&node->labels, value);
+                        if (r < 0)
+                                return r;
+                } else if (strcmp(key, "operation-credits") == 0)
+                        node->op_credits = strtoul(value, NULL, 10);
+                else if (strcmp(key, "operation-job") == 0) {
+                        r = strv_append(&node->op_jobs, value);
+                        if (r < 0)
+                                return r;
+                        node->n_ops_outstanding++;
+                } else if (strcmp(key, "events-ungranted") == 0)
+                        node->n_events_ungranted = strtoul(value, NULL, 10);
+                else if (strcmp(key, "session") == 0)
+                        (void) sd_id128_from_string(value, &node->session);
+                else if (strcmp(key, "events-received") == 0)
+                        node->n_events_received = node->n_events_acked = strtoull(value, NULL, 10);
+                else if (strcmp(key, "latency") == 0) {
+                        LatencyEstimate e;
+                        int op;
+
+                        if (sscanf(value, "%d %" SCNu64 " %" SCNu64 " %" SCNu32,
+                                   &op, &e.srtt_usec, &e.rttvar_usec, &e.n_samples) == 4 &&
+                            op >= 0 && op < _NODE_OP_MAX)
+                                node->latency[op] = e;
+                } else if (strcmp(key, "isolated-to") == 0) {
+                        node_set_target(node, value);
+                } else if (strcmp(key, "target") == 0) {
+                        TargetHistory *h;
+                        int n = 0;
+
+                        h = malloc0(sizeof(TargetHistory));
+                        if (h == NULL)
+                                return -ENOMEM;
+                        if (sscanf(value, "%" SCNu64 " %" SCNu64 " %" SCNu32 " %n",
+                                   &h->duration.srtt_usec, &h->duration.rttvar_usec,
+                                   &h->duration.n_samples, &n) < 3 || n == 0 ||
+                            node->n_target_history >= MAX_TARGET_HISTORY ||
+                            (h->target = strdup(value + n)) == NULL) {
+                                free(h);
+                                continue;
+                        }
+                        LIST_APPEND(target_history, node->target_history, h);
+                        node->n_target_history++;
+                }
+                /* Anything else is from a newer instance */
         }
 
-        r = sd_bus_match_signal(
-                        node->peer,
-                        NULL,
-                        NULL,
-                        NODE_PEER_OBJECT_PATH,
-                        NODE_IFACE,
-                        "JobRemoved",
-                        node_match_job_removed, node);
+        return r;
+}
+
+/* Without fd, from a replica, the node is to take over its session */
+static int orch_restore_node(Orchestrator *orch, int fd, char *buf, size_t size, size_t offset) {
+        char *name = NULL;
+        Node *node;
+        int r;
+
+        if (fd >= 0)
+                node = orch_add_peer(orch, fd);
+        else {
+                node = node_new(orch);
+                if (node != NULL) {
+                        orch_add_node(orch, node);
+                        node_unref(node);
+                }
+        }
+        if (node == NULL)
+                return -ENOMEM;
+
+        r = node_deserialize(node, buf, size, offset, &name);
+        if (r >= 0 && (name == NULL || orch_find_node(orch, name) != NULL))
+                r = -EBADMSG;
+        if (r >= 0 && fd < 0 && sd_id128_is_null(node->session))
+                r = -EBADMSG;
+        if (r >= 0)
+                r = node_export(node, name);
+        if (r >= 0 && fd < 0) {
+                /* Those were for the jobs of the old instance */
+                node->n_ops_outstanding = 0;
+                strv_free(steal_pointer(&node->op_jobs));
+                node->n_events_ungranted = 0;
+                r = node_keep_session(node);
+        }
         if (r < 0) {
-                fprintf(stderr, "Failed to job-removed peer bus match: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+                fprintf(stderr, "Failed to restore node: %s\n", strerror(-r));
+                orch_remove_node(orch, node); /* it reconnects */
+                return 0;
         }
 
-        r = sd_bus_add_object_vtable(node->peer,
-                                     NULL,
-                                     ORCHESTRATOR_OBJECT_PATH,
-                                     ORCHESTRATOR_PEER_IFACE,
-                                     peer_orchestrator_vtable,
-                                     node);
+        if (fd >= 0)
+                printf("Resumed node '%s' on fd %d\n", node->name, sd_bus_get_fd(node->peer));
+        return 0;
+}
+
+static int orch_restore_job(Orchestrator *orch, char *buf, size_t size, size_t offset) {
+        Manager *manager = &orch->manager;
+        _cleanup_(job_unrefp) Job *job = NULL;
+        const char *target = NULL;
+        uint32_t id = 0;
+        char *key, *value;
+        int type = -1;
+        int r;
+
+        while ((r = handoff_next(buf, size, &offset, &key, &value)) > 0) {
+                if (strcmp(key, "id") == 0)
+                        id = strtoul(value, NULL, 10);
+                else if (strcmp(key, "type") == 0)
+                        type = atoi(value);
+                else if (strcmp(key, "target") == 0)
+                        target = value;
+        }
+        if (r < 0)
+                return r;
+        if (id == 0 || target == NULL || (type != JOB_ISOLATE_ALL && type != JOB_PREPARE_ALL))
+                return -EBADMSG;
+
+        /* Same id and object path as before */
+        return queue_isolate_all(manager, type, NULL, target, id, &job);
+}
+
+/* Applies one record from orch_serialize(), taking fd. Returns 1 for the
+ * end record. */
+static int orch_restore_record(Orchestrator *orch, char *buf, size_t size, int fd,
+                               int *listen_fd_out, uint32_t *next_job_id) {
+        Manager *manager = &orch->manager;
+        char *key, *value;
+        size_t offset = 0;
+        bool end = false;
+        int r;
+
+        r = handoff_next(buf, size, &offset, &key, &value);
+        if (r > 0 && strcmp(key, "record") != 0)
+                r = -EBADMSG;
+        if (r <= 0) {
+                if (fd >= 0)
+                        close(fd);
+                return r < 0 ? r : -EBADMSG;
+        }
+
+        if (strcmp(value, "end") == 0)
+                end = true;
+        else if (strcmp(value, "orchestrator") == 0) {
+                while ((r = handoff_next(buf, size, &offset, &key, &value)) > 0)
+                        if (strcmp(key, "next-job-id") == 0)
+                                *next_job_id = strtoul(value, NULL, 10);
+                if (fd >= 0) {
+                        orch->upgrade_status_fd = fd;
+                        fd = -1;
+                }
+        } else if (strcmp(value, "listen") == 0 && fd >= 0) {
+                *listen_fd_out = fd;
+                fd = -1;
+        } else if (strcmp(value, "ha-lock") == 0 && fd >= 0) {
+                orch->ha_lock_fd = fd;
+                fd = -1;
+        } else if (strcmp(value, "history") == 0) {
+                uint32_t id = 0;
+                int type = 0, result = 0;
+                uint64_t finished = 0;
+
+                while ((r = handoff_next(buf, size, &offset, &key, &value)) > 0) {
+                        if (strcmp(key, "id") == 0)
+                                id = strtoul(value, NULL, 10);
+                        else if (strcmp(key, "type") == 0)
+                                type = atoi(value);
+                        else if (strcmp(key, "result") == 0)
+                                result = atoi(value);
+                        else if (strcmp(key, "finished") == 0)
+                                finished = strtoull(value, NULL, 10);
+                }
+                if (r >= 0)
+                        manager_restore_job_history(manager, id, type, result, finished);
+        } else if (strcmp(value, "idempotency-key") == 0) {
+                const char *k = NULL, *request = NULL;
+                uint32_t job_id = 0;
+
+                while ((r = handoff_next(buf, size, &offset, &key, &value)) > 0) {
+                        if (strcmp(key, "key") == 0)
+                                k = value;
+                        else if (strcmp(key, "request") == 0)
+                                request = value;
+                        else if (strcmp(key, "job") == 0)
+                                job_id = strtoul(value, NULL, 10);
+                }
+                if (r >= 0 && k != NULL && request != NULL)
+                        r = manager_add_idempotency_key(manager, k, request, job_id);
+        } else if (strcmp(value, "job") == 0)
+                r = orch_restore_job(orch, buf, size, offset);
+        else if (strcmp(value, "node") == 0) {
+                r = orch_restore_node(orch, fd, buf, size, offset);
+                fd = -1;
+        }
+        /* Other records are from a newer instance */
+
+        if (fd >= 0)
+                close(fd);
+        return r < 0 ? r : end;
+}
+
+/* Takes over from the instance that started us, see orch_upgrade_spawn() */
+static int orch_resume(Orchestrator *orch, int sock, int *listen_fd_out) {
+        Manager *manager = &orch->manager;
+        _cleanup_free_ char *buf = malloc(HANDOFF_MAX_RECORD);
+        uint32_t next_job_id = 0;
+        ssize_t size;
+        int fd, r;
+
+        if (buf == NULL)
+                return -ENOMEM;
+
+        do {
+                size = handoff_recv(sock, buf, HANDOFF_MAX_RECORD, &fd);
+                if (size == 0)
+                        return -EPIPE; /* no end record, the old instance failed */
+                if (size < 0)
+                        return size;
+
+                r = orch_restore_record(orch, buf, size, fd, listen_fd_out, &next_job_id);
+                if (r < 0)
+                        return r;
+        } while (r == 0);
+
+        if (next_job_id > manager->next_job_id)
+                manager->next_job_id = next_job_id;
+
+        return *listen_fd_out >= 0 ? 0 : -EBADMSG;
+}
+
+/* Takes over the state the active orchestrator replicated to us */
+static int orch_load_state(Orchestrator *orch) {
+        Manager *manager = &orch->manager;
+        _cleanup_free_ char *buf = malloc(HANDOFF_MAX_RECORD);
+        uint32_t next_job_id = 0;
+        int listen_fd = -1;
+        ssize_t size;
+        FILE *f;
+        int r;
+
+        if (buf == NULL)
+                return -ENOMEM;
+
+        f = fopen(orch->ha_state_path, "re");
+        if (f == NULL)
+                return errno == ENOENT ? 0 : -errno;
+
+        do {
+                size = handoff_read(f, buf, HANDOFF_MAX_RECORD);
+                if (size <= 0) {
+                        r = size == 0 ? -EBADMSG : size; /* no end record */
+                        break;
+                }
+
+                r = orch_restore_record(orch, buf, size, -1, &listen_fd, &next_job_id);
+        } while (r == 0);
+        fclose(f);
+        if (r < 0)
+                return r;
+
+        if (next_job_id > manager->next_job_id)
+                manager->next_job_id = next_job_id;
+
+        return 0;
+}
+
+static void orch_send_held_replies(Orchestrator *orch) {
+        size_t i;
+        int r;
+
+        for (i = 0; i < orch->n_held_replies; i++) {
+                r = sd_bus_send(NULL, orch->held_replies[i], NULL);
+                if (r < 0)
+                        fprintf(stderr, "Failed to reply to submit: %s\n", strerror(-r));
+                sd_bus_message_unref(orch->held_replies[i]);
+        }
+
+        free(orch->held_replies);
+        orch->held_replies = NULL;
+        orch->n_held_replies = 0;
+}
+
+/* A standby writes nothing, the lock tells us when to take over from it */
+static int orch_replicate(sd_event_source *s, uint64_t usec, void *userdata) {
+        Orchestrator *orch = userdata;
+        HandoffRecord *records = NULL;
+        uint32_t n_nodes;
+        int r;
+
+        orch->ha_timer = sd_event_source_disable_unref(orch->ha_timer);
+
+        r = orch_serialize(orch, true, &records, &n_nodes);
+        if (r >= 0)
+                r = handoff_save(records, orch->ha_state_path);
+        handoff_record_free_all(records);
+        if (r < 0)
+                fprintf(stderr, "Failed to replicate state: %s\n", strerror(-r));
+
+        /* Sent either way, the job is ours and runs */
+        orch_send_held_replies(orch);
+        return 0;
+}
+
+/* Jobs or node sessions changed, the standby gets them shortly */
+static void orch_state_changed(Orchestrator *orch) {
+        int r;
+
+        if (orch->ha_state_path == NULL || orch->standby || orch->ha_timer != NULL)
+                return;
+
+        /* Not the default accuracy, a quarter second would dwarf the interval */
+        r = sd_event_add_time_relative(orch->manager.event, &orch->ha_timer, CLOCK_MONOTONIC,
+                                       HA_REPLICATE_INTERVAL, 1, orch_replicate, orch);
+        if (r < 0)
+                fprintf(stderr, "Failed to add replication timer: %s\n", strerror(-r));
+}
+
+/* Answers a submit once the standby can see its job, so no job we
+ * acknowledged is lost with us. Submits of one event loop iteration
+ * share the write. */
+static int orch_reply_replicated(Orchestrator *orch, sd_bus_message *m, const char *job_path) {
+        _cleanup_sd_bus_message_ sd_bus_message *reply = NULL;
+        sd_bus_message **replies;
+        int r;
+
+        orch_state_changed(orch);
+        if (orch->ha_timer == NULL || orch->standby)
+                return sd_bus_reply_method_return(m, "o", job_path);
+
+        r = sd_bus_message_new_method_return(m, &reply);
+        if (r >= 0)
+                r = sd_bus_message_append(reply, "o", job_path);
+        if (r >= 0)
+                r = sd_event_source_set_time_relative(orch->ha_timer, 0);
+        if (r < 0)
+                return r;
+
+        replies = realloc(orch->held_replies, sizeof(sd_bus_message *) * (orch->n_held_replies + 1));
+        if (replies == NULL)
+                return -ENOMEM;
+        orch->held_replies = replies;
+        orch->held_replies[orch->n_held_replies++] = steal_pointer(&reply);
+        return 1;
+}
+
+static void orch_answer_held_registers(Orchestrator *orch) {
+        Node *node, *next_node;
+        int r;
+
+        LIST_FOREACH_SAFE(nodes, node, next_node, orch->nodes) {
+                _cleanup_sd_bus_message_ sd_bus_message *m = steal_pointer(&node->held_register);
+
+                if (m == NULL)
+                        continue;
+                node->held_register_timer = sd_event_source_disable_unref(node->held_register_timer);
+
+                /* Handled as if it had just come in, which may drop node */
+                r = sd_bus_message_rewind(m, true);
+                if (r >= 0 && strcmp(sd_bus_message_get_member(m), "Register") == 0)
+                        r = method_peer_orchestrator_register(m, node, NULL);
+                else if (r >= 0)
+                        r = method_peer_orchestrator_register_with_inventory(m, node, NULL);
+                if (r < 0)
+                        (void) sd_bus_reply_method_errnof(m, -r, "Failed to register: %m");
+        }
+}
+
+static int orch_become_active(Orchestrator *orch) {
+        Manager *manager = &orch->manager;
+        uint64_t start_usec, now;
+        int r;
+
+        (void) sd_event_now(manager->event, CLOCK_MONOTONIC, &start_usec);
+        orch->standby = false;
+        orch->ha_timer = sd_event_source_disable_unref(orch->ha_timer);
+
+        /* Without it nodes start new sessions, and what they held back is lost */
+        r = orch_load_state(orch);
+        if (r < 0)
+                fprintf(stderr, "Failed to load replicated state: %s\n", strerror(-r));
+
+        /* The old owner's connection is gone or about to be */
+        r = sd_bus_request_name(manager->bus, ORCHESTRATOR_BUS_NAME, SD_BUS_NAME_QUEUE);
         if (r < 0) {
-                fprintf(stderr, "Failed to add peer bus vtable: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+                fprintf(stderr, "Failed to acquire service name: %s\n", strerror(-r));
+                return r;
         }
 
-        r = sd_bus_match_signal_async(
-                        node->peer,
-                        NULL,
-                        "org.freedesktop.DBus.Local",
-                        "/org/freedesktop/DBus/Local",
-                        "org.freedesktop.DBus.Local",
-                        "Disconnected",
-                        node_disconnected, NULL, node);
+        orch_answer_held_registers(orch);
+        orch_state_changed(orch);
+        manager_retry_admission(manager);
+
+        (void) sd_event_now(manager->event, CLOCK_MONOTONIC, &now);
+        printf("Took over as active orchestrator in %.1f ms, with %d nodes\n",
+               (now - start_usec) / 1000.0, orch_get_n_nodes(orch));
+        return 0;
+}
+
+/* Held for as long as we run, the kernel drops it when we die */
+static int orch_take_lock(Orchestrator *orch) {
+        int fd;
+
+        fd = open(orch->ha_lock_path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+        if (fd < 0)
+                return -errno;
+
+        if (flock(fd, LOCK_EX|LOCK_NB) < 0) {
+                int errsv = errno;
+                close(fd);
+                return -errsv;
+        }
+
+        orch->ha_lock_fd = fd;
+        return 0;
+}
+
+static int orch_poll_lock(sd_event_source *s, uint64_t usec, void *userdata) {
+        Orchestrator *orch = userdata;
+        int r;
+
+        r = orch_take_lock(orch);
+        if (r == -EWOULDBLOCK) {
+                (void) sd_event_source_set_time_relative(s, HA_LOCK_POLL_INTERVAL);
+                return 0;
+        }
         if (r < 0) {
-                fprintf(stderr, "Failed to request match for Disconnected message: %s\n", strerror(-r));
+                fprintf(stderr, "Failed to take lock %s: %s\n", orch->ha_lock_path, strerror(-r));
+                sd_event_exit(orch->manager.event, EXIT_FAILURE);
                 return 0;
         }
 
-        if (DEBUG_DBUS_MESSAGES)
-                sd_bus_add_filter(node->peer, NULL, all_node_messages_handler, node);
-
-        orch_add_node(node->orch, node);
-        printf("Accepted new private connection on fd %d.\n", sd_bus_get_fd(node->peer));
+        printf("Active orchestrator is gone\n");
+        r = orch_become_active(orch);
+        if (r < 0)
+                sd_event_exit(orch->manager.event, EXIT_FAILURE);
 
         return 0;
 }
 
+/* Sets us up as active if we get the lock, or if the instance we took
+ * over from passed it on, and as standby otherwise */
+static int orch_start_ha(Orchestrator *orch, const char *lock_path) {
+        int r;
+
+        orch->ha_lock_path = strdup(lock_path);
+        if (orch->ha_lock_path == NULL ||
+            asprintf(&orch->ha_state_path, "%s.state", lock_path) < 0)
+                return -ENOMEM;
+
+        if (orch->ha_lock_fd < 0) {
+                r = orch_take_lock(orch);
+                if (r < 0 && r != -EWOULDBLOCK)
+                        return r;
+        }
+
+        if (orch->ha_lock_fd >= 0) {
+                printf("Holding %s, active\n", lock_path);
+                orch_state_changed(orch);
+                return 0;
+        }
+
+        printf("%s is held by another orchestrator, standing by\n", lock_path);
+        orch->standby = true;
+
+        r = sd_event_add_time_relative(orch->manager.event, &orch->ha_timer, CLOCK_MONOTONIC,
+                                       HA_LOCK_POLL_INTERVAL, 1, orch_poll_lock, orch);
+        if (r < 0)
+                return r;
+
+        return sd_event_source_set_enabled(orch->ha_timer, SD_EVENT_ON);
+}
+
 static int
 all_bus_messages_handler (sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
@@ -637,14 +3304,195 @@ all_bus_messages_handler (sd_bus_message *m, void *userdata, sd_bus_error *ret_e
         return 0;
 }
 
+enum {
+        ARG_MIN_CALL_TIMEOUT = 0x100,
+        ARG_MAX_CALL_TIMEOUT,
+        ARG_MIN_ISOLATE_TIMEOUT,
+        ARG_MAX_ISOLATE_TIMEOUT,
+        ARG_MIN_PREPARE_TIMEOUT,
+        ARG_MAX_PREPARE_TIMEOUT,
+        ARG_HANDOFF_FD,
+        ARG_HA_LOCK,
+};
+
+static const struct option options[] = {
+        { "job-history", required_argument, NULL, 'H' },
+        { "job-details-history", required_argument, NULL, 'D' },
+        { "idempotency-ttl", required_argument, NULL, 'I' },
+        { "straggler-factor", required_argument, NULL, 'S' },
+        { "dispatch-window", required_argument, NULL, 'W' },
+        { "min-call-timeout", required_argument, NULL, ARG_MIN_CALL_TIMEOUT },
+        { "max-call-timeout", required_argument, NULL, ARG_MAX_CALL_TIMEOUT },
+        { "min-isolate-timeout", required_argument, NULL, ARG_MIN_ISOLATE_TIMEOUT },
+        { "max-isolate-timeout", required_argument, NULL, ARG_MAX_ISOLATE_TIMEOUT },
+        { "min-prepare-timeout", required_argument, NULL, ARG_MIN_PREPARE_TIMEOUT },
+        { "max-prepare-timeout", required_argument, NULL, ARG_MAX_PREPARE_TIMEOUT },
+        { "handoff-fd", required_argument, NULL, ARG_HANDOFF_FD },
+        { "port", required_argument, NULL, 'p' },
+        { "ha-lock", required_argument, NULL, ARG_HA_LOCK },
+        { "help",        no_argument,       NULL, 'h' },
+        {}
+};
+
+static void usage(const char *argv0) {
+        printf("Usage: %s [OPTIONS]\n"
+               "  -H, --job-history=N           Number of finished job results to keep (default %d)\n"
+               "  -D, --job-details-history=N   Number of finished jobs to keep per-node results for (default %d)\n"
+               "  -I, --idempotency-ttl=S       Seconds to remember idempotency keys (default %d)\n"
+               "  -S, --straggler-factor=K      Flag nodes slower than K times the median (default %.1f, 0 disables)\n"
+               "  -W, --dispatch-window=N       Nodes a fleet job works on at a time (default all)\n"
+               "      --min-call-timeout=S      Bounds in seconds for the learned timeout of calls to nodes\n"
+               "      --max-call-timeout=S\n"
+               "      --min-isolate-timeout=S   Bounds in seconds for the learned timeout of node isolate jobs\n"
+               "      --max-isolate-timeout=S\n"
+               "      --min-prepare-timeout=S   Bounds in seconds for the learned timeout of node prepare jobs\n"
+               "      --max-prepare-timeout=S\n"
+               "      --handoff-fd=FD           Take over from a running orchestrator, used by Upgrade\n"
+               "  -p, --port=PORT               Port to accept node connections on (default %d)\n"
+               "      --ha-lock=PATH            Stand by while another orchestrator holds the lock at PATH\n"
+               "  -h, --help                    Show this help\n",
+               argv0, DEFAULT_JOB_HISTORY_SIZE, DEFAULT_JOB_DETAILS_HISTORY_SIZE,
+               (int)(DEFAULT_IDEMPOTENCY_KEY_TTL / USEC_PER_SEC), DEFAULT_STRAGGLER_FACTOR,
+               DEFAULT_ORCHESTRATOR_PORT);
+}
+
 int main(int argc, char *argv[]) {
         _cleanup_sd_event_ sd_event *event = NULL;
         _cleanup_sd_bus_slot_ sd_bus_slot *slot = NULL;
         _cleanup_sd_bus_ sd_bus *bus = NULL;
         _cleanup_fd_ int accept_fd = -1;
-        _cleanup_sd_event_source_ sd_event_source *event_source = NULL;
-        int r;
-        Orchestrator orchestrator = {};
+        _cleanup_fd_ int handoff_fd = -1;
+        const char *ha_lock_path = NULL;
+        bool resumed = false;
+        int port = DEFAULT_ORCHESTRATOR_PORT;
+        int r, c, i, n = 0;
+        uint64_t u;
+        double d;
+        unsigned long job_history_size = DEFAULT_JOB_HISTORY_SIZE;
+        unsigned long job_details_history_size = DEFAULT_JOB_DETAILS_HISTORY_SIZE;
+        uint64_t idempotency_ttl = DEFAULT_IDEMPOTENCY_KEY_TTL;
+        Orchestrator orchestrator = {
+                .ha_lock_fd = -1,
+                .upgrade_status_fd = -1,
+                .straggler_factor = DEFAULT_STRAGGLER_FACTOR,
+                .min_timeout = {
+                        [NODE_OP_CALL] = DEFAULT_MIN_CALL_TIMEOUT,
+                        [NODE_OP_ISOLATE] = DEFAULT_MIN_ISOLATE_TIMEOUT,
+                        [NODE_OP_PREPARE] = DEFAULT_MIN_PREPARE_TIMEOUT,
+                },
+                .max_timeout = {
+                        [NODE_OP_CALL] = DEFAULT_MAX_CALL_TIMEOUT,
+                        [NODE_OP_ISOLATE] = DEFAULT_MAX_ISOLATE_TIMEOUT,
+                        [NODE_OP_PREPARE] = DEFAULT_MAX_PREPARE_TIMEOUT,
+                },
+        };
+
+        /* Upgrade runs us again the same way, less any handoff */
+        orchestrator.argv = calloc(argc + 1, sizeof(char *));
+        if (orchestrator.argv == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return EXIT_FAILURE;
+        }
+        for (i = 0; i < argc; i++) {
+                if (strncmp(argv[i], "--handoff-fd=", strlen("--handoff-fd=")) != 0)
+                        orchestrator.argv[n++] = argv[i];
+        }
+
+        while ((c = getopt_long(argc, argv, "H:D:I:S:W:p:h", options, NULL)) >= 0) {
+                r = 0;
+                switch (c) {
+                case 'H':
+                        r = parse_uint64(optarg, 0, UINT32_MAX, &u);
+                        if (r >= 0)
+                                job_history_size = u;
+                        break;
+                case 'D':
+                        r = parse_uint64(optarg, 0, UINT32_MAX, &u);
+                        if (r >= 0)
+                                job_details_history_size = u;
+                        break;
+                case 'I':
+                        r = parse_uint64(optarg, 0, UINT64_MAX / USEC_PER_SEC, &u);
+                        if (r >= 0)
+                                idempotency_ttl = u * USEC_PER_SEC;
+                        break;
+                case 'S':
+                        r = parse_double(optarg, 0, HUGE_VAL, &d);
+                        if (r >= 0)
+                                orchestrator.straggler_factor = d;
+                        break;
+                case 'W':
+                        r = parse_uint64(optarg, 0, INT_MAX, &u);
+                        if (r >= 0)
+                                orchestrator.dispatch_window = u;
+                        break;
+                case ARG_MIN_CALL_TIMEOUT:
+                        r = parse_double(optarg, 0, UINT32_MAX, &d);
+                        if (r >= 0)
+                                orchestrator.min_timeout[NODE_OP_CALL] = d * USEC_PER_SEC;
+                        break;
+                case ARG_MAX_CALL_TIMEOUT:
+                        r = parse_double(optarg, 0, UINT32_MAX, &d);
+                        if (r >= 0)
+                                orchestrator.max_timeout[NODE_OP_CALL] = d * USEC_PER_SEC;
+                        break;
+                case ARG_MIN_ISOLATE_TIMEOUT:
+                        r = parse_double(optarg, 0, UINT32_MAX, &d);
+                        if (r >= 0)
+                                orchestrator.min_timeout[NODE_OP_ISOLATE] = d * USEC_PER_SEC;
+                        break;
+                case ARG_MAX_ISOLATE_TIMEOUT:
+                        r = parse_double(optarg, 0, UINT32_MAX, &d);
+                        if (r >= 0)
+                                orchestrator.max_timeout[NODE_OP_ISOLATE] = d * USEC_PER_SEC;
+                        break;
+                case ARG_MIN_PREPARE_TIMEOUT:
+                        r = parse_double(optarg, 0, UINT32_MAX, &d);
+                        if (r >= 0)
+                                orchestrator.min_timeout[NODE_OP_PREPARE] = d * USEC_PER_SEC;
+                        break;
+                case ARG_MAX_PREPARE_TIMEOUT:
+                        r = parse_double(optarg, 0, UINT32_MAX, &d);
+                        if (r >= 0)
+                                orchestrator.max_timeout[NODE_OP_PREPARE] = d * USEC_PER_SEC;
+                        break;
+                case ARG_HANDOFF_FD:
+                        r = parse_uint64(optarg, 0, INT_MAX, &u);
+                        if (r >= 0)
+                                handoff_fd = u;
+                        break;
+                case 'p':
+                        r = parse_uint64(optarg, 1, 65535, &u);
+                        if (r >= 0)
+                                port = u;
+                        break;
+                case ARG_HA_LOCK:
+                        ha_lock_path = optarg;
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+
+                if (r < 0) {
+                        fprintf(stderr, "%s argument '%s'\n", r == -ERANGE ? "Out of range" : "Invalid", optarg);
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        /* A zero timeout would fail every call at once */
+        for (i = 0; i < _NODE_OP_MAX; i++) {
+                if (orchestrator.min_timeout[i] == 0 || orchestrator.min_timeout[i] > orchestrator.max_timeout[i]) {
+                        fprintf(stderr, "Invalid %s timeout bounds, the minimum must be above 0 and at most the maximum\n",
+                                node_op_table[i]);
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
 
         /* User bus for now */
         r = sd_bus_open_user(&bus);
@@ -660,6 +3508,15 @@ int main(int argc, char *argv[]) {
         orchestrator.manager.job_path_prefix = ORCHESTRATOR_JOBS_OBJECT_PATH_PREFIX;
         orchestrator.manager.manager_path = ORCHESTRATOR_OBJECT_PATH;
         orchestrator.manager.manager_iface = ORCHESTRATOR_IFACE;
+        orchestrator.manager.idempotency_ttl_usec = idempotency_ttl;
+        orchestrator.manager.admit_cb = orch_admit_job;
+        orchestrator.manager.job_removed_cb = orch_job_removed;
+
+        r = manager_set_job_history_size(&orchestrator.manager, job_history_size, job_details_history_size);
+        if (r < 0) {
+                fprintf(stderr, "Failed to allocate job history: %s\n", strerror(-r));
+                return EXIT_FAILURE;
+        }
 
         r = sd_bus_add_object_vtable(bus,
                                      &slot,
@@ -672,15 +3529,11 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
         }
 
-        r = sd_bus_request_name(bus, ORCHESTRATOR_BUS_NAME, 0);
-        if (r < 0) {
-                fprintf(stderr, "Failed to acquire service name: %s\n", strerror(-r));
-                return EXIT_FAILURE;
-        }
-
-        accept_fd = create_master_socket(1999);
-        if (accept_fd < 0) {
-                return EXIT_FAILURE;
+        if (handoff_fd < 0) {
+                accept_fd = create_master_socket(port);
+                if (accept_fd < 0) {
+                        return EXIT_FAILURE;
+                }
         }
 
         r = sd_event_default(&event);
@@ -697,22 +3550,54 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
         }
 
-        r = sd_event_add_io(event, &event_source, accept_fd, EPOLLIN,
-                            accept_handler, &orchestrator);
-        if (r < 0) {
-                fprintf(stderr, "Failed to add io event: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+        if (handoff_fd >= 0) {
+                r = orch_resume(&orchestrator, handoff_fd, &accept_fd);
+                close(handoff_fd);
+                handoff_fd = -1;
+                if (r < 0) {
+                        fprintf(stderr, "Failed to take over from the previous orchestrator: %s\n", strerror(-r));
+                        return EXIT_FAILURE;
+                }
+                printf("Took over %d nodes\n", orch_get_n_nodes(&orchestrator));
+                resumed = true;
         }
 
-        r = sd_event_source_set_io_fd_own(event_source, true);
-        if (r < 0) {
-                fprintf(stderr, "Failed to set io fd own: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+        if (ha_lock_path) {
+                r = orch_start_ha(&orchestrator, ha_lock_path);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set up %s: %s\n", ha_lock_path, strerror(-r));
+                        return EXIT_FAILURE;
+                }
+        }
+
+        /* The instance we take over from may not have let go of it yet. A
+         * standby gets it once it takes over. */
+        if (!orchestrator.standby) {
+                r = sd_bus_request_name(bus, ORCHESTRATOR_BUS_NAME, resumed ? SD_BUS_NAME_QUEUE : 0);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to acquire service name: %s\n", strerror(-r));
+                        return EXIT_FAILURE;
+                }
         }
 
-        (void) sd_event_source_set_description(event_source, "master-socket");
+        r = acceptor_start(&orchestrator.acceptor, event, accept_fd,
+                           orch_accept_connection, &orchestrator);
+        if (r < 0)
+                return EXIT_FAILURE;
+
+        /* The previous instance replies to Upgrade and exits on this */
+        if (orchestrator.upgrade_status_fd >= 0) {
+                if (write(orchestrator.upgrade_status_fd, "1", 1) != 1) {
+                        fprintf(stderr, "Failed to confirm the upgrade: %m\n");
+                        return EXIT_FAILURE;
+                }
+                close(orchestrator.upgrade_status_fd);
+                orchestrator.upgrade_status_fd = -1;
+        }
 
         r = sd_event_loop(event);
+        acceptor_stop(&orchestrator.acceptor);
+        orchestrator.ha_timer = sd_event_source_disable_unref(orchestrator.ha_timer);
         if (r < 0) {
                 fprintf(stderr, "Event loop failed: %s\n", strerror(-r));
                 return EXIT_FAILURE;
@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <assert.h>
 #include <stdbool.h>
@@ -211,6 +212,40 @@ static inline void closep(int *fd) {
         }
 }
 
+static inline void strv_free(char **l) {
+        char **i;
+
+        if (l == NULL)
+                return;
+        for (i = l; *i; i++)
+                free(*i);
+        free(l);
+}
+
+static inline size_t strv_length(char **l) {
+        size_t n = 0;
+
+        while (l && l[n])
+                n++;
+        return n;
+}
+
+static inline int strv_append(char ***l, const char *s) {
+        size_t n = strv_length(*l);
+        char **t;
+
+        t = realloc(*l, sizeof(char *) * (n + 2));
+        if (t == NULL)
+                return -ENOMEM;
+        *l = t;
+
+        t[n] = strdup(s);
+        if (t[n] == NULL)
+                return -ENOMEM;
+        t[n + 1] = NULL;
+        return 0;
+}
+
 #define malloc0(n) (calloc(1, (n) ?: 1))
 
 static inline void freep(void *p) {
@@ -274,6 +309,13 @@ static inline const char *enum_to_string(int i, const char * const *table, int t
 #define ORCHESTRATOR_IFACE "com.redhat.Orchestrator"
 #define ORCHESTRATOR_NODE_IFACE "com.redhat.Orchestrator.Node"
 #define ORCHESTRATOR_PEER_IFACE "com.redhat.Orchestrator.Peer"
+#define ORCHESTRATOR_ERROR_STANDBY "com.redhat.Orchestrator.Error.Standby"
+
+/* Where nodes connect to, a standby on the same host needs another */
+#define DEFAULT_ORCHESTRATOR_PORT 1999
+/* Nodes try each address of the orchestrator in turn, giving each one
+ * NODE_CONNECT_TIMEOUT */
+#define NODE_CONNECT_TIMEOUT (USEC_PER_SEC * 2)
 
 #define JOB_IFACE "com.redhat.Orchestrator.Job"
 
@@ -283,8 +325,144 @@ static inline const char *enum_to_string(int i, const char * const *table, int t
 #define NODE_IFACE "com.redhat.Orchestrator.Node"
 #define NODE_PEER_IFACE "com.redhat.Orchestrator.Node.Peer"
 
+#define ORCH_VERSION "0.1"
+
+/* Version of the inventory nodes send with RegisterWithInventory. Keys
+ * can be added without bumping it, unknown keys are ignored. */
+#define NODE_INVENTORY_VERSION 1
+
+/* Version of the peer protocol, and the optional parts of it. Both ends
+ * send what they support, only features in both are used. */
+#define NODE_PROTOCOL_VERSION 1
+
+enum {
+        NODE_FEATURE_PREPARE       = 1 << 0, /* node implements Prepare */
+        NODE_FEATURE_QUIET_JOB_NEW = 1 << 1, /* node leaves out JobNew signals on the peer bus */
+        NODE_FEATURE_JOBS_REMOVED  = 1 << 2, /* node batches JobRemoved signals into JobsRemoved */
+        NODE_FEATURE_BATCH         = 1 << 3, /* node implements Batch */
+        NODE_FEATURE_CREDITS       = 1 << 4, /* credit based flow control, see below */
+        NODE_FEATURE_HANDOFF       = 1 << 5, /* node follows its connection to a new orchestrator, see below */
+        NODE_FEATURE_SESSION       = 1 << 6, /* node reconnects into its session, see below */
+        NODE_FEATURE_REPLAY        = 1 << 7, /* node sends job results again that were lost, see below */
+};
+
+#define NODE_FEATURES_SUPPORTED (NODE_FEATURE_PREPARE | NODE_FEATURE_QUIET_JOB_NEW | \
+                                 NODE_FEATURE_JOBS_REMOVED | NODE_FEATURE_BATCH | \
+                                 NODE_FEATURE_CREDITS | \
+                                 NODE_FEATURE_HANDOFF | NODE_FEATURE_SESSION | \
+                                 NODE_FEATURE_REPLAY)
+
+/* Upgrading the orchestrator in place, with NODE_FEATURE_HANDOFF. The
+ * orchestrator sends Handoff, the node stops sending and calls
+ * HandoffReady. The old orchestrator passes the connection to the new
+ * one and replies once the new one confirms it has resumed. The node
+ * then authenticates again on the same TCP connection and stays
+ * registered. If the new one fails, or doesn't confirm within
+ * HANDOFF_TIMEOUT, the reply is an error and the node carries on with
+ * the old one. */
+#define HANDOFF_TIMEOUT (USEC_PER_SEC * 10)
+
+/* Sessions, with NODE_FEATURE_SESSION. After registering the node gets
+ * a token in a Session signal. A node that loses its connection
+ * reconnects and registers again with the token as SessionToken in its
+ * inventory. That takes over the session, with the jobs and operations
+ * of the old connection, which is closed. */
+#define NODE_RECONNECT_INTERVAL (USEC_PER_SEC * 1)
+/* How long the orchestrator keeps the session of a disconnected node */
+#define NODE_SESSION_TIMEOUT (USEC_PER_SEC * 60)
+
+/* Active/standby orchestrators, with --ha-lock. The one holding the
+ * lock file is active, the standby tries to take it at
+ * HA_LOCK_POLL_INTERVAL. The active one replicates its jobs and node
+ * sessions to the lock file path plus ".state", after a change but at
+ * most every HA_REPLICATE_INTERVAL. Submits are written out at once and
+ * answered after, so what a takeover loses is job progress and node
+ * sessions from the last HA_REPLICATE_INTERVAL, never a job a client
+ * was given. Nodes given a standby keep a second connection to it,
+ * pinged every HA_HEARTBEAT_INTERVAL. They register there when they
+ * lose the active one, which the standby answers once it has taken
+ * over. If the lock is still held after HA_REGISTER_HOLD_TIMEOUT the
+ * active one is up, and the standby refuses with
+ * ORCHESTRATOR_ERROR_STANDBY to send the node back to it. */
+#define HA_LOCK_POLL_INTERVAL (USEC_PER_SEC / 50)
+#define HA_REPLICATE_INTERVAL (USEC_PER_SEC / 20)
+#define HA_HEARTBEAT_INTERVAL (USEC_PER_SEC * 1)
+#define HA_REGISTER_HOLD_TIMEOUT (USEC_PER_SEC / 2)
+
+/* Replaying job results, with NODE_FEATURE_SESSION and
+ * NODE_FEATURE_REPLAY. The orchestrator counts the job results it gets
+ * in a session and sends the count in EventsAcked, every
+ * EVENT_ACK_INTERVAL results and right after a resumed Register. Until
+ * that one, the node holds its results back, then it sends the ones
+ * past the count again. */
+#define EVENT_ACK_INTERVAL 32
+#define DEFAULT_NODE_EVENT_LOG_SIZE 1024
+
+/* Flow control on the peer link, with NODE_FEATURE_CREDITS. The node
+ * grants OperationCredits in its inventory, each operation sent to it
+ * takes one until its node job is removed. A job has one operation per
+ * node in flight, but one whose deadline passed gives up on its node
+ * job while that keeps the credit, so these bound how many operations
+ * pile up on a node that is stuck. The orchestrator grants the node
+ * credits for JobsRemoved signals with EventCredits signals, one per
+ * signal, replenished as it handles them. */
+#define DEFAULT_NODE_OPERATION_CREDITS 32
+#define DEFAULT_EVENT_CREDITS 16
+
+/* Operations for one node queued in the same event loop iteration go
+ * out as one Batch call of at most this many, with NODE_FEATURE_BATCH.
+ * The node queues all of a Batch or none of it. */
+#define MAX_NODE_BATCH 64
+
 #define DEFAULT_DBUS_TIMEOUT (USEC_PER_SEC * 30)
 
+/* Bounds for the per-node timeouts the orchestrator learns. Until a node
+ * has answered once, the maximum is used. */
+#define DEFAULT_MIN_CALL_TIMEOUT (USEC_PER_SEC * 1)
+#define DEFAULT_MAX_CALL_TIMEOUT DEFAULT_DBUS_TIMEOUT
+#define DEFAULT_MIN_ISOLATE_TIMEOUT (USEC_PER_SEC * 10)
+#define DEFAULT_MAX_ISOLATE_TIMEOUT (USEC_PER_SEC * 3600)
+#define DEFAULT_MIN_PREPARE_TIMEOUT (USEC_PER_SEC * 10)
+#define DEFAULT_MAX_PREPARE_TIMEOUT (USEC_PER_SEC * 3600)
+
+/* Number of finished jobs whose result can still be queried */
+#define DEFAULT_JOB_HISTORY_SIZE 1024
+
+/* Number of finished jobs whose per-node results are kept, these can be large */
+#define DEFAULT_JOB_DETAILS_HISTORY_SIZE 16
+
+/* How long a job submission idempotency key is remembered */
+#define DEFAULT_IDEMPOTENCY_KEY_TTL (USEC_PER_SEC * 600)
+
+/* A node whose request has been running for more than this many times
+ * the median completion time of a fleet job is a straggler */
+#define DEFAULT_STRAGGLER_FACTOR 3.0
+#define STRAGGLER_MIN_SAMPLES 5
+#define STRAGGLER_CHECK_INTERVAL (USEC_PER_SEC * 1)
+
+/* Nodes hold jobs back while pressure stall information (PSI) is
+ * above the configured thresholds, re-checking at this interval, but
+ * never longer than the max hold time */
+#define DEFAULT_PSI_DIR "/proc/pressure"
+#define PSI_POLL_INTERVAL (USEC_PER_SEC / 2)
+#define DEFAULT_PSI_MAX_HOLD (USEC_PER_SEC * 60)
+
+/* Pacing of a node's calls to systemd: a token bucket of this rate
+ * (calls per second) and burst, and at most this many calls in flight */
+#define DEFAULT_SYSTEMD_CALL_RATE 200
+#define DEFAULT_SYSTEMD_CALL_BURST 32
+#define DEFAULT_SYSTEMD_MAX_IN_FLIGHT 16
+
+/* A node that loses its connection to systemd, as on daemon-reexec,
+ * connects again right away and then at this interval. PID1 keeps its
+ * listening sockets over a reexec, so the first try normally works. */
+#define SYSTEMD_RECONNECT_INTERVAL (USEC_PER_SEC / 100)
+
+/* Targets per node whose isolate durations we remember */
+#define MAX_TARGET_HISTORY 16
+
 #define SYSTEMD_BUS_NAME "org.freedesktop.systemd1"
 #define SYSTEMD_OBJECT_PATH "/org/freedesktop/systemd1"
 #define SYSTEMD_MANAGER_IFACE "org.freedesktop.systemd1.Manager"
+#define SYSTEMD_UNIT_OBJECT_PATH_PREFIX "/org/freedesktop/systemd1/unit"
+#define SYSTEMD_UNIT_IFACE "org.freedesktop.systemd1.Unit"
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Runs the tests against a private bus, which stands in for both the
+# user bus of orch and the system bus of orch-node, with fakesd on it
+# in place of systemd. Used by make check.
+#
+# Needs dbus-daemon. BUILD_DIR says where the binaries are, including
+# tests/fakesd. Without arguments it runs every test in this directory,
+# otherwise the ones named.
+
+set -u
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+export BUILD_DIR=${BUILD_DIR:-$(dirname "$TESTS_DIR")}
+TESTS=${*:-$(cd "$TESTS_DIR" && ls *.sh | grep -v -x -e lib.sh -e check.sh | sed 's/\.sh$//')}
+TMP=$(mktemp -d)
+BUS_PID=""
+FAKESD_PID=""
+
+cleanup() {
+        kill $FAKESD_PID $BUS_PID 2>/dev/null
+        rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+dbus-daemon --config-file="$TESTS_DIR/bus.conf" --fork --print-address=1 --print-pid=1 > "$TMP/bus" || exit 1
+BUS_PID=$(sed -n 2p "$TMP/bus")
+export DBUS_SESSION_BUS_ADDRESS=$(sed -n 1p "$TMP/bus")
+export DBUS_SYSTEM_BUS_ADDRESS=$DBUS_SESSION_BUS_ADDRESS
+
+stdbuf -oL "$BUILD_DIR/tests/fakesd" > "$TMP/fakesd.log" 2>&1 &
+FAKESD_PID=$!
+for i in $(seq 200); do
+        grep -q "ready" "$TMP/fakesd.log" && break
+        sleep 0.05
+done
+grep -q "ready" "$TMP/fakesd.log" || { cat "$TMP/fakesd.log"; exit 1; }
+
+failed=""
+for t in $TESTS; do
+        echo "=== $t"
+        sh "$TESTS_DIR/$t.sh" || failed="$failed $t"
+done
+
+if [ -n "$failed" ]; then
+        echo "Failed:$failed"
+        exit 1
+fi
+echo "All tests passed"
@@ -0,0 +1,392 @@
+/* A fake of the parts of systemd's D-Bus API that orch-node uses, for
+ * the tests. It owns org.freedesktop.systemd1 on the system bus it is
+ * given, with a few units whose jobs finish after FAKESD_JOB_MSEC
+ * (default 50). Jobs for units named in FAKESD_FAIL fail. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#define MAX_UNITS 32
+#define MAX_JOBS 256
+
+typedef struct Unit {
+        char *name;
+        char *path;
+        char *active_state;
+        char **wants;
+        char **requires;
+        char **conflicts;
+        uint32_t job_id;
+} Unit;
+
+typedef struct FakeJob {
+        uint32_t id;
+        char *path;
+        Unit *unit;
+        const char *type;
+        bool fail;
+        sd_event_source *timer;
+} FakeJob;
+
+static sd_bus *bus;
+static sd_event *event;
+static Unit units[MAX_UNITS];
+static int n_units;
+static FakeJob *jobs[MAX_JOBS];
+static uint32_t next_job_id = 100;
+static uint64_t job_usec = 50000;
+
+/* Splits a space separated list */
+static char **strv_split(const char *s) {
+        char **l = calloc(MAX_UNITS + 1, sizeof(char *));
+        char *dup = strdup(s), *tok, *save;
+        int n = 0;
+
+        if (l == NULL || dup == NULL)
+                abort();
+
+        for (tok = strtok_r(dup, " ", &save); tok && n < MAX_UNITS; tok = strtok_r(NULL, " ", &save))
+                l[n++] = strdup(tok);
+
+        free(dup);
+        return l;
+}
+
+static Unit *find_unit(const char *name) {
+        int i;
+
+        for (i = 0; i < n_units; i++)
+                if (strcmp(units[i].name, name) == 0)
+                        return &units[i];
+        return NULL;
+}
+
+static void set_state(Unit *u, const char *state) {
+        free(u->active_state);
+        u->active_state = strdup(state);
+}
+
+static bool is_failed(Unit *u) {
+        return strcmp(u->active_state, "failed") == 0;
+}
+
+static int property_active_state(sd_bus *b, const char *path, const char *iface, const char *property,
+                                 sd_bus_message *reply, void *userdata, sd_bus_error *error) {
+        Unit *u = userdata;
+
+        return sd_bus_message_append(reply, "s", u->active_state);
+}
+
+static int property_deps(sd_bus *b, const char *path, const char *iface, const char *property,
+                         sd_bus_message *reply, void *userdata, sd_bus_error *error) {
+        static char *none[] = { NULL };
+        Unit *u = userdata;
+        char **l = none;
+
+        if (strcmp(property, "Wants") == 0)
+                l = u->wants;
+        else if (strcmp(property, "Requires") == 0)
+                l = u->requires;
+        else if (strcmp(property, "Conflicts") == 0)
+                l = u->conflicts;
+
+        return sd_bus_message_append_strv(reply, l);
+}
+
+static const sd_bus_vtable unit_vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_PROPERTY("ActiveState", "s", property_active_state, 0, 0),
+        SD_BUS_PROPERTY("Wants", "as", property_deps, 0, 0),
+        SD_BUS_PROPERTY("Requires", "as", property_deps, 0, 0),
+        SD_BUS_PROPERTY("Conflicts", "as", property_deps, 0, 0),
+        SD_BUS_PROPERTY("ConflictedBy", "as", property_deps, 0, 0),
+        SD_BUS_VTABLE_END
+};
+
+static void add_unit(const char *name, const char *state, const char *wants, const char *requires,
+                     const char *conflicts) {
+        Unit *u = &units[n_units++];
+
+        u->name = strdup(name);
+        u->active_state = strdup(state);
+        u->wants = strv_split(wants);
+        u->requires = strv_split(requires);
+        u->conflicts = strv_split(conflicts);
+        if (sd_bus_path_encode("/org/freedesktop/systemd1/unit", name, &u->path) < 0 ||
+            sd_bus_add_object_vtable(bus, NULL, u->path, "org.freedesktop.systemd1.Unit", unit_vtable, u) < 0)
+                abort();
+}
+
+/* Roughly what systemd does, one level deep */
+static void activate(Unit *u) {
+        char **d;
+        Unit *x;
+
+        set_state(u, "active");
+        for (d = u->wants; *d; d++)
+                if ((x = find_unit(*d)) && !is_failed(x))
+                        set_state(x, "active");
+        for (d = u->requires; *d; d++)
+                if ((x = find_unit(*d)))
+                        set_state(x, "active");
+        for (d = u->conflicts; *d; d++)
+                if ((x = find_unit(*d)))
+                        set_state(x, "inactive");
+}
+
+static int job_done(sd_event_source *s, uint64_t usec, void *userdata) {
+        FakeJob *j = userdata;
+        const char *result = j->fail ? "failed" : "done";
+        int i;
+
+        if (!j->fail) {
+                if (strcmp(j->type, "isolate") == 0)
+                        for (i = 0; i < n_units; i++)
+                                if (!is_failed(&units[i]))
+                                        set_state(&units[i], "inactive");
+                activate(j->unit);
+        }
+
+        printf("fakesd: job %u %s %s -> %s\n", j->id, j->unit->name, j->type, result);
+        fflush(stdout);
+        (void) sd_bus_emit_signal(bus, "/org/freedesktop/systemd1", "org.freedesktop.systemd1.Manager",
+                                  "JobRemoved", "uoss", j->id, j->path, j->unit->name, result);
+
+        j->unit->job_id = 0;
+        jobs[j->id % MAX_JOBS] = NULL;
+        sd_event_source_unref(j->timer);
+        free(j->path);
+        free(j);
+        return 0;
+}
+
+static int method_start_unit(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        const char *name, *mode, *fail = getenv("FAKESD_FAIL");
+        FakeJob *j;
+        Unit *u;
+        int r;
+
+        r = sd_bus_message_read(m, "ss", &name, &mode);
+        if (r < 0)
+                return r;
+
+        u = find_unit(name);
+        if (u == NULL)
+                return sd_bus_reply_method_errorf(m, "org.freedesktop.systemd1.NoSuchUnit", "Unit %s not found.", name);
+
+        j = calloc(1, sizeof(FakeJob));
+        if (j == NULL)
+                return -ENOMEM;
+        j->id = ++next_job_id;
+        j->unit = u;
+        j->type = strcmp(mode, "isolate") == 0 ? "isolate" : "start";
+        j->fail = fail != NULL && strstr(fail, name) != NULL;
+        if (asprintf(&j->path, "/org/freedesktop/systemd1/job/%u", j->id) < 0)
+                abort();
+
+        r = sd_event_add_time_relative(event, &j->timer, CLOCK_MONOTONIC, job_usec, 0, job_done, j);
+        if (r < 0) {
+                free(j->path);
+                free(j);
+                return r;
+        }
+
+        u->job_id = j->id;
+        jobs[j->id % MAX_JOBS] = j;
+        return sd_bus_reply_method_return(m, "o", j->path);
+}
+
+static int append_unit(sd_bus_message *reply, const char *name, Unit *u) {
+        char job_path[64];
+
+        snprintf(job_path, sizeof(job_path), "/org/freedesktop/systemd1/job/%u", u ? u->job_id : 0);
+        return sd_bus_message_append(reply, "(ssssssouso)", name, "", u ? "loaded" : "not-found",
+                                     u ? u->active_state : "inactive", "", "",
+                                     u ? u->path : "/", u ? u->job_id : 0, "",
+                                     u && u->job_id ? job_path : "/");
+}
+
+static int method_list_units_by_names(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        sd_bus_message *reply = NULL;
+        char **names = NULL, **n;
+        int r;
+
+        r = sd_bus_message_read_strv(m, &names);
+        if (r >= 0)
+                r = sd_bus_message_new_method_return(m, &reply);
+        if (r >= 0)
+                r = sd_bus_message_open_container(reply, 'a', "(ssssssouso)");
+        for (n = names; r >= 0 && n && *n; n++)
+                r = append_unit(reply, *n, find_unit(*n));
+        if (r >= 0)
+                r = sd_bus_message_close_container(reply);
+        if (r >= 0)
+                r = sd_bus_send(NULL, reply, NULL);
+
+        for (n = names; n && *n; n++)
+                free(*n);
+        free(names);
+        sd_bus_message_unref(reply);
+        return r;
+}
+
+static int method_list_units_filtered(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        sd_bus_message *reply = NULL;
+        char **states = NULL, **s;
+        int i, r;
+
+        r = sd_bus_message_read_strv(m, &states);
+        if (r >= 0)
+                r = sd_bus_message_new_method_return(m, &reply);
+        if (r >= 0)
+                r = sd_bus_message_open_container(reply, 'a', "(ssssssouso)");
+        for (i = 0; r >= 0 && i < n_units; i++)
+                for (s = states; s && *s; s++)
+                        if (strcmp(*s, units[i].active_state) == 0) {
+                                r = append_unit(reply, units[i].name, &units[i]);
+                                break;
+                        }
+        if (r >= 0)
+                r = sd_bus_message_close_container(reply);
+        if (r >= 0)
+                r = sd_bus_send(NULL, reply, NULL);
+
+        for (s = states; s && *s; s++)
+                free(*s);
+        free(states);
+        sd_bus_message_unref(reply);
+        return r;
+}
+
+static int method_list_jobs(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        sd_bus_message *reply = NULL;
+        int i, r;
+
+        r = sd_bus_message_new_method_return(m, &reply);
+        if (r >= 0)
+                r = sd_bus_message_open_container(reply, 'a', "(usssoo)");
+        for (i = 0; r >= 0 && i < MAX_JOBS; i++)
+                if (jobs[i])
+                        r = sd_bus_message_append(reply, "(usssoo)", jobs[i]->id, jobs[i]->unit->name,
+                                                  jobs[i]->type, "running", jobs[i]->path, jobs[i]->unit->path);
+        if (r >= 0)
+                r = sd_bus_message_close_container(reply);
+        if (r >= 0)
+                r = sd_bus_send(NULL, reply, NULL);
+
+        sd_bus_message_unref(reply);
+        return r;
+}
+
+static int method_get_job(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        FakeJob *j;
+        uint32_t id;
+        int r;
+
+        r = sd_bus_message_read(m, "u", &id);
+        if (r < 0)
+                return r;
+
+        j = jobs[id % MAX_JOBS];
+        if (j == NULL || j->id != id)
+                return sd_bus_reply_method_errorf(m, "org.freedesktop.systemd1.NoSuchJob", "Job %u does not exist.", id);
+
+        return sd_bus_reply_method_return(m, "o", j->path);
+}
+
+static int method_nop(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        return sd_bus_reply_method_return(m, "");
+}
+
+/* Not in systemd: changes a unit's state behind the node's back */
+static int method_set_state(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        const char *name, *state;
+        Unit *u;
+        int r;
+
+        r = sd_bus_message_read(m, "ss", &name, &state);
+        if (r < 0)
+                return r;
+
+        u = find_unit(name);
+        if (u == NULL)
+                return sd_bus_reply_method_errorf(m, "org.freedesktop.systemd1.NoSuchUnit", "Unit %s not found.", name);
+
+        set_state(u, state);
+        return sd_bus_reply_method_return(m, "");
+}
+
+static int property_n_failed_units(sd_bus *b, const char *path, const char *iface, const char *property,
+                                   sd_bus_message *reply, void *userdata, sd_bus_error *error) {
+        uint32_t n = 0;
+        int i;
+
+        for (i = 0; i < n_units; i++)
+                if (is_failed(&units[i]))
+                        n++;
+
+        return sd_bus_message_append(reply, "u", n);
+}
+
+static const sd_bus_vtable manager_vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_METHOD("Subscribe", "", "", method_nop, 0),
+        SD_BUS_METHOD("Unsubscribe", "", "", method_nop, 0),
+        SD_BUS_METHOD("StartUnit", "ss", "o", method_start_unit, 0),
+        SD_BUS_METHOD("ListUnitsByNames", "as", "a(ssssssouso)", method_list_units_by_names, 0),
+        SD_BUS_METHOD("ListUnitsFiltered", "as", "a(ssssssouso)", method_list_units_filtered, 0),
+        SD_BUS_METHOD("ListJobs", "", "a(usssoo)", method_list_jobs, 0),
+        SD_BUS_METHOD("GetJob", "u", "o", method_get_job, 0),
+        SD_BUS_METHOD("SetState", "ss", "", method_set_state, 0),
+        SD_BUS_PROPERTY("NFailedUnits", "u", property_n_failed_units, 0, 0),
+        SD_BUS_SIGNAL("JobRemoved", "uoss", 0),
+        SD_BUS_VTABLE_END
+};
+
+int main(int argc, char *argv[]) {
+        const char *msec = getenv("FAKESD_JOB_MSEC");
+        int r;
+
+        if (msec != NULL)
+                job_usec = strtoull(msec, NULL, 10) * 1000;
+
+        r = sd_event_default(&event);
+        if (r >= 0)
+                r = sd_bus_open_system(&bus);
+        if (r >= 0)
+                r = sd_bus_add_object_vtable(bus, NULL, "/org/freedesktop/systemd1", "org.freedesktop.systemd1.Manager",
+                                             manager_vtable, NULL);
+        if (r < 0) {
+                fprintf(stderr, "fakesd: failed to set up the bus: %s\n", strerror(-r));
+                return EXIT_FAILURE;
+        }
+
+        add_unit("multi-user.target", "active", "a.service b.service", "basic.target", "rescue.target");
+        add_unit("basic.target", "active", "", "c.service", "");
+        add_unit("rescue.target", "inactive", "", "rescue.service", "multi-user.target");
+        add_unit("graphical.target", "inactive", "d.service", "multi-user.target", "");
+        add_unit("a.service", "active", "", "", "");
+        add_unit("b.service", "active", "", "", "rescue.service");
+        add_unit("c.service", "active", "", "", "");
+        add_unit("d.service", "inactive", "", "", "");
+        add_unit("rescue.service", "inactive", "", "", "b.service");
+
+        r = sd_bus_request_name(bus, "org.freedesktop.systemd1", 0);
+        if (r >= 0)
+                r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
+        if (r < 0) {
+                fprintf(stderr, "fakesd: failed to take the systemd name: %s\n", strerror(-r));
+                return EXIT_FAILURE;
+        }
+
+        printf("fakesd: ready\n");
+        fflush(stdout);
+
+        r = sd_event_loop(event);
+        return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
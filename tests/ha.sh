@@ -0,0 +1,53 @@
+#!/bin/sh
+# Runs an active and a standby orchestrator on one lock file with two
+# nodes, kills the active one and checks that the standby takes the
+# nodes over with their sessions. Also checks that a node which only
+# lost its connection is sent back by the standby while the active one
+# is up.
+#
+# Run by make check, see check.sh. No jobs are run. PORT says which
+# ports to use, PORT and PORT + 1.
+
+set -u
+
+. "$(dirname "$0")/lib.sh"
+
+PORT=${PORT:-19980}
+STANDBY_PORT=$((PORT + 1))
+
+# Line buffered, the checks read the logs as they go
+stdbuf -oL "$BUILD_DIR/orch" -p "$PORT" --ha-lock="$TMP/lock" > "$TMP/active.log" 2>&1 &
+ACTIVE=$!
+PIDS="$PIDS $ACTIVE"
+wait_for 1 "active" "$TMP/active.log"
+stdbuf -oL "$BUILD_DIR/orch" -p "$STANDBY_PORT" --ha-lock="$TMP/lock" > "$TMP/standby.log" 2>&1 &
+PIDS="$PIDS $!"
+wait_for 1 "standing by" "$TMP/standby.log"
+
+# Given the standby first, as if it had lost the active one
+stdbuf -oL "$BUILD_DIR/orch-node" --standby="127.0.0.1:$PORT" "127.0.0.1:$STANDBY_PORT" n0 > "$TMP/n0.log" 2>&1 &
+PIDS="$PIDS $!"
+wait_for 1 "Refusing held registration" "$TMP/standby.log"
+wait_for 1 "Going back to orchestrator" "$TMP/n0.log"
+wait_for 1 "as 'n0'" "$TMP/active.log"
+echo "PASS: standby sent n0 back to the active orchestrator"
+
+for n in n1 n2; do
+        stdbuf -oL "$BUILD_DIR/orch-node" --standby="127.0.0.1:$STANDBY_PORT" "127.0.0.1:$PORT" $n > "$TMP/$n.log" 2>&1 &
+        PIDS="$PIDS $!"
+        wait_for 1 "Connected to standby orchestrator" "$TMP/$n.log"
+done
+wait_for 3 "Registered node" "$TMP/active.log"
+# Past HA_REPLICATE_INTERVAL, the standby has the sessions
+sleep 0.2
+
+start=$(date +%s%N)
+kill -9 $ACTIVE
+for n in n1 n2; do
+        wait_for 1 "Registered again" "$TMP/$n.log"
+done
+echo "takeover took $(( ($(date +%s%N) - start) / 1000000 )) ms"
+
+grep "Took over as active orchestrator" "$TMP/standby.log" || fail "standby did not take over"
+[ "$(grep -c "resumed its session" "$TMP/standby.log")" -ge 2 ] || fail "a session was not resumed"
+echo "PASS: standby took over n1 and n2 with their sessions"
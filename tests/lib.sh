@@ -0,0 +1,36 @@
+# Sourced by the tests. Sets TMP, a directory removed on exit, and PIDS,
+# the processes killed on exit. BUILD_DIR says where the binaries are.
+
+BUILD_DIR=${BUILD_DIR:-$(cd "$(dirname "$0")/.." && pwd)}
+TMP=$(mktemp -d)
+PIDS=""
+
+# Processes the test didn't start itself, killed on exit as well
+cleanup_pids() {
+        :
+}
+
+cleanup() {
+        kill $PIDS $(cleanup_pids) 2>/dev/null
+        wait 2>/dev/null
+        rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+fail() {
+        echo "FAIL: $*"
+        for f in "$TMP"/*.log; do
+                echo "--- $f"
+                cat "$f"
+        done
+        exit 1
+}
+
+# Waits up to 10s for at least N lines matching PATTERN in FILE
+wait_for() {
+        for i in $(seq 200); do
+                [ "$(grep -c "$2" "$3")" -ge "$1" ] && return 0
+                sleep 0.05
+        done
+        fail "no $1 x '$2' in $3"
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+# Runs isolates on a node that reads pressure from files written here.
+# Checks that a job starts at once below the thresholds, waits above
+# them until the pressure drops, and starts anyway after --psi-max-hold.
+# The holds have to reach the orchestrator as JobHeld and JobAdmitted.
+#
+# Run by make check, see check.sh. PORT says which port to use.
+
+set -u
+
+. "$(dirname "$0")/lib.sh"
+
+PORT=${PORT:-19970}
+
+# Sets the "some" avg10 of RESOURCE to PCT
+pressure() {
+        echo "some avg10=$2 avg60=0.00 avg300=0.00 total=0" > "$TMP/psi/$1"
+        echo "full avg10=0.00 avg60=0.00 avg300=0.00 total=0" >> "$TMP/psi/$1"
+}
+
+now_ms() {
+        echo $(( $(date +%s%N) / 1000000 ))
+}
+
+isolate() {
+        "$BUILD_DIR/orch-client" isolate-all "$1" >> "$TMP/client.log" 2>&1 &
+        PIDS="$PIDS $!"
+}
+
+mkdir "$TMP/psi"
+for r in cpu memory io; do
+        pressure $r 1.00
+done
+
+stdbuf -oL "$BUILD_DIR/orch" -p "$PORT" > "$TMP/orch.log" 2>&1 &
+PIDS="$PIDS $!"
+sleep 0.3
+stdbuf -oL "$BUILD_DIR/orch-node" --psi-dir="$TMP/psi" --psi-cpu=50 --psi-memory=50 --psi-io=50 \
+        --psi-max-hold=2 "127.0.0.1:$PORT" n1 > "$TMP/n1.log" 2>&1 &
+PIDS="$PIDS $!"
+wait_for 1 "Registered node" "$TMP/orch.log"
+
+isolate rescue.target
+wait_for 1 "0 held back by node pressure" "$TMP/orch.log"
+grep -q "Holding job" "$TMP/n1.log" && fail "job held below the thresholds"
+echo "PASS: job below the thresholds ran at once"
+
+pressure io 80.00
+isolate multi-user.target
+wait_for 1 "Holding job .*: io pressure 80.0% is above 50.0%" "$TMP/n1.log"
+wait_for 1 "node 'n1' holds its job: io pressure 80.0%" "$TMP/orch.log"
+sleep 1
+grep -q "Admitting job" "$TMP/n1.log" && fail "held job admitted under pressure"
+[ "$(grep -c "held back by node pressure" "$TMP/orch.log")" -eq 1 ] || fail "held job finished"
+pressure io 1.00
+wait_for 1 "Admitting job" "$TMP/n1.log"
+wait_for 1 "node 'n1' admitted its job after" "$TMP/orch.log"
+wait_for 1 "1 held back by node pressure" "$TMP/orch.log"
+echo "PASS: job waited for io pressure to drop"
+
+pressure memory 90.00
+isolate rescue.target
+wait_for 2 "Holding job" "$TMP/n1.log"
+start=$(now_ms)
+wait_for 1 "held too long, starting it under memory pressure" "$TMP/n1.log"
+held=$(( $(now_ms) - start ))
+[ "$held" -ge 1500 ] || fail "held job started after $held ms, before --psi-max-hold"
+wait_for 2 "1 held back by node pressure" "$TMP/orch.log"
+echo "PASS: job under memory pressure started after $held ms"
@@ -0,0 +1,69 @@
+#!/bin/sh
+# Upgrades a local orchestrator with two nodes connected, then makes an
+# upgrade fail and checks that the old instance keeps the nodes.
+#
+# Run by make check, see check.sh. No jobs are run. PORT says which
+# port to use.
+
+set -u
+
+. "$(dirname "$0")/lib.sh"
+
+PORT=${PORT:-19990}
+
+new_pid() {
+        sed -n "s/^New instance \([0-9]*\) took over.*/\1/p" "$TMP/orch.log" | tail -1
+}
+
+cleanup_pids() {
+        new_pid
+}
+
+# Upgrade starts what orch was started as, so run a copy we can replace.
+# Line buffered, the checks read the logs as they go.
+cp "$BUILD_DIR/orch" "$TMP/orch"
+stdbuf -oL "$TMP/orch" -p "$PORT" > "$TMP/orch.log" 2>&1 &
+OLD=$!
+PIDS="$PIDS $OLD"
+sleep 0.3
+
+for n in n1 n2; do
+        stdbuf -oL "$BUILD_DIR/orch-node" "127.0.0.1:$PORT" $n > "$TMP/$n.log" 2>&1 &
+        PIDS="$PIDS $!"
+done
+wait_for 2 "Registered node" "$TMP/orch.log"
+
+start=$(date +%s%N)
+"$BUILD_DIR/orch-client" upgrade > "$TMP/client.log" 2>&1 || fail "upgrade failed"
+echo "upgrade took $(( ($(date +%s%N) - start) / 1000000 )) ms"
+grep -q "handed off 2 nodes" "$TMP/client.log" || fail "not all nodes handed off"
+
+sleep 0.3
+kill -0 $OLD 2>/dev/null && fail "old instance still running"
+NEW=$(new_pid)
+[ -n "$NEW" ] && kill -0 "$NEW" 2>/dev/null || fail "new instance not running"
+for n in n1 n2; do
+        grep -q "Connection handed off" "$TMP/$n.log" || fail "$n not handed off"
+        grep -q "Orchestrator disconnected" "$TMP/$n.log" && fail "$n lost its connection"
+done
+echo "PASS: upgrade handed off both nodes to $NEW"
+
+# A new instance that can't start leaves the old one in charge
+rm "$TMP/orch"
+printf '#!/bin/sh\nexit 1\n' > "$TMP/orch"
+chmod +x "$TMP/orch"
+
+"$BUILD_DIR/orch-client" upgrade > "$TMP/client.log" 2>&1 && fail "broken upgrade succeeded"
+kill -0 "$NEW" 2>/dev/null || fail "old instance gone after broken upgrade"
+for n in n1 n2; do
+        wait_for 1 "handoff canceled" "$TMP/$n.log"
+        grep -q "Orchestrator disconnected" "$TMP/$n.log" && fail "$n lost its connection"
+done
+echo "PASS: broken upgrade left both nodes with $NEW"
+
+# The nodes are still ready to follow the next one
+rm "$TMP/orch"
+cp "$BUILD_DIR/orch" "$TMP/orch"
+"$BUILD_DIR/orch-client" upgrade > "$TMP/client.log" 2>&1 || fail "upgrade after a broken one failed"
+grep -q "handed off 2 nodes" "$TMP/client.log" || fail "not all nodes handed off again"
+echo "PASS: upgrade after a broken one handed off both nodes to $(new_pid)"
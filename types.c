@@ -1,15 +1,21 @@
 #include "types.h"
 
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+
 static const char* const job_type_table[_JOB_TYPE_MAX] = {
         [JOB_ISOLATE_ALL] = "isolate-all",
+        [JOB_PREPARE_ALL] = "prepare-all",
 };
 
 const char *job_type_to_string(JobType type) {
         return ENUM_TO_STRING(type, job_type_table);
 }
 
-static const char* const node_job_type_table[_JOB_TYPE_MAX] = {
+static const char* const node_job_type_table[_NODE_JOB_TYPE_MAX] = {
         [NODE_JOB_ISOLATE] = "isolate",
+        [NODE_JOB_PREPARE] = "prepare",
 };
 
 const char *node_job_type_to_string(NodeJobType type) {
@@ -35,17 +41,96 @@ const char *job_result_to_string(JobResult result) {
         return ENUM_TO_STRING(result, job_result_table);
 }
 
-Job *job_new(Manager *manager, int job_type, size_t job_size) {
+int parse_uint64(const char *s, uint64_t min, uint64_t max, uint64_t *ret) {
+        unsigned long long v;
+        char *end;
+
+        /* strtoull() takes leading space and a sign */
+        if (!isdigit((unsigned char) s[0]))
+                return -EINVAL;
+
+        errno = 0;
+        v = strtoull(s, &end, 10);
+        if (*end != '\0')
+                return -EINVAL;
+        if (errno == ERANGE || v < min || v > max)
+                return -ERANGE;
+
+        *ret = v;
+        return 0;
+}
+
+int parse_double(const char *s, double min, double max, double *ret) {
+        char *end;
+        double v;
+
+        if (!isdigit((unsigned char) s[0]) && s[0] != '.')
+                return -EINVAL;
+
+        errno = 0;
+        v = strtod(s, &end);
+        if (*end != '\0' || !isfinite(v))
+                return -EINVAL;
+        if (errno == ERANGE || v < min || v > max)
+                return -ERANGE;
+
+        *ret = v;
+        return 0;
+}
+
+void latency_estimate_add(LatencyEstimate *e, uint64_t sample_usec) {
+        uint64_t delta;
+
+        if (e->n_samples++ == 0) {
+                e->srtt_usec = sample_usec;
+                e->rttvar_usec = sample_usec / 2;
+                return;
+        }
+
+        delta = sample_usec > e->srtt_usec ? sample_usec - e->srtt_usec : e->srtt_usec - sample_usec;
+
+        /* alpha = 1/8, beta = 1/4 */
+        e->rttvar_usec = (3 * e->rttvar_usec + delta) / 4;
+        e->srtt_usec = (7 * e->srtt_usec + sample_usec) / 8;
+}
+
+/* Called when an operation timed out, so the next one gets longer */
+void latency_estimate_backoff(LatencyEstimate *e, uint64_t max_usec) {
+        if (e->n_samples == 0)
+                return;
+
+        e->srtt_usec = e->srtt_usec * 2 < max_usec ? e->srtt_usec * 2 : max_usec;
+}
+
+/* Without samples this is max_usec, as we know nothing yet */
+uint64_t latency_estimate_timeout(const LatencyEstimate *e, uint64_t min_usec, uint64_t max_usec) {
+        uint64_t timeout;
+
+        if (e->n_samples == 0)
+                return max_usec;
+
+        /* Allow at least twice the usual time, for operations that
+         * always take about as long */
+        timeout = e->srtt_usec + 4 * e->rttvar_usec;
+        if (timeout < 2 * e->srtt_usec)
+                timeout = 2 * e->srtt_usec;
+
+        if (timeout < min_usec)
+                return min_usec;
+        if (timeout > max_usec)
+                return max_usec;
+        return timeout;
+}
+
+static Job *job_new_with_id(Manager *manager, int job_type, size_t job_size, uint32_t id) {
         _cleanup_free_ Job *job = NULL;
         _cleanup_free_ char *object_path = NULL;
-        uint32_t id;
         int r;
 
         job = malloc0(job_size);
         if (job == NULL)
                 return NULL;
 
-        id = ++manager->next_job_id;
         r = asprintf(&object_path, "%s/%d", manager->job_path_prefix, id);
         if (r < 0)
                 return NULL;
@@ -61,6 +146,10 @@ Job *job_new(Manager *manager, int job_type, size_t job_size) {
         return steal_pointer(&job);
 }
 
+Job *job_new(Manager *manager, int job_type, size_t job_size) {
+        return job_new_with_id(manager, job_type, job_size, manager->next_job_id + 1);
+}
+
 Job *job_ref(Job *job) {
         job->ref_count++;
         return job;
@@ -75,6 +164,8 @@ void job_unref(Job *job) {
 
                 if (job->source_message)
                         sd_bus_message_unref (job->source_message);
+                if (job->details)
+                        job->details->free(job->details);
                 free(job->object_path);
                 if (job->bus_slot)
                         sd_bus_slot_unref(job->bus_slot);
@@ -133,6 +224,385 @@ static int manager_send_job_removed_signal(Manager *manager, Job *job) {
         return sd_bus_send(manager->bus, m, NULL);
 }
 
+/* Sends all batched JobRemoved signals as one JobsRemoved, a(uos) */
+int manager_flush_job_removed(Manager *manager) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        uint32_t i;
+        int r;
+
+        if (manager->n_job_removed_batch == 0 || manager->paused)
+                return 0;
+        if (manager->event_credits_enabled && manager->event_credits == 0)
+                return 0; /* Sent once the peer grants more */
+
+        r = sd_bus_message_new_signal(
+                        manager->bus,
+                        &m,
+                        manager->manager_path,
+                        manager->manager_iface,
+                        "JobsRemoved");
+        if (r >= 0)
+                r = sd_bus_message_open_container(m, 'a', "(uos)");
+        for (i = 0; r >= 0 && i < manager->n_job_removed_batch; i++) {
+                JobRemovedEvent *e = &manager->job_removed_batch[i];
+
+                r = sd_bus_message_append(m, "(uos)", e->id, e->object_path, job_result_to_string(e->result));
+        }
+        if (r >= 0)
+                r = sd_bus_message_close_container(m);
+        if (r >= 0)
+                r = sd_bus_send(manager->bus, m, NULL);
+        if (r < 0)
+                return r;
+        if (manager->event_credits_enabled)
+                manager->event_credits--;
+
+        manager_clear_job_removed(manager);
+        return r;
+}
+
+void manager_clear_job_removed(Manager *manager) {
+        uint32_t i;
+
+        for (i = 0; i < manager->n_job_removed_batch; i++)
+                free(manager->job_removed_batch[i].object_path);
+        manager->n_job_removed_batch = 0;
+}
+
+static int job_removed_flush_cb(sd_event_source *s, void *userdata) {
+        Manager *manager = userdata;
+        int r;
+
+        manager->job_removed_flush_source = sd_event_source_unref(manager->job_removed_flush_source);
+
+        r = manager_flush_job_removed(manager);
+        if (r < 0)
+                fprintf(stderr, "Failed to send JobsRemoved signal: %s\n", strerror(-r));
+
+        return 0;
+}
+
+void manager_add_event_credits(Manager *manager, uint32_t n) {
+        int r;
+
+        manager->event_credits += n;
+
+        if (manager->job_removed_flush_source != NULL)
+                return; /* Flushed soon anyway */
+
+        r = manager_flush_job_removed(manager);
+        if (r < 0)
+                fprintf(stderr, "Failed to send JobsRemoved signal: %s\n", strerror(-r));
+}
+
+/* Batches a JobRemoved for a job that may be gone already */
+int manager_queue_job_removed(Manager *manager, uint32_t id, JobResult result) {
+        JobRemovedEvent *e;
+        int r;
+
+        if (manager->n_job_removed_batch == manager->job_removed_batch_size) {
+                uint32_t size = manager->job_removed_batch_size ? manager->job_removed_batch_size * 2 : 16;
+
+                e = realloc(manager->job_removed_batch, size * sizeof(JobRemovedEvent));
+                if (e == NULL)
+                        return -ENOMEM;
+                manager->job_removed_batch = e;
+                manager->job_removed_batch_size = size;
+        }
+
+        e = &manager->job_removed_batch[manager->n_job_removed_batch];
+        if (asprintf(&e->object_path, "%s/%d", manager->job_path_prefix, id) < 0)
+                return -ENOMEM;
+        e->id = id;
+        e->result = result;
+        manager->n_job_removed_batch++;
+
+        if (manager->job_removed_flush_source != NULL)
+                return 0;
+
+        /* Sent once the current callback returns, with whatever else it
+         * queued. Results held back while paused or out of credits go out
+         * in one signal too. */
+        r = sd_event_add_defer(manager->event, &manager->job_removed_flush_source, job_removed_flush_cb, manager);
+        if (r < 0)
+                /* Already queued, so it goes out with a later flush if not now */
+                (void) manager_flush_job_removed(manager);
+
+        return 0;
+}
+
+static void job_history_entry_clear_details(JobHistoryEntry *entry) {
+        if (entry->details) {
+                entry->details->free(entry->details);
+                entry->details = NULL;
+        }
+}
+
+int manager_set_job_history_size(Manager *manager, uint32_t size, uint32_t details_size) {
+        JobHistoryEntry *history = NULL;
+        uint32_t *history_details = NULL;
+        uint32_t i;
+
+        if (size > 0) {
+                history = calloc(size, sizeof(JobHistoryEntry));
+                if (history == NULL)
+                        return -ENOMEM;
+        }
+
+        /* Details can't be kept for jobs that aren't in the history */
+        if (details_size > size)
+                details_size = size;
+
+        if (details_size > 0) {
+                history_details = calloc(details_size, sizeof(uint32_t));
+                if (history_details == NULL) {
+                        free(history);
+                        return -ENOMEM;
+                }
+        }
+
+        for (i = 0; i < manager->history_size; i++)
+                job_history_entry_clear_details(&manager->history[i]);
+        free(manager->history);
+        free(manager->history_details);
+
+        manager->history = history;
+        manager->history_size = size;
+        manager->history_details = history_details;
+        manager->history_details_size = details_size;
+        manager->history_details_next = 0;
+
+        return 0;
+}
+
+static void manager_remember_job_details(Manager *manager, Job *job, JobHistoryEntry *entry) {
+        uint32_t *slot;
+
+        if (job->details == NULL || manager->history_details_size == 0)
+                return;
+
+        /* Drop the details of the oldest job that still has them */
+        slot = &manager->history_details[manager->history_details_next];
+        if (*slot != 0) {
+                JobHistoryEntry *old = &manager->history[*slot % manager->history_size];
+                if (old->id == *slot)
+                        job_history_entry_clear_details(old);
+        }
+
+        *slot = job->id;
+        manager->history_details_next = (manager->history_details_next + 1) % manager->history_details_size;
+
+        entry->details = steal_pointer(&job->details);
+}
+
+static void manager_remember_job(Manager *manager, Job *job) {
+        JobHistoryEntry *entry;
+        struct timespec ts;
+
+        if (manager->history_size == 0)
+                return;
+
+        /* Ids are handed out in order, so this overwrites the job that
+         * finished history_size ids ago */
+        entry = &manager->history[job->id % manager->history_size];
+        job_history_entry_clear_details(entry);
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        entry->id = job->id;
+        entry->type = job->type;
+        entry->result = job->result;
+        entry->finished_usec = (uint64_t)ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / NSEC_PER_USEC;
+
+        manager_remember_job_details(manager, job, entry);
+}
+
+/* Fills in a history entry kept by a previous instance, without details */
+void manager_restore_job_history(Manager *manager, uint32_t id, int type, JobResult result, uint64_t finished_usec) {
+        JobHistoryEntry *entry;
+
+        if (manager->history_size == 0 || id == 0)
+                return;
+
+        entry = &manager->history[id % manager->history_size];
+        job_history_entry_clear_details(entry);
+
+        entry->id = id;
+        entry->type = type;
+        entry->result = result;
+        entry->finished_usec = finished_usec;
+}
+
+const JobHistoryEntry *manager_lookup_job_history(Manager *manager, uint32_t id) {
+        JobHistoryEntry *entry;
+
+        if (manager->history_size == 0 || id == 0)
+                return NULL;
+
+        entry = &manager->history[id % manager->history_size];
+        if (entry->id != id)
+                return NULL;
+
+        return entry;
+}
+
+Job *manager_find_job(Manager *manager, uint32_t id) {
+        Job *job;
+
+        LIST_FOREACH(jobs, job, manager->jobs) {
+                if (job->id == id)
+                        return job;
+        }
+
+        return NULL;
+}
+
+static uint64_t now_usec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / NSEC_PER_USEC;
+}
+
+static uint32_t string_hash(const char *s) {
+        uint32_t h = 2166136261u; /* FNV-1a */
+
+        for (; *s; s++) {
+                h ^= (uint8_t)*s;
+                h *= 16777619u;
+        }
+        return h;
+}
+
+static void idempotency_key_free(IdempotencyKey *k) {
+        free(k->key);
+        free(k->request);
+        free(k);
+}
+
+static void manager_unlink_idempotency_key(Manager *manager, IdempotencyKey *k) {
+        uint32_t b = string_hash(k->key) & (manager->n_idempotency_buckets - 1);
+
+        LIST_REMOVE(bucket, manager->idempotency_buckets[b], k);
+        if (manager->idempotency_oldest == k)
+                manager->idempotency_oldest = k->by_age_prev;
+        LIST_REMOVE(by_age, manager->idempotency_newest, k);
+        manager->n_idempotency_keys--;
+}
+
+static void manager_link_idempotency_key(Manager *manager, IdempotencyKey *k) {
+        uint32_t b = string_hash(k->key) & (manager->n_idempotency_buckets - 1);
+
+        LIST_PREPEND(bucket, manager->idempotency_buckets[b], k);
+        LIST_PREPEND(by_age, manager->idempotency_newest, k);
+        if (manager->idempotency_oldest == NULL)
+                manager->idempotency_oldest = k;
+        manager->n_idempotency_keys++;
+}
+
+static void manager_expire_idempotency_keys(Manager *manager) {
+        uint64_t now = now_usec();
+        IdempotencyKey *k;
+
+        while ((k = manager->idempotency_oldest) != NULL && k->expire_usec <= now) {
+                manager_unlink_idempotency_key(manager, k);
+
+                /* Keep the key alive for as long as its job is, so a retry
+                 * never duplicates a job that is still queued or running */
+                if (manager_find_job(manager, k->job_id) != NULL) {
+                        k->expire_usec = now + manager->idempotency_ttl_usec;
+                        manager_link_idempotency_key(manager, k);
+                        continue;
+                }
+
+                idempotency_key_free(k);
+        }
+}
+
+static int manager_grow_idempotency_buckets(Manager *manager) {
+        uint32_t n_buckets = manager->n_idempotency_buckets ? manager->n_idempotency_buckets * 2 : 64;
+        IdempotencyKey **buckets, *k;
+
+        buckets = calloc(n_buckets, sizeof(IdempotencyKey *));
+        if (buckets == NULL)
+                return -ENOMEM;
+
+        /* Rehash everything, walking the age list so it stays intact */
+        LIST_FOREACH(by_age, k, manager->idempotency_newest) {
+                uint32_t b = string_hash(k->key) & (n_buckets - 1);
+                LIST_PREPEND(bucket, buckets[b], k);
+        }
+
+        free(manager->idempotency_buckets);
+        manager->idempotency_buckets = buckets;
+        manager->n_idempotency_buckets = n_buckets;
+
+        return 0;
+}
+
+/* Returns 0 and the job id if key is known, -ENOENT if it is not, and
+ * -EEXIST if it was used for a different request */
+int manager_lookup_idempotency_key(Manager *manager, const char *key, const char *request, uint32_t *job_id_out) {
+        IdempotencyKey *k;
+        uint32_t b;
+
+        if (manager->n_idempotency_buckets == 0)
+                return -ENOENT;
+
+        manager_expire_idempotency_keys(manager);
+
+        b = string_hash(key) & (manager->n_idempotency_buckets - 1);
+        LIST_FOREACH(bucket, k, manager->idempotency_buckets[b]) {
+                if (strcmp(k->key, key) == 0) {
+                        /* A key expires with its job's history entry, the
+                         * job path would no longer resolve */
+                        if (manager_find_job(manager, k->job_id) == NULL &&
+                            manager_lookup_job_history(manager, k->job_id) == NULL) {
+                                manager_unlink_idempotency_key(manager, k);
+                                idempotency_key_free(k);
+                                return -ENOENT;
+                        }
+                        if (strcmp(k->request, request) != 0)
+                                return -EEXIST;
+                        *job_id_out = k->job_id;
+                        return 0;
+                }
+        }
+
+        return -ENOENT;
+}
+
+int manager_add_idempotency_key(Manager *manager, const char *key, const char *request, uint32_t job_id) {
+        IdempotencyKey *k;
+        int r;
+
+        if (manager->idempotency_ttl_usec == 0)
+                return 0; /* Keys disabled */
+
+        if (manager->n_idempotency_keys >= manager->n_idempotency_buckets) {
+                r = manager_grow_idempotency_buckets(manager);
+                if (r < 0)
+                        return r;
+        }
+
+        k = malloc0(sizeof(IdempotencyKey));
+        if (k == NULL)
+                return -ENOMEM;
+
+        k->key = strdup(key);
+        k->request = strdup(request);
+        if (k->key == NULL || k->request == NULL) {
+                idempotency_key_free(k);
+                return -ENOMEM;
+        }
+        k->job_id = job_id;
+        k->expire_usec = now_usec() + manager->idempotency_ttl_usec;
+
+        manager_link_idempotency_key(manager, k);
+
+        return 0;
+}
+
 /* Only called from mainloop */
 static void try_start_job (Manager *manager) {
         Job *job;
@@ -144,6 +614,10 @@ static void try_start_job (Manager *manager) {
         if (job == NULL)
                 return;
 
+        /* Left waiting, the owner calls manager_retry_admission() later */
+        if (manager->admit_cb && !manager->admit_cb(manager, job))
+                return;
+
         manager->current_job = job_ref(job);
 
         printf ("Started job %d\n", job->id);
@@ -161,8 +635,16 @@ static int finish_job_cb (sd_event_source *s, void *userdata) {
         job = steal_pointer (&manager->current_job);
         assert (job != NULL);
 
-        manager_send_job_removed_signal(manager, job);
+        if (manager->job_removed_cb)
+                manager->job_removed_cb(manager, job);
+
+        if (manager->batch_job_removed) {
+                if (manager_queue_job_removed(manager, job->id, job->result) < 0)
+                        manager_send_job_removed_signal(manager, job);
+        } else
+                manager_send_job_removed_signal(manager, job);
 
+        manager_remember_job(manager, job);
         manager_remove_job(manager, job);
 
         printf("Finished job %d, result: %s\n", job->id, job_result_to_string(job->result));
@@ -215,32 +697,47 @@ static void schedule_job(Manager *manager) {
         }
 }
 
+void manager_retry_admission(Manager *manager) {
+        schedule_job(manager);
+}
+
 static BUS_DEFINE_PROPERTY_GET_ENUM(property_get_type, job_type, JobType);
 static BUS_DEFINE_PROPERTY_GET_ENUM(property_get_state, job_state, JobState);
 
+static int property_get_remaining(sd_bus *bus,
+                                  const char *path,
+                                  const char *interface,
+                                  const char *property,
+                                  sd_bus_message *reply,
+                                  void *userdata,
+                                  sd_bus_error *error) {
+        Job *job = userdata;
+        uint64_t remaining = 0;
+
+        if (job->state == JOB_RUNNING && job->remaining_cb)
+                remaining = job->remaining_cb(job);
+
+        return sd_bus_message_append(reply, "t", remaining);
+}
+
 static const sd_bus_vtable job_vtable[] = {
         SD_BUS_VTABLE_START(0),
         SD_BUS_PROPERTY("JobType", "s", property_get_type, offsetof(Job, type), SD_BUS_VTABLE_PROPERTY_CONST),
         SD_BUS_PROPERTY("State", "s", property_get_state, offsetof(Job, state), SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+        SD_BUS_PROPERTY("EstimatedRemainingUSec", "t", property_get_remaining, 0, 0),
         SD_BUS_VTABLE_END
 };
 
-int manager_queue_job(Manager *manager,
-                      int job_type,
-                      size_t job_size,
-                      sd_bus_message *source_message,
-                      job_start_callback start_cb,
-                      job_cancel_callback cancel_cb,
-                      job_destroy_callback destroy_cb,
-                      Job **job_out) {
-        _cleanup_(job_unrefp) Job *job = NULL;
+static int manager_add_queued_job(Manager *manager,
+                                  Job *job,
+                                  sd_bus_message *source_message,
+                                  job_start_callback start_cb,
+                                  job_cancel_callback cancel_cb,
+                                  job_destroy_callback destroy_cb,
+                                  bool announce,
+                                  Job **job_out) {
         int r;
 
-        job = job_new(manager, job_type, job_size);
-        if (job == NULL) {
-                return -ENOMEM;
-        }
-
         if (source_message)
           job->source_message = sd_bus_message_ref(source_message);
 
@@ -256,14 +753,18 @@ int manager_queue_job(Manager *manager,
                                      job);
         if (r < 0) {
                 fprintf(stderr, "Failed to add job bus vtable: %s\n", strerror(-r));
-                return EXIT_FAILURE;
+                return r;
         }
 
+        if (job->id > manager->next_job_id)
+                manager->next_job_id = job->id;
+
         if (job_out)
                 *job_out = job_ref(job);
 
         manager_add_job(job->manager, job);
-        manager_send_job_new_signal(manager, job);
+        if (announce && !manager->quiet_job_new)
+                manager_send_job_new_signal(manager, job);
 
         printf ("Queued job %d\n", job->id);
 
@@ -271,3 +772,59 @@ int manager_queue_job(Manager *manager,
 
         return 0;
 }
+
+int manager_queue_job(Manager *manager,
+                      int job_type,
+                      size_t job_size,
+                      sd_bus_message *source_message,
+                      job_start_callback start_cb,
+                      job_cancel_callback cancel_cb,
+                      job_destroy_callback destroy_cb,
+                      Job **job_out) {
+        _cleanup_(job_unrefp) Job *job = NULL;
+
+        job = job_new(manager, job_type, job_size);
+        if (job == NULL) {
+                return -ENOMEM;
+        }
+
+        return manager_add_queued_job(manager, job, source_message, start_cb, cancel_cb, destroy_cb,
+                                      true, job_out);
+}
+
+int manager_queue_job_with_id(Manager *manager,
+                              uint32_t id,
+                              int job_type,
+                              size_t job_size,
+                              job_start_callback start_cb,
+                              job_cancel_callback cancel_cb,
+                              job_destroy_callback destroy_cb,
+                              Job **job_out) {
+        _cleanup_(job_unrefp) Job *job = NULL;
+
+        if (id == 0)
+                return -EINVAL;
+        if (manager_find_job(manager, id) != NULL)
+                return -EEXIST;
+
+        job = job_new_with_id(manager, job_type, job_size, id);
+        if (job == NULL)
+                return -ENOMEM;
+
+        return manager_add_queued_job(manager, job, NULL, start_cb, cancel_cb, destroy_cb,
+                                      false, job_out);
+}
+
+void manager_unqueue_job(Manager *manager, Job *job) {
+        assert(job->state == JOB_WAITING && job != manager->current_job);
+
+        /* Whoever saw it appear sees it go */
+        if (!manager->quiet_job_new) {
+                job->result = JOB_CANCELED;
+                (void) manager_send_job_removed_signal(manager, job);
+        }
+
+        printf("Unqueued job %d\n", job->id);
+
+        manager_remove_job(manager, job);
+}
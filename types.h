@@ -7,12 +7,14 @@ typedef enum JobResult JobResult;
 
 enum JobType {
         JOB_ISOLATE_ALL,
+        JOB_PREPARE_ALL,
         _JOB_TYPE_MAX,
         _JOB_TYPE_INVALID = -1
 };
 
 enum NodeJobType {
         NODE_JOB_ISOLATE,
+        NODE_JOB_PREPARE,
         _NODE_JOB_TYPE_MAX,
         _NODE_JOB_TYPE_INVALID = -1
 };
@@ -37,23 +39,57 @@ extern const char *node_job_type_to_string(NodeJobType type);
 extern const char *job_state_to_string(JobState state);
 extern const char *job_result_to_string(JobResult result);
 
+/* Parse all of s as a decimal number within [min, max], -ERANGE outside
+ * of it and -EINVAL for anything else */
+extern int parse_uint64(const char *s, uint64_t min, uint64_t max, uint64_t *ret);
+extern int parse_double(const char *s, double min, double max, double *ret);
+
+
+typedef struct LatencyEstimate LatencyEstimate;
+
+/* Smoothed latency and its variation, as used for TCP retransmission
+ * timeouts (RFC 6298) */
+struct LatencyEstimate {
+        uint64_t srtt_usec;
+        uint64_t rttvar_usec;
+        uint32_t n_samples;
+};
+
+extern void latency_estimate_add(LatencyEstimate *e, uint64_t sample_usec);
+extern void latency_estimate_backoff(LatencyEstimate *e, uint64_t max_usec);
+extern uint64_t latency_estimate_timeout(const LatencyEstimate *e, uint64_t min_usec, uint64_t max_usec);
+
 
 typedef struct Manager Manager;
 typedef struct Job Job;
 typedef struct JobTracker JobTracker;
+typedef struct JobHistoryEntry JobHistoryEntry;
+typedef struct IdempotencyKey IdempotencyKey;
+typedef struct JobDetails JobDetails;
+typedef struct JobRemovedEvent JobRemovedEvent;
 
 typedef void (*job_tracker_callback)(sd_bus_message *m, const char *result, void *userdata);
+typedef void (*job_hold_callback)(bool held, const char *reason, void *userdata);
 
 struct JobTracker {
         const char *object_path;
+        const char *unit;        /* its state tells how the job went if we miss JobRemoved */
         job_tracker_callback callback;
+        job_hold_callback hold_callback; /* optional, remote job held back or admitted */
         void *userdata;
         LIST_FIELDS(JobTracker, trackers);
 };
 
+/* Type specific results of a job that can outlive the job itself */
+struct JobDetails {
+        int (*append)(JobDetails *details, sd_bus_message *reply);
+        void (*free)(JobDetails *details);
+};
+
 typedef int (*job_start_callback)(Job *job);
 typedef int (*job_cancel_callback)(Job *job);
 typedef void (*job_destroy_callback)(Job *job);
+typedef uint64_t (*job_remaining_callback)(Job *job);
 
 struct Job {
         int ref_count;
@@ -66,14 +102,41 @@ struct Job {
         char *object_path;
 
         sd_bus_message *source_message;
+        JobDetails *details;
 
         job_start_callback start_cb;
         job_cancel_callback cancel_cb;
         job_destroy_callback destroy_cb;
+        job_remaining_callback remaining_cb; /* optional, estimated usec left */
 
         LIST_FIELDS(Job, jobs);
 };
 
+/* Compact record of a finished job, kept after the job object is gone */
+struct JobHistoryEntry {
+        uint32_t id;              /* 0 if the slot is unused */
+        int8_t type;
+        int8_t result;
+        uint64_t finished_usec;   /* CLOCK_REALTIME */
+        JobDetails *details;      /* only kept for the most recent jobs */
+};
+
+/* A JobRemoved signal waiting to go out in a JobsRemoved batch */
+struct JobRemovedEvent {
+        uint32_t id;
+        int8_t result;
+        char *object_path;
+};
+
+struct IdempotencyKey {
+        char *key;
+        char *request;            /* what was submitted under this key */
+        uint32_t job_id;
+        uint64_t expire_usec;     /* CLOCK_MONOTONIC */
+        LIST_FIELDS(IdempotencyKey, bucket);
+        LIST_FIELDS(IdempotencyKey, by_age);
+};
+
 struct Manager {
         sd_event *event;
         sd_bus *bus;           /* system bus for orchestrator, peer bus for node */
@@ -81,10 +144,46 @@ struct Manager {
         char *job_path_prefix;
         char *manager_path;
         char *manager_iface;
+        bool quiet_job_new;    /* the peer doesn't want JobNew signals */
+
+        /* With batch_job_removed, JobRemoved signals queued by one event
+         * loop callback go out after it as one JobsRemoved */
+        bool batch_job_removed;
+        JobRemovedEvent *job_removed_batch;
+        uint32_t n_job_removed_batch;
+        uint32_t job_removed_batch_size;
+        sd_event_source *job_removed_flush_source;
+        /* If enabled, each JobsRemoved takes one of these credits the
+         * peer grants, without any the batch waits */
+        bool event_credits_enabled;
+        uint32_t event_credits;
+        bool paused;           /* the batch waits, the peer connection is being handed off */
 
         Job *current_job;
         sd_event_source *job_source;
         LIST_HEAD(Job, jobs);
+
+        /* Optional, the first queued job only starts once this returns true */
+        bool (*admit_cb)(Manager *manager, Job *job);
+        /* Optional, told about each finished job before its JobRemoved goes out */
+        void (*job_removed_cb)(Manager *manager, Job *job);
+
+        /* Ring of finished jobs, indexed by id % history_size */
+        JobHistoryEntry *history;
+        uint32_t history_size;
+        /* Ids of the history entries holding details, oldest at details_next */
+        uint32_t *history_details;
+        uint32_t history_details_size;
+        uint32_t history_details_next;
+
+        /* Idempotency keys of submitted jobs, hashed by key. All keys
+         * have the same ttl, so by_age is also expiry order. */
+        IdempotencyKey **idempotency_buckets;
+        uint32_t n_idempotency_buckets;
+        uint32_t n_idempotency_keys;
+        uint64_t idempotency_ttl_usec;
+        LIST_HEAD(IdempotencyKey, idempotency_newest);
+        IdempotencyKey *idempotency_oldest;
 };
 
 
@@ -94,6 +193,17 @@ extern void job_unref(Job *job);
 _SD_DEFINE_POINTER_CLEANUP_FUNC(Job, job_unref);
 
 void manager_finish_job(Manager *manager, Job *job);
+void manager_retry_admission(Manager *manager);
+int manager_flush_job_removed(Manager *manager);
+int manager_queue_job_removed(Manager *manager, uint32_t id, JobResult result);
+void manager_clear_job_removed(Manager *manager);
+void manager_add_event_credits(Manager *manager, uint32_t n);
+int manager_set_job_history_size(Manager *manager, uint32_t size, uint32_t details_size);
+void manager_restore_job_history(Manager *manager, uint32_t id, int type, JobResult result, uint64_t finished_usec);
+const JobHistoryEntry *manager_lookup_job_history(Manager *manager, uint32_t id);
+Job *manager_find_job(Manager *manager, uint32_t id);
+int manager_lookup_idempotency_key(Manager *manager, const char *key, const char *request, uint32_t *job_id_out);
+int manager_add_idempotency_key(Manager *manager, const char *key, const char *request, uint32_t job_id);
 int manager_queue_job(Manager *manager,
                       int job_type,
                       size_t job_size,
@@ -102,3 +212,15 @@ int manager_queue_job(Manager *manager,
                       job_cancel_callback cancel_cb,
                       job_destroy_callback destroy_cb,
                       Job **job_out);
+/* Queues a job passed on from another instance under the id it had
+ * there. The peer knows it already, so no JobNew. */
+int manager_queue_job_with_id(Manager *manager,
+                              uint32_t id,
+                              int job_type,
+                              size_t job_size,
+                              job_start_callback start_cb,
+                              job_cancel_callback cancel_cb,
+                              job_destroy_callback destroy_cb,
+                              Job **job_out);
+/* Takes back a job that is still waiting, it never runs */
+void manager_unqueue_job(Manager *manager, Job *job);